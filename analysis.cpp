@@ -0,0 +1,741 @@
+/**
+ * @file
+ * Analysis taps of a run.
+ *
+ * The loudness is measured after EBU R128 / ITU-R BS.1770: the samples
+ * are K-weighted, their mean squares taken per 100 ms and combined into
+ * the gated 400 ms blocks of the integrated loudness and the 3 s windows
+ * of the loudness range. The true peak is the largest sample of the
+ * signal oversampled four times. The waveform is written in the binary
+ * format of audiowaveform, version 1 with 16 bit points, or as its JSON
+ * equivalent, as read by waveform players like peaks.js.
+ */
+
+#include "analysis.h"
+
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QSaveFile>
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <cstring>
+
+extern "C" {
+    #include "libavutil/channel_layout.h"
+    #include "libavutil/cpu.h"
+    #include "libavutil/samplefmt.h"
+}
+
+#if defined(__x86_64__) || defined(_M_X64)
+#include <immintrin.h>
+#define ANALYSIS_X86 1
+#endif
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define ANALYSIS_NEON 1
+#endif
+
+/* Samples of the chunk before kept for the true peak interpolator. */
+static const int history = ANALYSIS_PHASE_TAPS - 1;
+/* Gates of the integrated loudness and the loudness range, in LUFS
+ * and LU. */
+static const double absoluteGate   = -70.0;
+static const double integratedGate = -10.0;
+static const double rangeGate      = -20.0;
+/* Weight of the surround channels in the loudness. */
+static const double surroundWeight = 1.41;
+
+static void minMaxScalar(const float *input, int samples,
+                         float *minimum, float *maximum)
+{
+    float low = *minimum, high = *maximum;
+
+    for (int i = 0; i < samples; i++) {
+        low  = input[i] < low ? input[i] : low;
+        high = input[i] > high ? input[i] : high;
+    }
+    *minimum = low;
+    *maximum = high;
+}
+
+static float truePeakScalar(const float *input, int samples,
+                            const float *taps, float peak)
+{
+    for (int i = 0; i < samples; i++) {
+        for (int p = 0; p < ANALYSIS_OVERSAMPLING; p++) {
+            float sum = 0.0f;
+
+            for (int k = 0; k < ANALYSIS_PHASE_TAPS; k++)
+                sum += taps[k * ANALYSIS_OVERSAMPLING + p] * input[i - k];
+            peak = FFMAX(peak, fabsf(sum));
+        }
+    }
+    return peak;
+}
+
+#ifdef ANALYSIS_X86
+#if defined(__GNUC__)
+__attribute__((target("avx2")))
+#endif
+static void minMaxAvx2(const float *input, int samples,
+                       float *minimum, float *maximum)
+{
+    __m256 low  = _mm256_set1_ps(*minimum);
+    __m256 high = _mm256_set1_ps(*maximum);
+    float lows[8], highs[8];
+    int i = 0;
+
+    for (; i + 8 <= samples; i += 8) {
+        const __m256 x = _mm256_loadu_ps(input + i);
+
+        low  = _mm256_min_ps(low, x);
+        high = _mm256_max_ps(high, x);
+    }
+    _mm256_storeu_ps(lows, low);
+    _mm256_storeu_ps(highs, high);
+    for (int k = 0; k < 8; k++) {
+        *minimum = FFMIN(*minimum, lows[k]);
+        *maximum = FFMAX(*maximum, highs[k]);
+    }
+    minMaxScalar(input + i, samples - i, minimum, maximum);
+}
+
+/* Two input samples at a time, each lane holding one of their phases. */
+#if defined(__GNUC__)
+__attribute__((target("avx2,fma")))
+#endif
+static float truePeakAvx2(const float *input, int samples,
+                          const float *taps, float peak)
+{
+    const __m256 sign = _mm256_set1_ps(-0.0f);
+    __m256 coefficients[ANALYSIS_PHASE_TAPS];
+    __m256 peaks = _mm256_set1_ps(peak);
+    float lanes[8];
+    int i = 0;
+
+    for (int k = 0; k < ANALYSIS_PHASE_TAPS; k++)
+        coefficients[k] = _mm256_broadcast_ps((const __m128 *)(taps + k * 4));
+    for (; i + 2 <= samples; i += 2) {
+        __m256 sum = _mm256_setzero_ps();
+
+        for (int k = 0; k < ANALYSIS_PHASE_TAPS; k++) {
+            const __m256 x = _mm256_insertf128_ps(
+                _mm256_castps128_ps256(_mm_set1_ps(input[i - k])),
+                _mm_set1_ps(input[i + 1 - k]), 1);
+
+            sum = _mm256_fmadd_ps(coefficients[k], x, sum);
+        }
+        peaks = _mm256_max_ps(peaks, _mm256_andnot_ps(sign, sum));
+    }
+    _mm256_storeu_ps(lanes, peaks);
+    for (int k = 0; k < 8; k++)
+        peak = FFMAX(peak, lanes[k]);
+    return truePeakScalar(input + i, samples - i, taps, peak);
+}
+#endif
+
+#ifdef ANALYSIS_NEON
+static void minMaxNeon(const float *input, int samples,
+                       float *minimum, float *maximum)
+{
+    float32x4_t low  = vdupq_n_f32(*minimum);
+    float32x4_t high = vdupq_n_f32(*maximum);
+    float lows[4], highs[4];
+    int i = 0;
+
+    for (; i + 4 <= samples; i += 4) {
+        const float32x4_t x = vld1q_f32(input + i);
+
+        low  = vminq_f32(low, x);
+        high = vmaxq_f32(high, x);
+    }
+    vst1q_f32(lows, low);
+    vst1q_f32(highs, high);
+    for (int k = 0; k < 4; k++) {
+        *minimum = FFMIN(*minimum, lows[k]);
+        *maximum = FFMAX(*maximum, highs[k]);
+    }
+    minMaxScalar(input + i, samples - i, minimum, maximum);
+}
+
+/* One input sample at a time, each lane holding one of its phases. */
+static float truePeakNeon(const float *input, int samples,
+                          const float *taps, float peak)
+{
+    float32x4_t coefficients[ANALYSIS_PHASE_TAPS];
+    float32x4_t peaks = vdupq_n_f32(peak);
+    float lanes[4];
+
+    for (int k = 0; k < ANALYSIS_PHASE_TAPS; k++)
+        coefficients[k] = vld1q_f32(taps + k * 4);
+    for (int i = 0; i < samples; i++) {
+        float32x4_t sum = vdupq_n_f32(0.0f);
+
+        for (int k = 0; k < ANALYSIS_PHASE_TAPS; k++)
+            sum = vmlaq_n_f32(sum, coefficients[k], input[i - k]);
+        peaks = vmaxq_f32(peaks, vabsq_f32(sum));
+    }
+    vst1q_f32(lanes, peaks);
+    for (int k = 0; k < 4; k++)
+        peak = FFMAX(peak, lanes[k]);
+    return peak;
+}
+#endif
+
+/* Loudness in LUFS of a weighted mean square. */
+static double loudness(double meanSquare)
+{
+    return -0.691 + 10.0 * log10(meanSquare);
+}
+
+/* Level in dB, rounded to 1/100 dB, or null for silence. */
+static QJsonValue level(double value)
+{
+    if (!std::isfinite(value))
+        return QJsonValue(QJsonValue::Null);
+    return QJsonValue(std::round(value * 100.0) / 100.0);
+}
+
+/**
+ * Mean squares of the windows of a number of 100 ms quarters, moving by
+ * one quarter at a time.
+ * @param quarters Mean squares of the quarters
+ * @param length   Number of quarters per window
+ * @return Mean square of every complete window
+ */
+static std::vector<double> windows(const std::vector<double> &quarters,
+                                   size_t length)
+{
+    std::vector<double> result;
+    double sum = 0.0;
+
+    for (size_t i = 0; i < quarters.size(); i++) {
+        sum += quarters[i];
+        if (i >= length)
+            sum -= quarters[i - length];
+        if (i + 1 >= length)
+            result.push_back(FFMAX(sum, 0.0) / length);
+    }
+    return result;
+}
+
+/**
+ * Gate blocks, first above the absolute gate, then above their mean
+ * lowered by a relative gate.
+ * @param      blocks   Mean squares of the blocks
+ * @param      relative Relative gate in LU
+ * @param[out] kept     Loudness of every block passing both gates, or
+ *                      nullptr
+ * @return Mean square of the blocks passing both gates (0 if none)
+ */
+static double gate(const std::vector<double> &blocks, double relative,
+                   std::vector<double> *kept)
+{
+    const double absolute = pow(10.0, (absoluteGate + 0.691) / 10.0);
+    double sum = 0.0, threshold;
+    int count = 0;
+
+    for (double block : blocks)
+        if (block > absolute) {
+            sum += block;
+            count++;
+        }
+    if (!count)
+        return 0.0;
+    threshold = sum / count * pow(10.0, relative / 10.0);
+
+    sum   = 0.0;
+    count = 0;
+    for (double block : blocks)
+        if (block > absolute && block > threshold) {
+            sum += block;
+            count++;
+            if (kept)
+                kept->push_back(loudness(block));
+        }
+    return count ? sum / count : 0.0;
+}
+
+/* Point of a waveform, in 16 bit full scale. */
+static int16_t waveformSample(float value)
+{
+    return (int16_t)lrintf(FFMAX(FFMIN(value, 1.0f), -1.0f) * 32767.0f);
+}
+
+static void appendLittleEndian(QByteArray *data, uint32_t value, int bytes)
+{
+    for (int i = 0; i < bytes; i++)
+        data->append((char)((value >> (8 * i)) & 0xff));
+}
+
+/**
+ * Set up the taps for the frames of an encoder.
+ * @param options      Measurements to be taken
+ * @param codecContext Encoder whose frames are analysed
+ */
+AudioAnalyzer::AudioAnalyzer(const AnalysisOptions &options,
+                             const AVCodecContext *codecContext)
+    : options(options), sampleRate(codecContext->sample_rate),
+      channels(codecContext->channels), format(codecContext->sample_fmt),
+      minMax(minMaxScalar), truePeakKernel(truePeakScalar), position(0),
+      quarterFill(0), quarterEnergy(0.0), samplePeak(0.0f), truePeak(0.0f),
+      pointFill(0), pointMinimum(FLT_MAX), pointMaximum(-FLT_MAX),
+      blockFill(0), blockPeak(0.0f), silenceStart(-1)
+{
+    const uint64_t layout = codecContext->channel_layout ?
+                            codecContext->channel_layout :
+                            (uint64_t)av_get_default_channel_layout(channels);
+    const int flags = av_get_cpu_flags();
+    double K, Vh, Vb, a0;
+
+    planes.assign(channels, std::vector<float>(history + ANALYSIS_CHUNK, 0.0f));
+    filterState.assign(channels * 4, 0.0);
+    quarterSamples = FFMAX(sampleRate / 10, 1);
+    blockSamples   = FFMAX(sampleRate / 100, 1);
+    this->options.waveformZoom = FFMAX(options.waveformZoom, 1);
+    silenceLevel   = (float)pow(10.0, options.silenceThreshold / 20.0);
+    minimumSilence = (int64_t)(options.silenceDuration * sampleRate);
+
+    /* The LFE channel is not measured, the surround channels weigh more. */
+    for (int c = 0; c < channels; c++) {
+        const uint64_t channel = av_channel_layout_extract_channel(layout, c);
+
+        if (channel == AV_CH_LOW_FREQUENCY)
+            weights.push_back(0.0);
+        else if (channel & (AV_CH_BACK_LEFT | AV_CH_BACK_RIGHT |
+                            AV_CH_SIDE_LEFT | AV_CH_SIDE_RIGHT))
+            weights.push_back(surroundWeight);
+        else
+            weights.push_back(1.0);
+    }
+
+    /* K-weighting for the sample rate: a high shelf modelling the head,
+     * then a high-pass, both as b0, b1, b2, a1, a2. */
+    K  = tan(M_PI * 1681.974450955533 / sampleRate);
+    Vh = pow(10.0, 3.999843853973347 / 20.0);
+    Vb = pow(Vh, 0.4996667741545416);
+    a0 = 1.0 + K / 0.7071752369554196 + K * K;
+    shelf[0] = (Vh + Vb * K / 0.7071752369554196 + K * K) / a0;
+    shelf[1] = 2.0 * (K * K - Vh) / a0;
+    shelf[2] = (Vh - Vb * K / 0.7071752369554196 + K * K) / a0;
+    shelf[3] = 2.0 * (K * K - 1.0) / a0;
+    shelf[4] = (1.0 - K / 0.7071752369554196 + K * K) / a0;
+    K  = tan(M_PI * 38.13547087602444 / sampleRate);
+    a0 = 1.0 + K / 0.5003270373238773 + K * K;
+    highPass[0] = 1.0;
+    highPass[1] = -2.0;
+    highPass[2] = 1.0;
+    highPass[3] = 2.0 * (K * K - 1.0) / a0;
+    highPass[4] = (1.0 - K / 0.5003270373238773 + K * K) / a0;
+
+    /* Hann windowed sinc interpolator, split into its phases. Phase 0
+     * passes the input samples through, delayed by half the taps. */
+    for (int p = 0; p < ANALYSIS_OVERSAMPLING; p++) {
+        const int centre = ANALYSIS_PHASE_TAPS * ANALYSIS_OVERSAMPLING / 2;
+        double sum = 0.0;
+
+        for (int k = 0; k < ANALYSIS_PHASE_TAPS; k++) {
+            const int t    = k * ANALYSIS_OVERSAMPLING + p;
+            const double x = (double)(t - centre) / ANALYSIS_OVERSAMPLING;
+            const double h = (t == centre ? 1.0 : sin(M_PI * x) / (M_PI * x)) *
+                             0.5 * (1.0 + cos(M_PI * (t - centre) / (centre + 1)));
+
+            taps[t] = (float)h;
+            sum    += h;
+        }
+        for (int k = 0; k < ANALYSIS_PHASE_TAPS; k++)
+            taps[k * ANALYSIS_OVERSAMPLING + p] /= (float)sum;
+    }
+
+#ifdef ANALYSIS_X86
+    if (flags & AV_CPU_FLAG_AVX2)
+        minMax = minMaxAvx2;
+    if ((flags & AV_CPU_FLAG_AVX2) && (flags & AV_CPU_FLAG_FMA3))
+        truePeakKernel = truePeakAvx2;
+#endif
+#ifdef ANALYSIS_NEON
+    if (flags & AV_CPU_FLAG_NEON) {
+        minMax         = minMaxNeon;
+        truePeakKernel = truePeakNeon;
+    }
+#endif
+    (void)flags;
+}
+
+/**
+ * Analyse a number of samples.
+ * @param data    Samples in the encoder's sample format and layout
+ * @param samples Number of samples per channel
+ */
+void AudioAnalyzer::process(const uint8_t *const *data, int samples)
+{
+    for (int offset = 0; offset < samples; offset += ANALYSIS_CHUNK) {
+        const int count = FFMIN(samples - offset, ANALYSIS_CHUNK);
+
+        convert(data, offset, count);
+        if (options.loudness) {
+            measureLoudness(count);
+            measurePeaks(count);
+        }
+        if (options.waveform)
+            measureWaveform(count);
+        if (options.silence)
+            detectSilence(count);
+        position += count;
+
+        /* Keep the end of the chunk for the interpolator. */
+        for (int c = 0; c < channels; c++)
+            memmove(planes[c].data(), planes[c].data() + count,
+                    history * sizeof(float));
+    }
+}
+
+/**
+ * Convert samples to float planar.
+ * @param data    Samples in the encoder's sample format
+ * @param offset  First sample per channel to be converted
+ * @param samples Number of samples per channel
+ */
+void AudioAnalyzer::convert(const uint8_t *const *data, int offset, int samples)
+{
+    const bool planar = av_sample_fmt_is_planar(format);
+    const int stride  = planar ? 1 : channels;
+
+    for (int c = 0; c < channels; c++) {
+        const uint8_t *plane = data[planar ? c : 0];
+        const int first      = offset * stride + (planar ? 0 : c);
+        float *output        = planes[c].data() + history;
+
+        switch (av_get_packed_sample_fmt(format)) {
+        case AV_SAMPLE_FMT_U8:
+            for (int i = 0; i < samples; i++)
+                output[i] = (plane[first + i * stride] - 128) * (1.0f / 128);
+            break;
+        case AV_SAMPLE_FMT_S16:
+            for (int i = 0; i < samples; i++)
+                output[i] = ((const int16_t *)plane)[first + i * stride] *
+                            (1.0f / 32768);
+            break;
+        case AV_SAMPLE_FMT_S32:
+            for (int i = 0; i < samples; i++)
+                output[i] = ((const int32_t *)plane)[first + i * stride] *
+                            (1.0f / 2147483648.0f);
+            break;
+        case AV_SAMPLE_FMT_S64:
+            for (int i = 0; i < samples; i++)
+                output[i] = (float)(((const int64_t *)plane)[first + i * stride] *
+                                    (1.0 / 9223372036854775808.0));
+            break;
+        case AV_SAMPLE_FMT_FLT:
+            if (planar) {
+                memcpy(output, (const float *)plane + first, samples * sizeof(float));
+                break;
+            }
+            for (int i = 0; i < samples; i++)
+                output[i] = ((const float *)plane)[first + i * stride];
+            break;
+        case AV_SAMPLE_FMT_DBL:
+            for (int i = 0; i < samples; i++)
+                output[i] = (float)((const double *)plane)[first + i * stride];
+            break;
+        default:
+            memset(output, 0, samples * sizeof(float));
+            break;
+        }
+    }
+}
+
+/**
+ * K-weight the converted samples and sum up their squares per 100 ms.
+ * @param samples Number of samples per channel
+ */
+void AudioAnalyzer::measureLoudness(int samples)
+{
+    int done = 0;
+
+    while (done < samples) {
+        const int count = FFMIN(samples - done, quarterSamples - quarterFill);
+
+        for (int c = 0; c < channels; c++) {
+            const float *input = planes[c].data() + history + done;
+            double *state      = &filterState[c * 4];
+            double s0 = state[0], s1 = state[1], s2 = state[2], s3 = state[3];
+            double sum = 0.0;
+
+            if (weights[c] == 0.0)
+                continue;
+            for (int i = 0; i < count; i++) {
+                const double x = input[i];
+                const double y = shelf[0] * x + s0;
+                double z;
+
+                s0 = shelf[1] * x - shelf[3] * y + s1;
+                s1 = shelf[2] * x - shelf[4] * y;
+                z  = highPass[0] * y + s2;
+                s2 = highPass[1] * y - highPass[3] * z + s3;
+                s3 = highPass[2] * y - highPass[4] * z;
+                sum += z * z;
+            }
+            state[0] = s0;
+            state[1] = s1;
+            state[2] = s2;
+            state[3] = s3;
+            quarterEnergy += weights[c] * sum;
+        }
+        quarterFill += count;
+        done        += count;
+        if (quarterFill == quarterSamples) {
+            quarters.push_back(quarterEnergy / quarterSamples);
+            quarterFill   = 0;
+            quarterEnergy = 0.0;
+        }
+    }
+}
+
+/**
+ * Take the sample and the true peak of the converted samples.
+ * @param samples Number of samples per channel
+ */
+void AudioAnalyzer::measurePeaks(int samples)
+{
+    for (int c = 0; c < channels; c++) {
+        const float *input = planes[c].data() + history;
+        float minimum = 0.0f, maximum = 0.0f;
+
+        minMax(input, samples, &minimum, &maximum);
+        samplePeak = FFMAX(samplePeak, FFMAX(-minimum, maximum));
+        /* High sample rates are close enough to the true peak already. */
+        if (sampleRate < 96000)
+            truePeak = truePeakKernel(input, samples, taps, truePeak);
+    }
+}
+
+/**
+ * Take the minimum and maximum of all channels per waveform point.
+ * @param samples Number of samples per channel
+ */
+void AudioAnalyzer::measureWaveform(int samples)
+{
+    int done = 0;
+
+    while (done < samples) {
+        const int count = FFMIN(samples - done, options.waveformZoom - pointFill);
+
+        for (int c = 0; c < channels; c++)
+            minMax(planes[c].data() + history + done, count,
+                   &pointMinimum, &pointMaximum);
+        pointFill += count;
+        done      += count;
+        if (pointFill == options.waveformZoom)
+            endWaveformPoint();
+    }
+}
+
+void AudioAnalyzer::endWaveformPoint()
+{
+    points.push_back(waveformSample(pointMinimum));
+    points.push_back(waveformSample(pointMaximum));
+    pointFill    = 0;
+    pointMinimum = FLT_MAX;
+    pointMaximum = -FLT_MAX;
+}
+
+/**
+ * Take the peak of all channels per block of 10 ms.
+ * @param samples Number of samples per channel
+ */
+void AudioAnalyzer::detectSilence(int samples)
+{
+    int done = 0;
+
+    while (done < samples) {
+        const int count = FFMIN(samples - done, blockSamples - blockFill);
+
+        for (int c = 0; c < channels; c++) {
+            float minimum = 0.0f, maximum = 0.0f;
+
+            minMax(planes[c].data() + history + done, count, &minimum, &maximum);
+            blockPeak = FFMAX(blockPeak, FFMAX(-minimum, maximum));
+        }
+        blockFill += count;
+        done      += count;
+        if (blockFill == blockSamples)
+            endSilenceBlock(position + done);
+    }
+}
+
+/**
+ * Extend or end the current silence by a block.
+ * @param end Sample position the block ends at
+ */
+void AudioAnalyzer::endSilenceBlock(int64_t end)
+{
+    const int64_t start = end - blockFill;
+
+    if (blockPeak < silenceLevel) {
+        if (silenceStart < 0)
+            silenceStart = start;
+    } else if (silenceStart >= 0) {
+        if (start - silenceStart >= minimumSilence)
+            silences.append(qMakePair(silenceStart, start));
+        silenceStart = -1;
+    }
+    blockFill = 0;
+    blockPeak = 0.0f;
+}
+
+/**
+ * Integrated loudness of the samples analysed so far.
+ * @return Loudness in LUFS (-infinity for silence)
+ */
+double AudioAnalyzer::integratedLoudness() const
+{
+    return loudness(gate(windows(quarters, 4), integratedGate, nullptr));
+}
+
+/**
+ * True peak of the samples analysed so far.
+ * @return Level in dBTP (-infinity for silence)
+ */
+double AudioAnalyzer::truePeakLevel() const
+{
+    return 20.0 * log10(FFMAX(truePeak, samplePeak));
+}
+
+/**
+ * Complete the measurements at the end of the run and write them next
+ * to the output.
+ * @param outputPath Path of the output file
+ * @return true if every file was written
+ */
+bool AudioAnalyzer::write(const QString &outputPath)
+{
+    if (options.waveform && pointFill > 0)
+        endWaveformPoint();
+    if (options.silence) {
+        if (blockFill > 0)
+            endSilenceBlock(position);
+        if (silenceStart >= 0 && position - silenceStart >= minimumSilence)
+            silences.append(qMakePair(silenceStart, position));
+        silenceStart = -1;
+    }
+
+    if ((options.loudness || options.silence) &&
+        !writeReport(outputPath + ANALYSIS_SUFFIX))
+        return false;
+    if (options.waveform &&
+        !writeWaveform(outputPath + (options.waveformJson ? WAVEFORM_JSON_SUFFIX :
+                                                            WAVEFORM_SUFFIX)))
+        return false;
+    return true;
+}
+
+/**
+ * Write the loudness and the silences as JSON.
+ * @param path File to be written
+ * @return true if successful
+ */
+bool AudioAnalyzer::writeReport(const QString &path) const
+{
+    QSaveFile file(path);
+    QJsonObject object;
+
+    object.insert("sample_rate", sampleRate);
+    object.insert("channels", channels);
+    object.insert("duration", (double)position / sampleRate);
+
+    if (options.loudness) {
+        const std::vector<double> momentary = windows(quarters, 4);
+        const std::vector<double> shortTerm = windows(quarters, 30);
+        std::vector<double> ranged;
+        QJsonObject measured;
+        double range = 0.0;
+
+        gate(shortTerm, rangeGate, &ranged);
+        std::sort(ranged.begin(), ranged.end());
+        if (ranged.size() > 1)
+            range = ranged[lrint((ranged.size() - 1) * 0.95)] -
+                    ranged[lrint((ranged.size() - 1) * 0.10)];
+
+        measured.insert("integrated", level(integratedLoudness()));
+        measured.insert("range", level(range));
+        measured.insert("momentary_max", level(momentary.empty() ? -INFINITY :
+            loudness(*std::max_element(momentary.begin(), momentary.end()))));
+        measured.insert("short_term_max", level(shortTerm.empty() ? -INFINITY :
+            loudness(*std::max_element(shortTerm.begin(), shortTerm.end()))));
+        measured.insert("true_peak", level(truePeakLevel()));
+        measured.insert("sample_peak", level(20.0 * log10(samplePeak)));
+        object.insert("loudness", measured);
+    }
+
+    if (options.silence) {
+        QJsonArray ranges;
+
+        for (const QPair<int64_t, int64_t> &silence : silences) {
+            QJsonObject range;
+
+            range.insert("start", (double)silence.first / sampleRate);
+            range.insert("end", (double)silence.second / sampleRate);
+            ranges.append(range);
+        }
+        object.insert("silences", ranges);
+    }
+
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate) ||
+        file.write(QJsonDocument(object).toJson()) < 0 ||
+        !file.commit()) {
+        fprintf(stderr, "Could not write analysis '%s'\n",
+                path.toLocal8Bit().constData());
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Write the waveform points.
+ * @param path File to be written
+ * @return true if successful
+ */
+bool AudioAnalyzer::writeWaveform(const QString &path) const
+{
+    const uint32_t length = (uint32_t)(points.size() / 2);
+    QSaveFile file(path);
+    QByteArray data;
+
+    if (options.waveformJson) {
+        QJsonObject object;
+        QJsonArray values;
+
+        for (int16_t point : points)
+            values.append((int)point);
+        object.insert("version", 2);
+        object.insert("channels", 1);
+        object.insert("sample_rate", sampleRate);
+        object.insert("samples_per_pixel", options.waveformZoom);
+        object.insert("bits", 16);
+        object.insert("length", (int)length);
+        object.insert("data", values);
+        data = QJsonDocument(object).toJson(QJsonDocument::Compact);
+    } else {
+        /* Version, flags (16 bit points), sample rate, samples per
+         * point and number of points, then the points. */
+        appendLittleEndian(&data, 1, 4);
+        appendLittleEndian(&data, 0, 4);
+        appendLittleEndian(&data, sampleRate, 4);
+        appendLittleEndian(&data, options.waveformZoom, 4);
+        appendLittleEndian(&data, length, 4);
+        for (int16_t point : points)
+            appendLittleEndian(&data, (uint16_t)point, 2);
+    }
+
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate) ||
+        file.write(data) < 0 || !file.commit()) {
+        fprintf(stderr, "Could not write waveform '%s'\n",
+                path.toLocal8Bit().constData());
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,149 @@
+#ifndef ANALYSIS_H
+#define ANALYSIS_H
+
+#include <QList>
+#include <QPair>
+#include <QString>
+
+#include <cstdint>
+#include <vector>
+
+#ifdef __cplusplus
+extern "C" {
+    #include "libavcodec/avcodec.h"
+    #include "libavutil/frame.h"
+}
+#endif
+
+/* Samples per channel converted to float and analysed at a time */
+#define ANALYSIS_CHUNK 1024
+/* Oversampling factor of the true peak measurement */
+#define ANALYSIS_OVERSAMPLING 4
+/* Taps of every phase of the true peak interpolator */
+#define ANALYSIS_PHASE_TAPS 12
+/* Suffix of the analysis report, appended to the output path */
+#define ANALYSIS_SUFFIX ".analysis.json"
+/* Suffix of the binary waveform, appended to the output path */
+#define WAVEFORM_SUFFIX ".waveform.dat"
+/* Suffix of the JSON waveform, appended to the output path */
+#define WAVEFORM_JSON_SUFFIX ".waveform.json"
+
+/* Measurements taken of the encoded audio, next to the output file. */
+struct AnalysisOptions
+{
+    /* EBU R128 integrated loudness, loudness range and true peak. */
+    bool loudness = false;
+    /* Minimum and maximum of every waveformZoom samples, for players. */
+    bool waveform = false;
+    /* Ranges below silenceThreshold lasting silenceDuration or longer. */
+    bool silence = false;
+    /* Samples per channel summarised by one waveform point. */
+    int waveformZoom = 256;
+    /* Write the waveform as JSON instead of the binary format. */
+    bool waveformJson = false;
+    /* Level in dBFS below which the audio counts as silent. */
+    double silenceThreshold = -60.0;
+    /* Duration in s a silence has to last at least. */
+    double silenceDuration = 2.0;
+
+    bool enabled() const { return loudness || waveform || silence; }
+};
+
+/**
+ * Loudness, peak, waveform and silence taps on the frames of a run.
+ * The frames handed to the encoder are analysed as they pass, so that no
+ * second decode of the output is needed. Every frame is converted to
+ * float planar once; the peak, waveform and silence measurements then
+ * share a min/max kernel, and the true peak is taken by a polyphase
+ * interpolator, both with AVX2 and NEON versions chosen at run time. The
+ * K-weighting filters of the loudness measurement are recursive and run
+ * per sample in double precision.
+ */
+class AudioAnalyzer
+{
+    public:
+        AudioAnalyzer(const AnalysisOptions &options,
+                      const AVCodecContext *codecContext);
+
+        void process(const AVFrame *frame)
+        {
+            process(frame->extended_data, frame->nb_samples);
+        }
+
+        void process(const uint8_t *const *data, int samples);
+
+        double integratedLoudness() const;
+
+        double truePeakLevel() const;
+
+        bool write(const QString &outputPath);
+
+    private:
+        typedef void (*MinMaxKernel)(const float *input, int samples,
+                                     float *minimum, float *maximum);
+        typedef float (*TruePeakKernel)(const float *input, int samples,
+                                        const float *taps, float peak);
+
+        void convert(const uint8_t *const *data, int offset, int samples);
+
+        void measureLoudness(int samples);
+
+        void measurePeaks(int samples);
+
+        void measureWaveform(int samples);
+
+        void endWaveformPoint();
+
+        void detectSilence(int samples);
+
+        void endSilenceBlock(int64_t end);
+
+        bool writeReport(const QString &path) const;
+
+        bool writeWaveform(const QString &path) const;
+
+        AnalysisOptions options;
+        int sampleRate;
+        int channels;
+        AVSampleFormat format;
+        MinMaxKernel minMax;
+        TruePeakKernel truePeakKernel;
+
+        /* Float samples of every channel, preceded by the last
+         * ANALYSIS_PHASE_TAPS - 1 samples of the chunk before. */
+        std::vector<std::vector<float>> planes;
+        int64_t position;
+
+        /* K-weighting: two cascaded biquads whose state is kept per
+         * channel, and the weight of every channel. */
+        double shelf[5];
+        double highPass[5];
+        std::vector<double> filterState;
+        std::vector<double> weights;
+        /* Mean square of every complete 100 ms of the weighted signal. */
+        std::vector<double> quarters;
+        int quarterSamples;
+        int quarterFill;
+        double quarterEnergy;
+
+        float taps[ANALYSIS_PHASE_TAPS * ANALYSIS_OVERSAMPLING];
+        float samplePeak;
+        float truePeak;
+
+        /* Minimum and maximum of every waveform point, interleaved. */
+        std::vector<int16_t> points;
+        int pointFill;
+        float pointMinimum;
+        float pointMaximum;
+
+        /* Silences are detected in blocks of 10 ms. */
+        QList<QPair<int64_t, int64_t>> silences;
+        int blockSamples;
+        int blockFill;
+        float blockPeak;
+        float silenceLevel;
+        int64_t minimumSilence;
+        int64_t silenceStart;
+};
+
+#endif
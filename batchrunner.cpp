@@ -0,0 +1,355 @@
+#include "batchrunner.h"
+
+#include <QDir>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QDirIterator>
+#include <QFileInfo>
+#include <QJsonDocument>
+#include <QMutexLocker>
+#include <QRunnable>
+#include <QSet>
+#include <QTextStream>
+
+/* Runs a single job of a batch on one of the pool threads. */
+class TranscodeTask : public QRunnable
+{
+    public:
+        TranscodeTask(BatchRunner *runner, const BatchJob &job)
+            : runner(runner), job(job)
+        {
+        }
+
+        void run() override
+        {
+            QElapsedTimer timer;
+            timer.start();
+
+            /* The transcoder only keeps pointers to the file names,
+             * so they have to live as long as the transcoder does. */
+            const QByteArray input  = job.input.toLocal8Bit();
+            const QByteArray output = job.output.toLocal8Bit();
+            int error;
+
+            if (QFileInfo(job.input).absoluteFilePath() ==
+                QFileInfo(job.output).absoluteFilePath()) {
+                fprintf(stderr, "Output file would overwrite input file '%s'\n",
+                        input.constData());
+                error = AVERROR(EINVAL);
+            } else {
+                Transcoder transcoder(input.constData(), output.constData(),
+                                      runner->transcoderOptions());
+                error = transcoder.processInput();
+            }
+
+            runner->reportResult(job, error, timer.elapsed());
+        }
+
+    private:
+        BatchRunner *runner;
+        BatchJob job;
+};
+
+/* Probes a single input of a batch on one of the pool threads. */
+class ProbeTask : public QRunnable
+{
+    public:
+        ProbeTask(BatchRunner *runner, const QString &input)
+            : runner(runner), input(input)
+        {
+        }
+
+        void run() override
+        {
+            const QByteArray filename = input.toLocal8Bit();
+            QJsonObject info;
+
+            Transcoder::probeInput(filename.constData(),
+                                   runner->transcoderOptions(), &info);
+            runner->reportProbe(info);
+        }
+
+    private:
+        BatchRunner *runner;
+        QString input;
+};
+
+BatchRunner::BatchRunner(int threadCount, const TranscoderOptions &options)
+    : options(options), total(0), completed(0), failed(0)
+{
+    if (!this->options.codecCache)
+        this->options.codecCache = &codecCache;
+    pool.setMaxThreadCount(threadCount > 0 ? threadCount : 1);
+    /* The jobs running at the same time share the cores among their
+     * codecs instead of each one spawning a thread per core. */
+    if (this->options.codecThreads <= 0)
+        this->options.codecThreads =
+            Transcoder::codecThreadShare(this->options, pool.maxThreadCount());
+}
+
+/**
+ * Read the jobs of a manifest file.
+ * Every non-empty line not starting with '#' describes one job, either as
+ * "input<TAB>output" or as a single input file name. In the latter case
+ * the output is placed into outputDir.
+ * @param      manifest     Manifest file to be read
+ * @param      outputDir    Directory for outputs not named in the manifest
+ * @param      extension    File extension of those outputs
+ * @param[out] jobs         List the jobs are appended to
+ * @return true if the manifest could be read completely
+ */
+bool BatchRunner::loadManifest(const QString &manifest,
+                               const QString &outputDir,
+                               const QString &extension,
+                               QList<BatchJob> *jobs)
+{
+    QFile file(manifest);
+    if (!file.open(QIODevice::ReadOnly | QIODevice::Text)) {
+        fprintf(stderr, "Could not open manifest '%s'\n",
+                manifest.toLocal8Bit().constData());
+        return false;
+    }
+
+    QTextStream stream(&file);
+    int lineNumber = 0;
+    while (!stream.atEnd()) {
+        const QString line = stream.readLine().trimmed();
+        lineNumber++;
+        if (line.isEmpty() || line.startsWith("#"))
+            continue;
+
+        BatchJob job;
+        const int separator = line.indexOf('\t');
+        if (separator >= 0) {
+            job.input  = line.left(separator).trimmed();
+            job.output = line.mid(separator + 1).trimmed();
+        } else {
+            if (outputDir.isEmpty()) {
+                fprintf(stderr, "Manifest line %d has no output file and no "
+                        "output directory was given\n", lineNumber);
+                return false;
+            }
+            /* Named once all inputs are known. */
+            job.input = line;
+        }
+        jobs->append(job);
+    }
+
+    nameOutputs(outputDir, extension, jobs);
+    return checkOutputs(*jobs);
+}
+
+/**
+ * Create one job for every regular file of a directory.
+ * @param      directory    Directory holding the input files
+ * @param      outputDir    Directory the outputs are written to
+ * @param      extension    File extension of the outputs
+ * @param[out] jobs         List the jobs are appended to
+ * @return true if the directory could be read
+ */
+bool BatchRunner::scanDirectory(const QString &directory,
+                                const QString &outputDir,
+                                const QString &extension,
+                                QList<BatchJob> *jobs)
+{
+    QDir dir(directory);
+    if (!dir.exists()) {
+        fprintf(stderr, "Could not open input directory '%s'\n",
+                directory.toLocal8Bit().constData());
+        return false;
+    }
+
+    const QList<QFileInfo> files = dir.entryInfoList(QDir::Files | QDir::Readable,
+                                                     QDir::Name);
+    for (const QFileInfo &info : files) {
+        BatchJob job;
+        job.input = info.filePath();
+        jobs->append(job);
+    }
+
+    nameOutputs(outputDir, extension, jobs);
+    return checkOutputs(*jobs);
+}
+
+/**
+ * Transcode all jobs and wait until every one of them is finished.
+ * @param jobs Jobs to be run
+ * @return Number of failed jobs
+ */
+int BatchRunner::run(const QList<BatchJob> &jobs)
+{
+    total     = jobs.size();
+    completed = 0;
+    failed    = 0;
+
+    for (const BatchJob &job : jobs)
+        pool.start(new TranscodeTask(this, job));
+    pool.waitForDone();
+
+    fprintf(stdout, "%d of %d jobs succeeded, %d failed\n",
+            total - failed, total, failed);
+    return failed;
+}
+
+/**
+ * Collect the inputs in or below a directory, or a single input file.
+ * @param      path   File or directory
+ * @param[out] inputs List the files are appended to, in name order per
+ *                    directory
+ * @return true if the path exists
+ */
+bool BatchRunner::scanInputs(const QString &path, QStringList *inputs)
+{
+    const QFileInfo info(path);
+
+    if (info.isFile()) {
+        inputs->append(path);
+        return true;
+    }
+    if (!info.isDir()) {
+        fprintf(stderr, "Could not open input '%s'\n",
+                path.toLocal8Bit().constData());
+        return false;
+    }
+
+    QDirIterator files(path, QDir::Files | QDir::Readable,
+                       QDirIterator::Subdirectories);
+    QStringList found;
+    while (files.hasNext())
+        found.append(files.next());
+    found.sort();
+    inputs->append(found);
+    return true;
+}
+
+/**
+ * Probe every input on the pool threads without decoding any of them.
+ * Every result is written to stdout as one line of JSON, in the order the
+ * probes finish.
+ * @param inputs Files to be probed
+ * @return Number of inputs that cannot be transcoded
+ */
+int BatchRunner::probe(const QStringList &inputs)
+{
+    total     = inputs.size();
+    completed = 0;
+    failed    = 0;
+
+    for (const QString &input : inputs)
+        pool.start(new ProbeTask(this, input));
+    pool.waitForDone();
+
+    fprintf(stderr, "%d of %d inputs can be transcoded, %d cannot\n",
+            total - failed, total, failed);
+    return failed;
+}
+
+void BatchRunner::reportProbe(const QJsonObject &info)
+{
+    QMutexLocker locker(&reportMutex);
+
+    completed++;
+    if (!info.value("ok").toBool())
+        failed++;
+    fprintf(stdout, "%s\n", QJsonDocument(info).toJson(QJsonDocument::Compact).constData());
+    fflush(stdout);
+}
+
+/**
+ * Print the result of one job together with the overall progress.
+ * Called from the pool threads.
+ * @param job      Finished job
+ * @param error    Error code of the job (0 if successful)
+ * @param msecs    Wall clock time of the job in milliseconds
+ */
+void BatchRunner::reportResult(const BatchJob &job, int error, qint64 msecs)
+{
+    QMutexLocker locker(&reportMutex);
+
+    completed++;
+    if (error < 0) {
+        char message[AV_ERROR_MAX_STRING_SIZE];
+        av_strerror(error, message, sizeof(message));
+        failed++;
+        fprintf(stdout, "[%d/%d] failed %s -> %s (%s)\n", completed, total,
+                job.input.toLocal8Bit().constData(),
+                job.output.toLocal8Bit().constData(), message);
+    } else {
+        fprintf(stdout, "[%d/%d] done %s -> %s (%.2fs)\n", completed, total,
+                job.input.toLocal8Bit().constData(),
+                job.output.toLocal8Bit().constData(), msecs / 1000.0);
+    }
+    fflush(stdout);
+}
+
+/**
+ * Name the outputs of the jobs without one in the output directory. An
+ * input's suffix is kept if the name without it is the input of any job
+ * or the output of another one, like that of a.wav next to a.mp3, or of
+ * a.mp3 next to a.mp4 in the output directory itself.
+ * @param      outputDir Directory the outputs are written to
+ * @param      extension File extension of the outputs
+ * @param[out] jobs      Jobs whose empty outputs are named
+ */
+void BatchRunner::nameOutputs(const QString &outputDir,
+                              const QString &extension,
+                              QList<BatchJob> *jobs)
+{
+    const QDir dir(outputDir);
+    QSet<QString> inputs;
+    QSet<QString> outputs;
+
+    for (const BatchJob &job : *jobs) {
+        inputs.insert(QFileInfo(job.input).absoluteFilePath());
+        if (!job.output.isEmpty())
+            outputs.insert(QFileInfo(job.output).absoluteFilePath());
+    }
+
+    for (BatchJob &job : *jobs) {
+        if (!job.output.isEmpty())
+            continue;
+
+        const QFileInfo info(job.input);
+        QString path = dir.filePath(info.completeBaseName() + "." + extension);
+        QString absolute = QFileInfo(path).absoluteFilePath();
+
+        if (inputs.contains(absolute) || outputs.contains(absolute)) {
+            path     = dir.filePath(info.fileName() + "." + extension);
+            absolute = QFileInfo(path).absoluteFilePath();
+        }
+        job.output = path;
+        outputs.insert(absolute);
+    }
+}
+
+/**
+ * Make sure that no two jobs write the same output and that no job
+ * writes over an input, as the jobs run concurrently and the inputs are
+ * read through memory mappings.
+ * @param jobs Jobs of the batch
+ * @return true if every output is written by one job only
+ */
+bool BatchRunner::checkOutputs(const QList<BatchJob> &jobs)
+{
+    QSet<QString> inputs;
+    QSet<QString> outputs;
+
+    for (const BatchJob &job : jobs)
+        inputs.insert(QFileInfo(job.input).absoluteFilePath());
+    for (const BatchJob &job : jobs) {
+        const QString output = QFileInfo(job.output).absoluteFilePath();
+
+        if (inputs.contains(output)) {
+            fprintf(stderr, "Output '%s' is an input of the batch\n",
+                    job.output.toLocal8Bit().constData());
+            return false;
+        }
+        if (outputs.contains(output)) {
+            fprintf(stderr, "Output '%s' is written by several jobs\n",
+                    job.output.toLocal8Bit().constData());
+            return false;
+        }
+        outputs.insert(output);
+    }
+    return true;
+}
@@ -0,0 +1,73 @@
+#ifndef BATCHRUNNER_H
+#define BATCHRUNNER_H
+
+#include <QJsonObject>
+#include <QList>
+#include <QMutex>
+#include <QString>
+#include <QStringList>
+#include <QThreadPool>
+
+#include "transcoder.h"
+
+/* One input -> output pair of a batch run. */
+struct BatchJob
+{
+    QString input;
+    QString output;
+};
+
+/**
+ * Run many transcoding jobs in one process.
+ * The jobs are distributed over a thread pool, each one running its own
+ * Transcoder instance. Unless the options name a codec cache of their own,
+ * the jobs share the runner's, so that inputs and outputs of the same
+ * format reuse opened decoders and encoders. The result of every job is
+ * reported on stdout as soon as it is finished. Inputs may also only be
+ * probed, each reported as one line of JSON.
+ */
+class BatchRunner
+{
+    public:
+        BatchRunner(int threadCount, const TranscoderOptions &options);
+
+        static bool loadManifest(const QString &manifest,
+                                 const QString &outputDir,
+                                 const QString &extension,
+                                 QList<BatchJob> *jobs);
+
+        static bool scanDirectory(const QString &directory,
+                                  const QString &outputDir,
+                                  const QString &extension,
+                                  QList<BatchJob> *jobs);
+
+        int run(const QList<BatchJob> &jobs);
+
+        static bool scanInputs(const QString &path, QStringList *inputs);
+
+        int probe(const QStringList &inputs);
+
+        void reportResult(const BatchJob &job, int error, qint64 msecs);
+
+        void reportProbe(const QJsonObject &info);
+
+        const TranscoderOptions &transcoderOptions() const { return options; }
+
+    private:
+        static void nameOutputs(const QString &outputDir,
+                                const QString &extension,
+                                QList<BatchJob> *jobs);
+
+        static bool checkOutputs(const QList<BatchJob> &jobs);
+
+        /* Declared before the pool so that it outlives the jobs. */
+        CodecContextCache codecCache;
+        TranscoderOptions options;
+        QThreadPool pool;
+        QMutex reportMutex;
+        int total;
+        int completed;
+        int failed;
+};
+
+#endif
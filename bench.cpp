@@ -0,0 +1,373 @@
+/**
+ * @file
+ * Benchmark of the transcoding engines.
+ *
+ * Transcodes a corpus of real and/or synthetic inputs with every engine
+ * asked for, several times each, and reports the realtime factor, the
+ * throughput and the time spent per stage as JSON or CSV on stdout.
+ */
+
+#include <QCommandLineParser>
+#include <QCoreApplication>
+#include <QDir>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QFileInfo>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QTemporaryDir>
+
+#include <cmath>
+#include <cstring>
+
+#include "transcoder.h"
+
+/* Result of one benchmark run. */
+struct BenchResult
+{
+    QString input;
+    QString engine;
+    int run;
+    int error;
+    double audioSeconds;
+    int sampleRate;
+    double wallSeconds;
+    int64_t stageNanoseconds[(int)TranscodeStage::Count];
+};
+
+/* Synthetic inputs as sample rate and channel count. */
+static const int syntheticFormats[][2] = {
+    { 44100, 2 },
+    { 48000, 2 },
+    { 48000, 1 }
+};
+
+static void putLittleEndian(char *data, uint32_t value, int bytes)
+{
+    for (int i = 0; i < bytes; i++)
+        data[i] = (char)((value >> (8 * i)) & 0xff);
+}
+
+/**
+ * Write a 16 bit PCM WAV file holding a sine sweep over low-level noise,
+ * so that the encoder has some realistic work to do.
+ * @param path        File to be written
+ * @param seconds     Duration of the signal
+ * @param sampleRate  Sample rate in Hz
+ * @param channels    Number of channels
+ * @return true if the file could be written
+ */
+static bool writeSyntheticWav(const QString &path, int seconds, int sampleRate,
+                              int channels)
+{
+    const uint32_t frames   = (uint32_t)seconds * sampleRate;
+    const uint32_t dataSize = frames * channels * 2;
+    const int blockFrames   = 4096;
+    QByteArray header(44, 0);
+    QByteArray block;
+    uint32_t noise = 1;
+    double phase   = 0;
+    QFile file(path);
+
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+        fprintf(stderr, "Could not create '%s'\n", path.toLocal8Bit().constData());
+        return false;
+    }
+
+    char *data = header.data();
+    memcpy(data, "RIFF", 4);
+    putLittleEndian(data + 4, 36 + dataSize, 4);
+    memcpy(data + 8, "WAVEfmt ", 8);
+    putLittleEndian(data + 16, 16, 4);
+    putLittleEndian(data + 20, 1, 2);
+    putLittleEndian(data + 22, channels, 2);
+    putLittleEndian(data + 24, sampleRate, 4);
+    putLittleEndian(data + 28, sampleRate * channels * 2, 4);
+    putLittleEndian(data + 32, channels * 2, 2);
+    putLittleEndian(data + 34, 16, 2);
+    memcpy(data + 36, "data", 4);
+    putLittleEndian(data + 40, dataSize, 4);
+    if (file.write(header) != header.size())
+        return false;
+
+    block.resize(blockFrames * channels * 2);
+    for (uint32_t frame = 0; frame < frames; ) {
+        const int count = (int)qMin<uint32_t>(blockFrames, frames - frame);
+        char *samples   = block.data();
+
+        for (int i = 0; i < count; i++, frame++) {
+            /* Sweep from 50 Hz to 10 kHz over the whole duration. */
+            const double frequency = 50.0 * pow(200.0, (double)frame / frames);
+
+            phase += 6.283185307179586 * frequency / sampleRate;
+            for (int channel = 0; channel < channels; channel++) {
+                noise = noise * 1664525u + 1013904223u;
+                const double value = 0.5 * sin(phase + channel) +
+                                     0.03 * ((int32_t)noise / 2147483648.0);
+                putLittleEndian(samples, (uint32_t)(int16_t)(value * 32767), 2);
+                samples += 2;
+            }
+        }
+        if (file.write(block.constData(), count * channels * 2) !=
+            count * channels * 2)
+            return false;
+    }
+
+    return true;
+}
+
+/**
+ * Determine the duration and sample rate of the audio stream of an input.
+ * @param      path        Input file
+ * @param[out] seconds     Duration of the audio stream
+ * @param[out] sampleRate  Sample rate of the audio stream
+ * @return true if the input could be probed
+ */
+static bool probeInput(const QString &path, double *seconds, int *sampleRate)
+{
+    const QByteArray filename = path.toLocal8Bit();
+    AVFormatContext *formatContext = nullptr;
+    int index;
+
+    if (avformat_open_input(&formatContext, filename.constData(), nullptr,
+                            nullptr) < 0)
+        return false;
+    if (avformat_find_stream_info(formatContext, nullptr) < 0 ||
+        (index = av_find_best_stream(formatContext, AVMEDIA_TYPE_AUDIO,
+                                     -1, -1, nullptr, 0)) < 0) {
+        avformat_close_input(&formatContext);
+        return false;
+    }
+
+    const AVStream *stream = formatContext->streams[index];
+    *sampleRate = stream->codecpar->sample_rate;
+    if (stream->duration != AV_NOPTS_VALUE)
+        *seconds = stream->duration * av_q2d(stream->time_base);
+    else
+        *seconds = formatContext->duration / (double)AV_TIME_BASE;
+    avformat_close_input(&formatContext);
+    return *seconds > 0;
+}
+
+static double realtimeFactor(const BenchResult &result)
+{
+    return result.wallSeconds > 0 ? result.audioSeconds / result.wallSeconds : 0;
+}
+
+static double samplesPerSecond(const BenchResult &result)
+{
+    return result.wallSeconds > 0 ?
+           result.audioSeconds * result.sampleRate / result.wallSeconds : 0;
+}
+
+static void printJson(const QList<BenchResult> &results)
+{
+    QJsonArray runs;
+
+    for (const BenchResult &result : results) {
+        QJsonObject run;
+        QJsonObject stages;
+
+        run.insert("input", result.input);
+        run.insert("engine", result.engine);
+        run.insert("run", result.run);
+        run.insert("status", result.error < 0 ? "failed" : "ok");
+        run.insert("audio_seconds", result.audioSeconds);
+        run.insert("wall_seconds", result.wallSeconds);
+        run.insert("realtime_factor", realtimeFactor(result));
+        run.insert("samples_per_second", samplesPerSecond(result));
+        for (int i = 0; i < (int)TranscodeStage::Count; i++)
+            stages.insert(TranscodeStats::stageName((TranscodeStage)i),
+                          result.stageNanoseconds[i] / 1e6);
+        run.insert("stage_ms", stages);
+        runs.append(run);
+    }
+
+    fprintf(stdout, "%s", QJsonDocument(runs).toJson().constData());
+}
+
+static void printCsv(const QList<BenchResult> &results)
+{
+    fprintf(stdout, "input,engine,run,status,audio_seconds,wall_seconds,"
+                    "realtime_factor,samples_per_second");
+    for (int i = 0; i < (int)TranscodeStage::Count; i++)
+        fprintf(stdout, ",%s_ms", TranscodeStats::stageName((TranscodeStage)i));
+    fprintf(stdout, "\n");
+
+    for (const BenchResult &result : results) {
+        fprintf(stdout, "\"%s\",%s,%d,%s,%.3f,%.3f,%.2f,%.0f",
+                result.input.toLocal8Bit().constData(),
+                result.engine.toLocal8Bit().constData(), result.run,
+                result.error < 0 ? "failed" : "ok", result.audioSeconds,
+                result.wallSeconds, realtimeFactor(result),
+                samplesPerSecond(result));
+        for (int i = 0; i < (int)TranscodeStage::Count; i++)
+            fprintf(stdout, ",%.3f", result.stageNanoseconds[i] / 1e6);
+        fprintf(stdout, "\n");
+    }
+}
+
+static bool parseEngine(const QString &name, TranscodeEngine *engine)
+{
+    if (name == "sequential")
+        *engine = TranscodeEngine::Sequential;
+    else if (name == "pipelined")
+        *engine = TranscodeEngine::Pipelined;
+    else if (name == "segmented")
+        *engine = TranscodeEngine::Segmented;
+    else
+        return false;
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    QCoreApplication app(argc, argv);
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Benchmark the transcoding engines.");
+    parser.addHelpOption();
+    parser.addPositionalArgument("inputs", "Files or directories of the corpus.",
+                                 "[inputs...]");
+
+    QCommandLineOption syntheticOption("synthetic",
+            "Add generated inputs of the given duration to the corpus.",
+            "seconds", "0");
+    QCommandLineOption enginesOption("engines",
+            "Comma separated engines to be compared.",
+            "engines", "sequential,pipelined,segmented");
+    QCommandLineOption repeatOption("repeat",
+            "Number of runs per input and engine.",
+            "count", "3");
+    QCommandLineOption formatOption("format",
+            "Report format: 'json' or 'csv'.",
+            "format", "json");
+    QCommandLineOption outputDirOption(QStringList() << "o" << "output-dir",
+            "Directory for the encoded outputs (default: a temporary one).",
+            "directory");
+    QCommandLineOption extensionOption("extension",
+            "Extension (and thereby container format) of the outputs.",
+            "extension", "mp4");
+    parser.addOption(syntheticOption);
+    parser.addOption(enginesOption);
+    parser.addOption(repeatOption);
+    parser.addOption(formatOption);
+    parser.addOption(outputDirOption);
+    parser.addOption(extensionOption);
+    parser.process(app);
+
+    const QString format = parser.value(formatOption);
+    if (format != "json" && format != "csv") {
+        fprintf(stderr, "Unknown report format '%s'\n", format.toLocal8Bit().constData());
+        return 1;
+    }
+
+    QList<TranscodeEngine> engines;
+    const QStringList engineNames = parser.value(enginesOption).split(',');
+    for (const QString &name : engineNames) {
+        TranscodeEngine engine;
+        if (!parseEngine(name, &engine)) {
+            fprintf(stderr, "Unknown engine '%s'\n", name.toLocal8Bit().constData());
+            return 1;
+        }
+        engines.append(engine);
+    }
+
+    QTemporaryDir temporaryDir;
+    const QString workDir = parser.isSet(outputDirOption) ?
+                            parser.value(outputDirOption) : temporaryDir.path();
+    if (!QDir().mkpath(workDir)) {
+        fprintf(stderr, "Could not create output directory '%s'\n",
+                workDir.toLocal8Bit().constData());
+        return 1;
+    }
+
+    /* Collect the corpus. */
+    QStringList inputs;
+    for (const QString &argument : parser.positionalArguments()) {
+        if (QFileInfo(argument).isDir()) {
+            const QList<QFileInfo> files = QDir(argument).entryInfoList(
+                        QDir::Files | QDir::Readable, QDir::Name);
+            for (const QFileInfo &info : files)
+                inputs.append(info.filePath());
+        } else {
+            inputs.append(argument);
+        }
+    }
+    const int seconds = parser.value(syntheticOption).toInt();
+    if (seconds > 0) {
+        for (const auto &synthetic : syntheticFormats) {
+            const QString path = QDir(workDir).filePath(
+                        QString("synthetic-%1-%2ch.wav").arg(synthetic[0]).arg(synthetic[1]));
+            if (!writeSyntheticWav(path, seconds, synthetic[0], synthetic[1]))
+                return 1;
+            inputs.append(path);
+        }
+    }
+    if (inputs.isEmpty()) {
+        fprintf(stderr, "No inputs given; use --synthetic or name files or directories\n");
+        return 1;
+    }
+
+    const int repeat = qMax(1, parser.value(repeatOption).toInt());
+    QList<BenchResult> results;
+    bool failed = false;
+
+    for (const QString &input : inputs) {
+        double audioSeconds;
+        int sampleRate;
+
+        if (!probeInput(input, &audioSeconds, &sampleRate)) {
+            fprintf(stderr, "Could not probe '%s', skipped\n",
+                    input.toLocal8Bit().constData());
+            failed = true;
+            continue;
+        }
+
+        for (int e = 0; e < engines.size(); e++) {
+            for (int run = 1; run <= repeat; run++) {
+                const QString output = QDir(workDir).filePath(
+                            QFileInfo(input).completeBaseName() + "-" +
+                            engineNames.at(e) + "." + parser.value(extensionOption));
+                const QByteArray inputName  = input.toLocal8Bit();
+                const QByteArray outputName = output.toLocal8Bit();
+                TranscodeStats stats;
+                TranscoderOptions options;
+                BenchResult result;
+                QElapsedTimer timer;
+
+                options.engine = engines.at(e);
+                options.stats  = &stats;
+
+                timer.start();
+                Transcoder transcoder(inputName.constData(), outputName.constData(),
+                                      options);
+                result.error       = transcoder.processInput();
+                result.wallSeconds = timer.nsecsElapsed() / 1e9;
+
+                result.input        = input;
+                result.engine       = engineNames.at(e);
+                result.run          = run;
+                result.audioSeconds = audioSeconds;
+                result.sampleRate   = sampleRate;
+                for (int i = 0; i < (int)TranscodeStage::Count; i++)
+                    result.stageNanoseconds[i] = stats.nanoseconds((TranscodeStage)i);
+                results.append(result);
+                if (result.error < 0)
+                    failed = true;
+
+                fprintf(stderr, "%s %s run %d: %.2fx realtime\n",
+                        inputName.constData(), engineNames.at(e).toLocal8Bit().constData(),
+                        run, realtimeFactor(result));
+            }
+        }
+    }
+
+    if (format == "csv")
+        printCsv(results);
+    else
+        printJson(results);
+
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,195 @@
+/**
+ * @file
+ * Checkpoints of long runs.
+ *
+ * Every so often the muxer's pending fragment is completed and the output
+ * flushed, and the number of output samples and bytes it then holds is
+ * saved next to it. A later run of the same job truncates the output to
+ * that size, appends to it without a new header and encodes the rest of
+ * the input, starting a few frames early to warm up the encoder.
+ */
+
+#include "transcoder.h"
+
+#include <QFile>
+#include <QFileInfo>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QSaveFile>
+
+/**
+ * Read a checkpoint saved by save().
+ * @param path Checkpoint file
+ * @return false if there is none or it cannot be parsed
+ */
+bool Checkpoint::load(const QString &path)
+{
+    QFile file(path);
+    QJsonObject object;
+
+    if (!file.open(QIODevice::ReadOnly))
+        return false;
+    object = QJsonDocument::fromJson(file.readAll()).object();
+    if (object.isEmpty())
+        return false;
+
+    input      = object.value("input").toString();
+    output     = object.value("output").toString();
+    codec      = object.value("codec").toString();
+    bitRate    = object.value("bitRate").toInt();
+    channels   = object.value("channels").toInt();
+    sampleRate = object.value("sampleRate").toInt();
+    position   = (int64_t)object.value("position").toDouble(-1);
+    bytes      = (int64_t)object.value("bytes").toDouble(-1);
+    return position >= 0 && bytes >= 0;
+}
+
+/**
+ * Replace the checkpoint file atomically, so that a run stopped while
+ * saving leaves the previous checkpoint intact.
+ * @param path Checkpoint file
+ * @return true if the checkpoint has been saved
+ */
+bool Checkpoint::save(const QString &path) const
+{
+    QSaveFile file(path);
+    QJsonObject object;
+
+    object.insert("input", input);
+    object.insert("output", output);
+    object.insert("codec", codec);
+    object.insert("bitRate", bitRate);
+    object.insert("channels", channels);
+    object.insert("sampleRate", sampleRate);
+    object.insert("position", (double)position);
+    object.insert("bytes", (double)bytes);
+
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate) ||
+        file.write(QJsonDocument(object).toJson()) < 0 ||
+        !file.commit()) {
+        fprintf(stderr, "Could not write checkpoint '%s'\n",
+                path.toLocal8Bit().constData());
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Check whether a checkpoint was saved by a run with the same input,
+ * output and encoder settings, so that its output can be continued.
+ */
+bool Checkpoint::sameJob(const Checkpoint &other) const
+{
+    return input == other.input && output == other.output &&
+           codec == other.codec && bitRate == other.bitRate &&
+           channels == other.channels && sampleRate == other.sampleRate;
+}
+
+/**
+ * Decide whether the run saves checkpoints and whether it continues the
+ * output of an earlier run of the same job that was stopped.
+ * @param spec              Output of the run
+ * @param sampleRate        Sample rate of the output in Hz
+ * @param inputCodecContext Codec context of the input file
+ * @return Size the output file is continued at, or -1 for a new file
+ */
+int64_t Transcoder::prepareCheckpoints(const OutputSpec &spec, int sampleRate,
+                                       AVCodecContext *inputCodecContext)
+{
+    const QByteArray path   = spec.path.toLocal8Bit();
+    const QByteArray format = spec.format.toLatin1();
+    const AVOutputFormat *outputFormat =
+        av_guess_format(format.isEmpty() ? nullptr : format.constData(),
+                        path.constData(), nullptr);
+    const int64_t interval = av_rescale(options.checkpointInterval, sampleRate,
+                                        AV_TIME_BASE);
+    Checkpoint saved;
+
+    if (options.checkpointInterval <= 0)
+        return -1;
+    /* The input is seeked and the output appended to by a resumed run. */
+    if (options.engine == TranscodeEngine::Segmented || options.copyStreams ||
+        options.inputStream || spec.stream || options.trimStart > 0 ||
+        options.trimDuration > 0 || options.analysis.enabled() ||
+        options.normalize) {
+        fprintf(stderr, "Checkpoints are only saved for whole files transcoded "
+                        "without segments, copied streams, analysis or "
+                        "normalization\n");
+        return -1;
+    }
+    /* Input and output sample positions have to be the same. */
+    if (sampleRate != inputCodecContext->sample_rate) {
+        fprintf(stderr, "Sample rate conversion, saving no checkpoints\n");
+        return -1;
+    }
+    if (!outputFormat || !av_match_name(outputFormat->name, CHECKPOINT_FORMATS)) {
+        fprintf(stderr, "Output format cannot be continued, saving no checkpoints\n");
+        return -1;
+    }
+
+    checkpointFile        = spec.path + CHECKPOINT_SUFFIX;
+    checkpoint            = Checkpoint();
+    checkpoint.input      = QString::fromLocal8Bit(inputFile);
+    checkpoint.output     = spec.path;
+    checkpoint.codec      = spec.codec;
+    checkpoint.bitRate    = spec.bitRate;
+    checkpoint.channels   = spec.channels;
+    checkpoint.sampleRate = sampleRate;
+    nextCheckpoint        = FFMAX(interval, (int64_t)1);
+
+    if (!saved.load(checkpointFile) || !saved.sameJob(checkpoint) ||
+        saved.position <= 0)
+        return -1;
+    if (QFileInfo(spec.path).size() < saved.bytes ||
+        !QFile::resize(spec.path, saved.bytes)) {
+        fprintf(stderr, "Output does not match its checkpoint, starting over\n");
+        return -1;
+    }
+
+    checkpoint     = saved;
+    resumePosition = saved.position;
+    nextCheckpoint = resumePosition + FFMAX(interval, (int64_t)1);
+    fprintf(stderr, "Resuming '%s' at %.3f s\n", path.constData(),
+            (double)resumePosition / sampleRate);
+    return saved.bytes;
+}
+
+/**
+ * Complete the output up to a sample position and save the checkpoint.
+ * A checkpoint that cannot be saved only costs the work since the
+ * previous one, so the run goes on.
+ * @param outputFormatContext Format context of the output file
+ * @param outputCodecContext  Codec context of the output file
+ * @param position            Output sample position the written packets
+ *                            reach up to
+ * @return Error code (0 if successful)
+ */
+int Transcoder::saveCheckpoint(AVFormatContext *outputFormatContext,
+                               AVCodecContext *outputCodecContext,
+                               int64_t position)
+{
+    int error;
+
+    /* End the pending fragment, so that the file ends where the output
+     * can be continued. */
+    if ((outputFormatContext->oformat->flags & AVFMT_ALLOW_FLUSH) &&
+        (error = av_write_frame(outputFormatContext, nullptr)) < 0) {
+        fprintf(stderr, "Could not flush output file (error '%d')\n", error);
+        return error;
+    }
+    avio_flush(outputFormatContext->pb);
+    if (outputFormatContext->pb->error < 0) {
+        fprintf(stderr, "Could not write output file (error '%d')\n",
+                outputFormatContext->pb->error);
+        return outputFormatContext->pb->error;
+    }
+
+    checkpoint.position = position;
+    checkpoint.bytes    = avio_tell(outputFormatContext->pb);
+    checkpoint.save(checkpointFile);
+    nextCheckpoint = position +
+                     FFMAX(av_rescale(options.checkpointInterval,
+                                      outputCodecContext->sample_rate, AV_TIME_BASE),
+                           (int64_t)1);
+    return 0;
+}
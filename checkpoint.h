@@ -0,0 +1,39 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <QString>
+
+#include <cstdint>
+
+/* Appended to the output path to name the checkpoint file of a run */
+#define CHECKPOINT_SUFFIX ".checkpoint"
+
+/**
+ * Progress of a run, saved while the output is written so that a run
+ * stopped half way can be continued from there instead of redone.
+ * The state of the encoder is not saved; a resumed run warms up a new
+ * encoder on the frames before the position, like a segment does.
+ */
+struct Checkpoint
+{
+    QString input;
+    QString output;
+    /* Encoder settings the output is written with. */
+    QString codec;
+    int bitRate = 0;
+    int channels = 0;
+    int sampleRate = 0;
+    /* First output sample not yet in the output file, at a boundary of
+     * the encoder's frames. */
+    int64_t position = 0;
+    /* Bytes of the output file up to that sample. */
+    int64_t bytes = 0;
+
+    bool load(const QString &path);
+
+    bool save(const QString &path) const;
+
+    bool sameJob(const Checkpoint &other) const;
+};
+
+#endif
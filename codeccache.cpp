@@ -0,0 +1,160 @@
+#include "codeccache.h"
+
+#include <QMutexLocker>
+
+/**
+ * Key of a decoder for the parameters found by the demuxer.
+ * @param codec      Decoder to be used
+ * @param parameters Parameters of the input stream
+ * @return Key of the decoder context
+ */
+CodecKey CodecKey::decoder(const AVCodec *codec,
+                           const AVCodecParameters *parameters)
+{
+    CodecKey key;
+
+    key.codec              = codec;
+    key.format             = parameters->format;
+    key.sampleRate         = parameters->sample_rate;
+    key.channels           = parameters->channels;
+    key.channelLayout      = parameters->channel_layout;
+    key.bitRate            = parameters->bit_rate;
+    key.blockAlign         = parameters->block_align;
+    key.bitsPerCodedSample = parameters->bits_per_coded_sample;
+    if (parameters->extradata_size > 0)
+        key.extradata = QByteArray((const char *)parameters->extradata,
+                                   parameters->extradata_size);
+    return key;
+}
+
+bool CodecKey::operator==(const CodecKey &other) const
+{
+    return codec == other.codec && format == other.format &&
+           sampleRate == other.sampleRate && channels == other.channels &&
+           channelLayout == other.channelLayout && bitRate == other.bitRate &&
+           blockAlign == other.blockAlign &&
+           bitsPerCodedSample == other.bitsPerCodedSample &&
+           flags == other.flags && extradata == other.extradata &&
+           options == other.options;
+}
+
+CodecContextCache::CodecContextCache()
+    : hitCount(0), missCount(0)
+{
+}
+
+CodecContextCache::~CodecContextCache()
+{
+    clear();
+}
+
+/**
+ * Take an opened context out of the cache.
+ * @param key Parameters the context must have been opened with
+ * @return Context owned by the caller now, or nullptr if none matches
+ */
+AVCodecContext *CodecContextCache::take(const CodecKey &key)
+{
+    QMutexLocker locker(&mutex);
+    QList<Entry> &entries = av_codec_is_encoder(key.codec) ? encoders : decoders;
+
+    for (int i = 0; i < entries.size(); i++) {
+        if (entries.at(i).key == key) {
+            AVCodecContext *context = entries.takeAt(i).context;
+
+            hitCount++;
+            lent.insert(context, key);
+            return context;
+        }
+    }
+    missCount++;
+    return nullptr;
+}
+
+/**
+ * Have a context opened by the caller kept once it is released.
+ * @param key     Parameters the context has been opened with
+ * @param context Opened context, still owned by the caller
+ */
+void CodecContextCache::adopt(const CodecKey &key, AVCodecContext *context)
+{
+    QMutexLocker locker(&mutex);
+    lent.insert(context, key);
+}
+
+/**
+ * Return a context to the cache, or close it if it cannot be reused.
+ * Contexts neither taken nor adopted are closed. The least recently
+ * released context is closed if the cache is full.
+ * @param context Context to be released; set to nullptr
+ */
+void CodecContextCache::release(AVCodecContext **context)
+{
+    AVCodecContext *evicted = nullptr;
+    CodecKey key;
+    bool tracked, encoder;
+
+    if (!*context)
+        return;
+    {
+        QMutexLocker locker(&mutex);
+
+        if ((tracked = lent.contains(*context)))
+            key = lent.take(*context);
+    }
+    if (!tracked) {
+        avcodec_free_context(context);
+        return;
+    }
+
+    encoder = av_codec_is_encoder((*context)->codec);
+    if (encoder) {
+#ifdef AV_CODEC_CAP_ENCODER_FLUSH
+        if (!((*context)->codec->capabilities & AV_CODEC_CAP_ENCODER_FLUSH)) {
+            avcodec_free_context(context);
+            return;
+        }
+#else
+        avcodec_free_context(context);
+        return;
+#endif
+    }
+    /* Drop the delayed frames and leave the draining state. */
+    avcodec_flush_buffers(*context);
+
+    {
+        QMutexLocker locker(&mutex);
+        QList<Entry> &entries = encoder ? encoders : decoders;
+
+        if (entries.size() >= CODEC_CACHE_CAPACITY)
+            evicted = entries.takeFirst().context;
+        entries.append(Entry{key, *context});
+    }
+    *context = nullptr;
+    avcodec_free_context(&evicted);
+}
+
+/* Close all contexts kept. */
+void CodecContextCache::clear()
+{
+    QMutexLocker locker(&mutex);
+
+    for (Entry &entry : decoders)
+        avcodec_free_context(&entry.context);
+    for (Entry &entry : encoders)
+        avcodec_free_context(&entry.context);
+    decoders.clear();
+    encoders.clear();
+}
+
+int64_t CodecContextCache::hits() const
+{
+    QMutexLocker locker(&mutex);
+    return hitCount;
+}
+
+int64_t CodecContextCache::misses() const
+{
+    QMutexLocker locker(&mutex);
+    return missCount;
+}
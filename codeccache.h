@@ -0,0 +1,85 @@
+#ifndef CODECCACHE_H
+#define CODECCACHE_H
+
+#include <QByteArray>
+#include <QHash>
+#include <QList>
+#include <QMutex>
+
+#ifdef __cplusplus
+extern "C" {
+    #include "libavcodec/avcodec.h"
+}
+#endif
+
+/* The number of idle contexts kept per kind */
+#define CODEC_CACHE_CAPACITY 8
+
+/* Parameters an opened codec context can be shared by. */
+struct CodecKey
+{
+    const AVCodec *codec = nullptr;
+    int format = -1;
+    int sampleRate = 0;
+    int channels = 0;
+    uint64_t channelLayout = 0;
+    int64_t bitRate = 0;
+    int blockAlign = 0;
+    int bitsPerCodedSample = 0;
+    int flags = 0;
+    QByteArray extradata;
+    /* Options the context was opened with, as "key=value:" pairs. */
+    QByteArray options;
+
+    static CodecKey decoder(const AVCodec *codec,
+                            const AVCodecParameters *parameters);
+
+    bool operator==(const CodecKey &other) const;
+};
+
+/**
+ * Opened decoder and encoder contexts kept between the jobs of a run.
+ * A job takes a context matching its parameters, if there is one, instead
+ * of allocating and opening a new one, and releases it when it is done.
+ * Contexts opened because none matched are adopted to be kept likewise.
+ * Released contexts are flushed; encoders that cannot be flushed are
+ * closed. The cache may be used from several threads at once.
+ */
+class CodecContextCache
+{
+    public:
+        CodecContextCache();
+        ~CodecContextCache();
+
+        AVCodecContext *take(const CodecKey &key);
+
+        void adopt(const CodecKey &key, AVCodecContext *context);
+
+        void release(AVCodecContext **context);
+
+        void clear();
+
+        int64_t hits() const;
+
+        int64_t misses() const;
+
+    private:
+        CodecContextCache(const CodecContextCache &) = delete;
+        CodecContextCache &operator=(const CodecContextCache &) = delete;
+
+        struct Entry
+        {
+            CodecKey key;
+            AVCodecContext *context;
+        };
+
+        mutable QMutex mutex;
+        QList<Entry> decoders;
+        QList<Entry> encoders;
+        /* Keys of the contexts taken or adopted and not released yet. */
+        QHash<AVCodecContext *, CodecKey> lent;
+        int64_t hitCount;
+        int64_t missCount;
+};
+
+#endif
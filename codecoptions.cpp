@@ -0,0 +1,85 @@
+/**
+ * @file
+ * Options decoders and encoders are opened with.
+ *
+ * The threading of a codec follows the options of the run: a given number
+ * of threads, or as many as FFmpeg considers useful, and slice threading
+ * only if frame threading's delay is unwanted. Codec options given by the
+ * caller are set on top of that. The options a context was opened with
+ * are part of its key in the codec cache, so that a context is only
+ * reused by a job asking for the same ones.
+ */
+
+#include "transcoder.h"
+
+#include <QThread>
+
+/**
+ * Build the options a codec is opened with.
+ * @param      codec      Decoder or encoder to be opened
+ * @param      given      Codec options of the caller
+ * @param      options    Threading settings of the run
+ * @param[out] dictionary Options to be passed to avcodec_open2()
+ * @param[out] key        Cache key the options are stored in
+ * @return Error code (0 if successful)
+ */
+int Transcoder::codecOptions(const AVCodec *codec,
+                             const QMap<QString, QString> &given,
+                             const TranscoderOptions &options,
+                             AVDictionary **dictionary, CodecKey *key)
+{
+    const AVDictionaryEntry *entry = nullptr;
+    int error;
+
+    if ((error = EncoderSelector::openOptions(codec, options.codecThreads,
+                                              dictionary)) < 0)
+        return error;
+    if (options.lowDelay &&
+        (error = av_dict_set(dictionary, "thread_type", "slice", 0)) < 0)
+        return error;
+    for (auto it = given.constBegin(); it != given.constEnd(); ++it)
+        if ((error = av_dict_set(dictionary, it.key().toUtf8().constData(),
+                                 it.value().toUtf8().constData(), 0)) < 0)
+            return error;
+
+    key->options.clear();
+    while ((entry = av_dict_get(*dictionary, "", entry, AV_DICT_IGNORE_SUFFIX))) {
+        key->options += entry->key;
+        key->options += '=';
+        key->options += entry->value;
+        key->options += ':';
+    }
+    return 0;
+}
+
+/**
+ * Report the options a codec did not use, like misspelled ones or ones
+ * of another encoder.
+ * @param codec      Codec that was opened
+ * @param dictionary Options left over by avcodec_open2()
+ */
+void Transcoder::reportUnusedOptions(const AVCodec *codec,
+                                     const AVDictionary *dictionary)
+{
+    const AVDictionaryEntry *entry = nullptr;
+
+    while ((entry = av_dict_get(dictionary, "", entry, AV_DICT_IGNORE_SUFFIX)))
+        fprintf(stderr, "Codec '%s' has no option '%s', ignoring it\n",
+                codec->name, entry->key);
+}
+
+/**
+ * Number of threads each codec may use if several of them run at once.
+ * The cores, or the threads of the options if set, are shared evenly,
+ * leaving at least one thread to every codec.
+ * @param options    Threading settings of the run
+ * @param concurrent Number of codecs running at the same time
+ * @return Number of threads per codec
+ */
+int Transcoder::codecThreadShare(const TranscoderOptions &options, int concurrent)
+{
+    const int threads = options.codecThreads > 0 ? options.codecThreads :
+                                                   QThread::idealThreadCount();
+
+    return FFMAX(threads / FFMAX(concurrent, 1), 1);
+}
@@ -0,0 +1,259 @@
+#include "downmix.h"
+
+#include <math.h>
+
+extern "C" {
+    #include "libavutil/channel_layout.h"
+    #include "libavutil/cpu.h"
+}
+
+#if defined(__x86_64__) || defined(_M_X64)
+#include <immintrin.h>
+#define DOWNMIX_X86 1
+#endif
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define DOWNMIX_NEON 1
+#endif
+
+/* Centre and surround level of the matrices, -3 dB. */
+static const double mixLevel = M_SQRT1_2;
+
+static void mixScalar(const float *const *input, const float *coefficients,
+                      int taps, float *output, int samples)
+{
+    for (int i = 0; i < samples; i++) {
+        float sum = coefficients[0] * input[0][i];
+
+        for (int k = 1; k < taps; k++)
+            sum += coefficients[k] * input[k][i];
+        output[i] = sum;
+    }
+}
+
+#ifdef DOWNMIX_X86
+#if defined(__GNUC__)
+__attribute__((target("avx2,fma")))
+#endif
+static void mixAvx2(const float *const *input, const float *coefficients,
+                    int taps, float *output, int samples)
+{
+    __m256 gains[DOWNMIX_MAX_INPUTS];
+    int i = 0;
+
+    for (int k = 0; k < taps; k++)
+        gains[k] = _mm256_set1_ps(coefficients[k]);
+    for (; i + 8 <= samples; i += 8) {
+        __m256 sum = _mm256_mul_ps(gains[0], _mm256_loadu_ps(input[0] + i));
+
+        for (int k = 1; k < taps; k++)
+            sum = _mm256_fmadd_ps(gains[k], _mm256_loadu_ps(input[k] + i), sum);
+        _mm256_storeu_ps(output + i, sum);
+    }
+    for (; i < samples; i++) {
+        float sum = coefficients[0] * input[0][i];
+
+        for (int k = 1; k < taps; k++)
+            sum += coefficients[k] * input[k][i];
+        output[i] = sum;
+    }
+}
+#endif
+
+#ifdef DOWNMIX_NEON
+static void mixNeon(const float *const *input, const float *coefficients,
+                    int taps, float *output, int samples)
+{
+    float32x4_t gains[DOWNMIX_MAX_INPUTS];
+    int i = 0;
+
+    for (int k = 0; k < taps; k++)
+        gains[k] = vdupq_n_f32(coefficients[k]);
+    for (; i + 4 <= samples; i += 4) {
+        float32x4_t sum = vmulq_f32(gains[0], vld1q_f32(input[0] + i));
+
+        for (int k = 1; k < taps; k++)
+            sum = vmlaq_f32(sum, gains[k], vld1q_f32(input[k] + i));
+        vst1q_f32(output + i, sum);
+    }
+    for (; i < samples; i++) {
+        float sum = coefficients[0] * input[0][i];
+
+        for (int k = 1; k < taps; k++)
+            sum += coefficients[k] * input[k][i];
+        output[i] = sum;
+    }
+}
+#endif
+
+Downmix::Downmix()
+    : kernel(mixScalar), replaced(nullptr)
+{
+    taps[0] = taps[1] = 0;
+}
+
+/**
+ * Compute the stereo downmix matrix of an input channel layout.
+ * Only layouts made of front, centre, LFE, side and back channels are
+ * supported; the LFE channel is dropped.
+ * @param      inputLayout    Channel layout of the input
+ * @param      outputChannels Number of output channels, must be 2
+ * @param      mode           Matrix to be used
+ * @param[out] matrix         Gain of every input channel, in layout order,
+ *                            for the left and the right output channel
+ * @return true if the layout can be downmixed
+ */
+bool Downmix::coefficients(uint64_t inputLayout, int outputChannels,
+                           DownmixMode mode,
+                           double matrix[DOWNMIX_OUTPUTS][DOWNMIX_MAX_INPUTS])
+{
+    const int inputs = av_get_channel_layout_nb_channels(inputLayout);
+    const double surround = mode == DownmixMode::LtRt ? -mixLevel : mixLevel;
+    double scale = 1.0;
+
+    if (outputChannels != DOWNMIX_OUTPUTS || inputs <= 0 ||
+        inputs > DOWNMIX_MAX_INPUTS || inputLayout == AV_CH_LAYOUT_STEREO)
+        return false;
+
+    for (int i = 0; i < inputs; i++) {
+        double *left  = &matrix[0][i];
+        double *right = &matrix[1][i];
+
+        switch (av_channel_layout_extract_channel(inputLayout, i)) {
+        case AV_CH_FRONT_LEFT:
+            *left = 1.0, *right = 0.0;
+            break;
+        case AV_CH_FRONT_RIGHT:
+            *left = 0.0, *right = 1.0;
+            break;
+        case AV_CH_FRONT_CENTER:
+            *left = *right = mixLevel;
+            break;
+        case AV_CH_LOW_FREQUENCY:
+            *left = *right = 0.0;
+            break;
+        case AV_CH_SIDE_LEFT:
+        case AV_CH_BACK_LEFT:
+            /* Lt/Rt sums all surrounds into one antiphase signal. */
+            *left  = surround;
+            *right = mode == DownmixMode::LtRt ? mixLevel : 0.0;
+            break;
+        case AV_CH_SIDE_RIGHT:
+        case AV_CH_BACK_RIGHT:
+            *left  = mode == DownmixMode::LtRt ? -mixLevel : 0.0;
+            *right = mode == DownmixMode::LtRt ? mixLevel : surround;
+            break;
+        case AV_CH_BACK_CENTER:
+            *left  = surround * mixLevel;
+            *right = mixLevel * mixLevel;
+            break;
+        default:
+            return false;
+        }
+    }
+
+    /* Keep the loudest possible mix at full scale. */
+    if (mode != DownmixMode::LoRo) {
+        for (int o = 0; o < DOWNMIX_OUTPUTS; o++) {
+            double sum = 0.0;
+
+            for (int i = 0; i < inputs; i++)
+                sum += fabs(matrix[o][i]);
+            scale = fmax(scale, sum);
+        }
+    }
+    for (int o = 0; o < DOWNMIX_OUTPUTS; o++)
+        for (int i = 0; i < inputs; i++)
+            matrix[o][i] /= scale;
+    return true;
+}
+
+/**
+ * Channel layout of the decoded audio. The decoder's layout is trusted if
+ * it matches the channel count; otherwise the default layout of the
+ * channel count is assumed.
+ * @param inputCodecContext Codec context of the input file
+ * @return Channel layout of the decoded samples
+ */
+uint64_t Downmix::inputLayout(const AVCodecContext *inputCodecContext)
+{
+    if (inputCodecContext->channel_layout &&
+        av_get_channel_layout_nb_channels(inputCodecContext->channel_layout) ==
+        inputCodecContext->channels)
+        return inputCodecContext->channel_layout;
+    return av_get_default_channel_layout(inputCodecContext->channels);
+}
+
+/**
+ * Take over the conversion of a resampler if it only has to downmix
+ * float planar samples, and pick the fastest kernel for the CPU.
+ * @param inputCodecContext  Codec context of the input file
+ * @param outputCodecContext Codec context of the output file
+ * @param mode               Matrix to be used
+ * @param resampleContext    Resampler set up for the same conversion
+ * @return true if the downmix replaces the resampler
+ */
+bool Downmix::configure(const AVCodecContext *inputCodecContext,
+                        const AVCodecContext *outputCodecContext,
+                        DownmixMode mode, const SwrContext *resampleContext)
+{
+    double matrix[DOWNMIX_OUTPUTS][DOWNMIX_MAX_INPUTS];
+    const int flags = av_get_cpu_flags();
+
+    replaced = nullptr;
+    if (!resampleContext ||
+        inputCodecContext->sample_fmt != AV_SAMPLE_FMT_FLTP ||
+        outputCodecContext->sample_fmt != AV_SAMPLE_FMT_FLTP ||
+        inputCodecContext->sample_rate != outputCodecContext->sample_rate ||
+        !coefficients(inputLayout(inputCodecContext), outputCodecContext->channels,
+                      mode, matrix))
+        return false;
+
+    for (int o = 0; o < DOWNMIX_OUTPUTS; o++) {
+        taps[o] = 0;
+        for (int i = 0; i < inputCodecContext->channels; i++) {
+            if (matrix[o][i] == 0.0)
+                continue;
+            channels[o][taps[o]] = i;
+            gains[o][taps[o]]    = (float)matrix[o][i];
+            taps[o]++;
+        }
+    }
+
+    kernel = mixScalar;
+#ifdef DOWNMIX_X86
+    if ((flags & AV_CPU_FLAG_AVX2) && (flags & AV_CPU_FLAG_FMA3))
+        kernel = mixAvx2;
+#endif
+#ifdef DOWNMIX_NEON
+    if (flags & AV_CPU_FLAG_NEON)
+        kernel = mixNeon;
+#endif
+    (void)flags;
+    replaced = resampleContext;
+    return true;
+}
+
+/**
+ * Downmix float planar samples.
+ * @param input   Planes of the input channels
+ * @param output  Planes of the two output channels
+ * @param samples Number of samples per channel
+ */
+void Downmix::process(const uint8_t **input, uint8_t **output, int samples) const
+{
+    for (int o = 0; o < DOWNMIX_OUTPUTS; o++) {
+        const float *planes[DOWNMIX_MAX_INPUTS];
+        float *out = (float *)output[o];
+
+        /* An output no input contributes to is silent. */
+        if (taps[o] == 0) {
+            for (int i = 0; i < samples; i++)
+                out[i] = 0.0f;
+            continue;
+        }
+        for (int k = 0; k < taps[o]; k++)
+            planes[k] = (const float *)input[channels[o][k]];
+        kernel(planes, gains[o], taps[o], out, samples);
+    }
+}
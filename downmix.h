@@ -0,0 +1,76 @@
+#ifndef DOWNMIX_H
+#define DOWNMIX_H
+
+#include <cstdint>
+
+#ifdef __cplusplus
+extern "C" {
+    #include "libavcodec/avcodec.h"
+    #include "libswresample/swresample.h"
+}
+#endif
+
+/* The maximum number of input channels a downmix can take */
+#define DOWNMIX_MAX_INPUTS 8
+/* The number of output channels of a downmix */
+#define DOWNMIX_OUTPUTS 2
+
+/* Matrix used to fold surround channels into stereo. */
+enum class DownmixMode
+{
+    /* ITU-R BS.775: centre and surrounds at -3 dB, scaled so that the
+     * mix never exceeds full scale. */
+    Itu,
+    /* Lo/Ro: the same levels without scaling, as loud as the source but
+     * possibly above full scale on loud surround content. */
+    LoRo,
+    /* Lt/Rt: matrix encoded surround, the surrounds summed in antiphase
+     * into left and right for Dolby Surround decoders. */
+    LtRt
+};
+
+/**
+ * Stereo downmix of float planar audio without libswresample.
+ * Every output sample is accumulated in a register from all the inputs it
+ * depends on and stored once. Kernels for AVX2 and NEON are chosen at run
+ * time if the CPU supports them. The conversion applies when input and
+ * output are float planar at the same sample rate, which is what most
+ * decoders deliver and what the AAC encoder takes; a libswresample context
+ * is set up with the same matrix for all other cases.
+ */
+class Downmix
+{
+    public:
+        Downmix();
+
+        static bool coefficients(uint64_t inputLayout, int outputChannels,
+                                 DownmixMode mode,
+                                 double matrix[DOWNMIX_OUTPUTS][DOWNMIX_MAX_INPUTS]);
+
+        static uint64_t inputLayout(const AVCodecContext *inputCodecContext);
+
+        bool configure(const AVCodecContext *inputCodecContext,
+                       const AVCodecContext *outputCodecContext,
+                       DownmixMode mode, const SwrContext *resampleContext);
+
+        bool replaces(const SwrContext *resampleContext) const
+        {
+            return resampleContext && resampleContext == replaced;
+        }
+
+        void process(const uint8_t **input, uint8_t **output, int samples) const;
+
+    private:
+        typedef void (*Kernel)(const float *const *input, const float *coefficients,
+                               int taps, float *output, int samples);
+
+        /* Non-zero coefficients of every output channel. */
+        int taps[DOWNMIX_OUTPUTS];
+        int channels[DOWNMIX_OUTPUTS][DOWNMIX_MAX_INPUTS];
+        float gains[DOWNMIX_OUTPUTS][DOWNMIX_MAX_INPUTS];
+        Kernel kernel;
+        /* Resampler whose conversion this downmix performs instead. */
+        const SwrContext *replaced;
+};
+
+#endif
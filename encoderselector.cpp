@@ -0,0 +1,173 @@
+#include "encoderselector.h"
+
+#include <stdio.h>
+
+extern "C" {
+    #include "libavutil/channel_layout.h"
+}
+
+/* Encoders of the selectable codecs, the fastest one first. Encoders
+ * flagged as hardware backed are preferred over all of these. */
+static const char *const knownEncoders[] = {
+    /* AudioToolbox, accelerated by the OS on macOS. */
+    "aac_at",
+    /* Media Foundation on Windows, possibly hardware backed. */
+    "aac_mf",
+    "libfdk_aac",
+    /* The native encoder's two-loop search is slowest. */
+    "aac",
+    "libopus",
+    /* Experimental, and limited to 48 kHz stereo. */
+    "opus"
+};
+
+EncoderSelector::EncoderSelector()
+    : probed(false)
+{
+}
+
+/**
+ * Find the encoders that are available and can be opened.
+ * Has to be called once before the selector is shared between threads.
+ */
+void EncoderSelector::probe()
+{
+    const int known = sizeof(knownEncoders) / sizeof(*knownEncoders);
+    QList<AVCodec *> hardware;
+    const AVCodec *iterated;
+    void *opaque = nullptr;
+
+    if (probed)
+        return;
+    probed = true;
+
+    /* Hardware encoders of the selectable codecs the table does not name. */
+    while ((iterated = av_codec_iterate(&opaque))) {
+        AVCodec *codec = const_cast<AVCodec *>(iterated);
+
+        if (av_codec_is_encoder(codec) && codec->type == AVMEDIA_TYPE_AUDIO &&
+            (codec->id == AV_CODEC_ID_AAC || codec->id == AV_CODEC_ID_OPUS) &&
+            (codec->capabilities & (AV_CODEC_CAP_HARDWARE | AV_CODEC_CAP_HYBRID)) &&
+            opens(codec))
+            hardware.append(codec);
+    }
+    available = hardware;
+
+    for (int i = 0; i < known; i++) {
+        AVCodec *codec = avcodec_find_encoder_by_name(knownEncoders[i]);
+
+        if (codec && !available.contains(codec) && opens(codec))
+            available.append(codec);
+    }
+}
+
+/**
+ * Check that an encoder can be opened with a typical stereo setup.
+ * @param codec Encoder to be checked
+ * @return true if the encoder could be opened
+ */
+bool EncoderSelector::opens(AVCodec *codec)
+{
+    AVCodecContext *avctx = avcodec_alloc_context3(codec);
+    int error;
+
+    if (!avctx)
+        return false;
+    avctx->channels       = 2;
+    avctx->channel_layout = AV_CH_LAYOUT_STEREO;
+    avctx->sample_rate    = ENCODER_PROBE_SAMPLE_RATE;
+    avctx->sample_fmt     = codec->sample_fmts ? codec->sample_fmts[0] :
+                                                 AV_SAMPLE_FMT_FLTP;
+    avctx->bit_rate       = ENCODER_PROBE_BIT_RATE;
+    avctx->strict_std_compliance = FF_COMPLIANCE_EXPERIMENTAL;
+
+    error = avcodec_open2(avctx, codec, nullptr);
+    avcodec_free_context(&avctx);
+    if (error < 0)
+        fprintf(stderr, "Encoder '%s' is not usable (error '%d')\n",
+                codec->name, error);
+    return error >= 0;
+}
+
+/**
+ * Check that an encoder supports a sample rate and channel count.
+ * @param codec      Encoder to be checked
+ * @param sampleRate Sample rate of the output in Hz
+ * @param channels   Number of output channels
+ * @return true if the encoder supports both
+ */
+bool EncoderSelector::supports(const AVCodec *codec, int sampleRate, int channels)
+{
+    const uint64_t layout = av_get_default_channel_layout(channels);
+
+    if (codec->supported_samplerates) {
+        const int *rate = codec->supported_samplerates;
+
+        while (*rate && *rate != sampleRate)
+            rate++;
+        if (!*rate)
+            return false;
+    }
+    if (codec->channel_layouts) {
+        const uint64_t *channelLayout = codec->channel_layouts;
+
+        while (*channelLayout && *channelLayout != layout)
+            channelLayout++;
+        if (!*channelLayout)
+            return false;
+    }
+    return true;
+}
+
+/**
+ * Pick the encoder for an output.
+ * The name of a codec ("aac", "opus", or empty for AAC) selects the
+ * fastest usable encoder of the codec that supports the output; any
+ * other name is looked up as the name of an encoder.
+ * @param name       Name of the codec or encoder
+ * @param sampleRate Sample rate of the output in Hz
+ * @param channels   Number of output channels
+ * @return Encoder, or nullptr if there is none
+ */
+AVCodec *EncoderSelector::select(const QByteArray &name, int sampleRate,
+                                 int channels) const
+{
+    const AVCodecDescriptor *descriptor =
+        avcodec_descriptor_get_by_name(name.isEmpty() ? "aac" : name.constData());
+
+    if (descriptor && descriptor->type == AVMEDIA_TYPE_AUDIO) {
+        for (AVCodec *codec : available)
+            if (codec->id == descriptor->id &&
+                supports(codec, sampleRate, channels))
+                return codec;
+    }
+    /* Either the name of an encoder or none of the codec's encoders fits;
+     * the caller reports why the encoder found here cannot be used. */
+    if (!name.isEmpty())
+        if (AVCodec *codec = avcodec_find_encoder_by_name(name.constData()))
+            return codec;
+    return descriptor ? avcodec_find_encoder(descriptor->id) : nullptr;
+}
+
+/**
+ * Threading options a decoder or encoder is opened with.
+ * Codecs that can run on several threads use the given number of them,
+ * or as many as FFmpeg considers useful; all others are kept from
+ * spawning any.
+ * @param      codec   Codec to be opened
+ * @param      threads Number of threads (0: automatic)
+ * @param[out] options Options to be passed to avcodec_open2()
+ * @return Error code (0 if successful)
+ */
+int EncoderSelector::openOptions(const AVCodec *codec, int threads,
+                                 AVDictionary **options)
+{
+    const int threaded = AV_CODEC_CAP_FRAME_THREADS | AV_CODEC_CAP_SLICE_THREADS |
+                         AV_CODEC_CAP_AUTO_THREADS;
+
+    if (!(codec->capabilities & threaded))
+        return av_dict_set(options, "threads", "1", 0);
+    if (threads > 0)
+        return av_dict_set_int(options, "threads", threads, 0);
+    return av_dict_set(options, "threads", "auto", 0);
+}
@@ -0,0 +1,52 @@
+#ifndef ENCODERSELECTOR_H
+#define ENCODERSELECTOR_H
+
+#include <QByteArray>
+#include <QList>
+
+#ifdef __cplusplus
+extern "C" {
+    #include "libavcodec/avcodec.h"
+}
+#endif
+
+/* Sample rate in Hz the encoders are opened with when probed */
+#define ENCODER_PROBE_SAMPLE_RATE 48000
+/* Bit rate in bit/s the encoders are opened with when probed */
+#define ENCODER_PROBE_BIT_RATE 128000
+
+/**
+ * Choice between the encoders available for one codec.
+ * FFmpeg may be built with several encoders of the same codec: for AAC the
+ * native one, libfdk_aac, AudioToolbox on macOS and Media Foundation on
+ * Windows, which may offload to hardware; for Opus libopus and the native
+ * one. probe() opens every one of them once, so that backends which are
+ * compiled in but unusable on this machine are never picked. select()
+ * then returns the fastest one that supports the requested output.
+ * Once probed, the selector may be used from any thread.
+ */
+class EncoderSelector
+{
+    public:
+        EncoderSelector();
+
+        void probe();
+
+        AVCodec *select(const QByteArray &name, int sampleRate,
+                        int channels) const;
+
+        static int openOptions(const AVCodec *codec, int threads,
+                               AVDictionary **options);
+
+        const QList<AVCodec *> &backends() const { return available; }
+
+    private:
+        static bool opens(AVCodec *codec);
+        static bool supports(const AVCodec *codec, int sampleRate, int channels);
+
+        /* Usable encoders, the fastest one of every codec first. */
+        QList<AVCodec *> available;
+        bool probed;
+};
+
+#endif
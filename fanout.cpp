@@ -0,0 +1,335 @@
+/**
+ * @file
+ * Fan-out of one decoded input to several renditions.
+ *
+ * The input is demuxed and decoded once on the calling thread. Renditions
+ * with the same sample format, channel count and sample rate share one
+ * resampler, whose converted frames are handed by reference to every one
+ * of them. Each rendition re-chunks, encodes and muxes its frames on a
+ * thread of its own, fed by a bounded lock-free queue.
+ */
+
+#include "transcoder.h"
+#include "spscqueue.h"
+
+#include <memory>
+#include <thread>
+#include <vector>
+
+/* One output file of a fan-out run. */
+struct FanOutRendition
+{
+    explicit FanOutRendition(int depth)
+        : frames(depth)
+    {
+    }
+
+    AVFormatContext *outputFormatContext = nullptr;
+    AVCodecContext *outputCodecContext = nullptr;
+    AVAudioFifo *fifo = nullptr;
+    /* Frames to be encoded, each one a reference of its own. A null
+     * pointer marks the end of the stream. */
+    SpscQueue<AVFrame *> frames;
+    /* Raised by any thread of the run to stop all others. */
+    std::atomic<bool> *abort = nullptr;
+    int error = 0;
+};
+
+/* Renditions sharing one sample format, channel count and sample rate. */
+struct FanOutGroup
+{
+    /* Codec context of the first rendition, describing the format. */
+    AVCodecContext *outputCodecContext = nullptr;
+    /* nullptr if the decoded samples can be passed through. */
+    SwrContext *resampleContext = nullptr;
+    /* Converted frames, recycled once no rendition references them. */
+    std::vector<AVFrame *> frames;
+    size_t next = 0;
+    std::vector<FanOutRendition *> renditions;
+};
+
+/**
+ * Hand one frame to every rendition of a group, by reference.
+ * @param group Renditions to be fed
+ * @param frame Frame to be handed out; stays owned by the caller
+ * @param abort Raised if the run is given up
+ * @return Error code (0 if successful)
+ */
+static int distributeFrame(FanOutGroup *group, AVFrame *frame,
+                           const std::atomic<bool> &abort)
+{
+    for (FanOutRendition *rendition : group->renditions) {
+        AVFrame *reference = av_frame_clone(frame);
+
+        if (!reference) {
+            fprintf(stderr, "Could not reference converted frame\n");
+            return AVERROR(ENOMEM);
+        }
+        if (!rendition->frames.push(reference, abort)) {
+            av_frame_free(&reference);
+            return AVERROR_EXIT;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Convert one decoded frame for a group of renditions and hand it to
+ * each of them.
+ * @param group Renditions sharing the conversion
+ * @param input Decoded frame, or nullptr at the end of the stream to
+ *              drain the samples delayed by the resampler
+ * @param abort Raised if the run is given up
+ * @return Error code (0 if successful)
+ */
+int Transcoder::convertAndDistribute(FanOutGroup *group, AVFrame *input,
+                                     const std::atomic<bool> &abort)
+{
+    AVCodecContext *outputCodecContext = group->outputCodecContext;
+    const int inputSize = input ? input->nb_samples : 0;
+    AVFrame *output;
+    int outputSize, converted, error;
+
+    /* Without a resampler the decoded frame is passed on as it is. */
+    if (!group->resampleContext) {
+        if (!input)
+            return 0;
+        input->channel_layout = outputCodecContext->channel_layout;
+        return distributeFrame(group, input, abort);
+    }
+
+    if ((outputSize = swr_get_out_samples(group->resampleContext,
+                                          inputSize)) <= 0)
+        return outputSize;
+
+    /* Take the least recently used frame. It is reallocated if a slow
+     * rendition still references its samples. */
+    output = group->frames[group->next];
+    group->next = (group->next + 1) % group->frames.size();
+    if ((error = FramePool::prepareFrame(output, outputCodecContext,
+                                         outputSize)) < 0)
+        return error;
+
+    if ((converted = convertSamples(input ? (const uint8_t **)input->extended_data :
+                                            nullptr, inputSize,
+                                    output->extended_data, outputSize,
+                                    group->resampleContext)) <= 0)
+        return converted;
+    output->nb_samples = converted;
+
+    return distributeFrame(group, output, abort);
+}
+
+/**
+ * Re-chunk the frames of one rendition to its encoder's frame size,
+ * encode and write them. Runs on its own thread, on a worker instance
+ * with timestamps and a pool of its own.
+ * @param rendition Rendition to be encoded
+ * @return Error code (0 if successful)
+ */
+int Transcoder::runRendition(FanOutRendition *rendition)
+{
+    AVFormatContext *outputFormatContext = rendition->outputFormatContext;
+    AVCodecContext *outputCodecContext   = rendition->outputCodecContext;
+    const int outputFrameSize = outputCodecContext->frame_size;
+    AVFrame *frame;
+
+    while (rendition->frames.pop(&frame, *rendition->abort)) {
+        int error;
+
+        /* At the end of the stream, encode the remaining samples
+         * and the frames delayed by the encoder. */
+        if (!frame) {
+            while (av_audio_fifo_size(rendition->fifo) > 0)
+                if (loadEncodeAndWrite(rendition->fifo, outputFormatContext,
+                                       outputCodecContext, 1))
+                    return AVERROR_EXIT;
+            return flushEncoder(outputFormatContext, outputCodecContext);
+        }
+
+        /* A frame lining up with the encoder's frames skips the FIFO. */
+        if (av_audio_fifo_size(rendition->fifo) == 0 &&
+            frame->nb_samples == outputFrameSize) {
+            int dataWritten;
+
+            error = encodeAudioFrame(frame, outputFormatContext,
+                                     outputCodecContext, &dataWritten);
+        } else {
+            error = storeSamples(rendition->fifo, outputFormatContext,
+                                 outputCodecContext, frame->extended_data,
+                                 frame->nb_samples);
+        }
+        av_frame_free(&frame);
+        if (error)
+            return error;
+
+        while (av_audio_fifo_size(rendition->fifo) >= outputFrameSize)
+            if (loadEncodeAndWrite(rendition->fifo, outputFormatContext,
+                                   outputCodecContext, 0))
+                return AVERROR_EXIT;
+    }
+
+    /* The run was given up. */
+    return AVERROR_EXIT;
+}
+
+/**
+ * Decode the input once and encode it into every output of the run.
+ * The engine option does not apply; the renditions are always encoded
+ * concurrently.
+ * @param inputFormatContext Format context of the opened input
+ * @param inputCodecContext  Codec context of the input
+ * @return Error code (0 if successful)
+ */
+int Transcoder::processFanOut(AVFormatContext *inputFormatContext,
+                              AVCodecContext *inputCodecContext)
+{
+    TranscoderOptions workerOptions = options;
+    AVFrame *inputFrame = nullptr;
+    std::vector<std::unique_ptr<FanOutRendition>> renditions;
+    std::vector<std::unique_ptr<FanOutGroup>> groups;
+    std::vector<std::unique_ptr<Transcoder>> workers;
+    std::vector<std::thread> threads;
+    std::atomic<bool> abort(false);
+    int finished = 0;
+    int depth;
+    int ret = AVERROR_EXIT;
+
+    /* Every group holds its own converted frames, and every rendition
+     * gets its share of the FIFO budget and of the cores. */
+    depth = framesInFlight(inputCodecContext, outputs.size());
+    workerOptions.memoryBudget /= FFMAX(outputs.size(), 1);
+    workerOptions.codecThreads  = codecThreadShare(options, outputs.size());
+
+    if (options.copyStreams)
+        fprintf(stderr, "Streams are not copied into renditions, dropping them\n");
+
+    /* Open every output and assign it to the group of its format. */
+    for (const OutputSpec &spec : outputs) {
+        renditions.emplace_back(new FanOutRendition(depth));
+        FanOutRendition *rendition = renditions.back().get();
+        FanOutGroup *group = nullptr;
+
+        rendition->abort = &abort;
+        if (openOutputFile(spec, outputSampleRate(spec, inputCodecContext),
+                           workerOptions, &rendition->outputFormatContext,
+                           &rendition->outputCodecContext))
+            goto cleanup;
+        if (initFifo(&rendition->fifo, inputCodecContext,
+                     rendition->outputCodecContext))
+            goto cleanup;
+
+        for (const std::unique_ptr<FanOutGroup> &candidate : groups)
+            if (formatsMatch(candidate->outputCodecContext,
+                             rendition->outputCodecContext))
+                group = candidate.get();
+        if (!group) {
+            groups.emplace_back(new FanOutGroup);
+            group = groups.back().get();
+            group->outputCodecContext = rendition->outputCodecContext;
+            if (!formatsMatch(inputCodecContext, rendition->outputCodecContext) &&
+                initResampler(inputCodecContext, rendition->outputCodecContext,
+                              options.resamplerQuality, options.downmix,
+                              &group->resampleContext))
+                goto cleanup;
+            /* The downmix kernels take over one conversion at most. */
+            if (groups.size() == 1)
+                downmix.configure(inputCodecContext, rendition->outputCodecContext,
+                                  options.downmix, group->resampleContext);
+            /* Every rendition may hold a queue full of frames, plus the
+             * one it is encoding. */
+            for (int i = 0; i < depth + 2; i++) {
+                AVFrame *frame = av_frame_alloc();
+
+                if (!frame) {
+                    fprintf(stderr, "Could not allocate fan-out frames\n");
+                    goto cleanup;
+                }
+                group->frames.push_back(frame);
+            }
+        }
+        group->renditions.push_back(rendition);
+    }
+
+    for (const std::unique_ptr<FanOutRendition> &rendition : renditions)
+        if (writeOutputFileHeader(rendition->outputFormatContext))
+            goto cleanup;
+    if (pool.inputFrame(&inputFrame))
+        goto cleanup;
+
+    /* Encode every rendition on a worker instance of its own. The first
+     * one taps its frames for the analysis files. */
+    for (const std::unique_ptr<FanOutRendition> &rendition : renditions) {
+        FanOutRendition *job = rendition.get();
+        Transcoder *worker   = new Transcoder(inputFile, nullptr, workerOptions);
+
+        if (workers.empty() && options.analysis.enabled() && outputs.first().stream)
+            fprintf(stderr, "Output is a stream, writing no analysis\n");
+        else if (workers.empty() && options.analysis.enabled())
+            worker->analyzer.reset(new AudioAnalyzer(options.analysis,
+                                                     job->outputCodecContext));
+        workers.emplace_back(worker);
+        threads.emplace_back([worker, job]() {
+            job->error = worker->runRendition(job);
+            if (job->error < 0)
+                job->abort->store(true);
+        });
+    }
+
+    /* Decode the whole input once, converting it for every group. */
+    ret = 0;
+    while (!finished && !ret) {
+        int dataPresent = 0;
+
+        if (decodeAudioFrame(inputFrame, inputFormatContext,
+                             inputCodecContext, &dataPresent, &finished)) {
+            ret = AVERROR_EXIT;
+            break;
+        }
+        for (size_t i = 0; i < groups.size() && !ret; i++)
+            if (dataPresent || finished)
+                ret = convertAndDistribute(groups[i].get(),
+                                           dataPresent ? inputFrame : nullptr,
+                                           abort);
+        av_frame_unref(inputFrame);
+    }
+    for (size_t i = 0; i < renditions.size() && !ret; i++)
+        if (!renditions[i]->frames.push(nullptr, abort))
+            ret = AVERROR_EXIT;
+    if (ret < 0)
+        abort.store(true);
+
+    for (std::thread &thread : threads)
+        thread.join();
+
+    for (const std::unique_ptr<FanOutRendition> &rendition : renditions)
+        if (!ret && rendition->error < 0)
+            ret = rendition->error;
+
+    for (size_t i = 0; i < renditions.size() && !ret; i++)
+        if (writeOutputFileTrailer(renditions[i]->outputFormatContext))
+            ret = AVERROR_EXIT;
+    if (!ret && workers.front()->analyzer &&
+        !workers.front()->analyzer->write(outputs.first().path))
+        ret = AVERROR_EXIT;
+
+cleanup:
+    for (const std::unique_ptr<FanOutRendition> &rendition : renditions) {
+        AVFrame *frame;
+
+        while (rendition->frames.tryPop(&frame))
+            av_frame_free(&frame);
+        if (rendition->fifo)
+            av_audio_fifo_free(rendition->fifo);
+        if (rendition->outputCodecContext)
+            closeCodec(options.codecCache, &rendition->outputCodecContext);
+        closeOutputFile(&rendition->outputFormatContext);
+    }
+    for (const std::unique_ptr<FanOutGroup> &group : groups) {
+        swr_free(&group->resampleContext);
+        for (AVFrame *frame : group->frames)
+            av_frame_free(&frame);
+    }
+
+    return ret;
+}
@@ -0,0 +1,105 @@
+/**
+ * @file
+ * Fragmented MP4 and HLS output.
+ *
+ * With a fragment duration set, MP4 output is written as fragments of
+ * that duration, each completed and flushed to the output as soon as its
+ * last packet is written, so that an upload or a player can take it while
+ * the rest is still being encoded. Other containers are flushed as often.
+ * HLS playlists (.m3u8) are written by FFmpeg's HLS muxer, as CMAF
+ * segments of fragmented MP4 next to the playlist, which is rewritten
+ * after every completed segment.
+ */
+
+#include "transcoder.h"
+
+#include <QFileInfo>
+
+/**
+ * Add the options fragmenting the output to the options of its muxer.
+ * Outputs that cannot be seeked and checkpointed outputs are fragmented
+ * too, as they need no index at the end.
+ * @param      outputFormatContext Format context of the output file
+ * @param[out] muxerOptions        Options to be passed to
+ *                                 avformat_write_header()
+ */
+void Transcoder::fragmentOptions(const AVFormatContext *outputFormatContext,
+                                 AVDictionary **muxerOptions)
+{
+    const char *name      = outputFormatContext->oformat->name;
+    const bool fragmented = options.fragmentDuration > 0;
+    QByteArray flags;
+
+    /* The HLS muxer opens the playlist and its segments itself. */
+    if (av_match_name(name, "hls")) {
+        const double seconds = (double)(fragmented ? options.fragmentDuration :
+                                                     HLS_SEGMENT_DURATION) /
+                               AV_TIME_BASE;
+        const QByteArray init =
+            QFileInfo(QString::fromLocal8Bit(outputFormatContext->url))
+                .completeBaseName().toLocal8Bit() + HLS_INIT_SUFFIX;
+
+        av_dict_set(muxerOptions, "hls_segment_type", "fmp4", 0);
+        av_dict_set(muxerOptions, "hls_fmp4_init_filename", init.constData(), 0);
+        av_dict_set(muxerOptions, "hls_time",
+                    QByteArray::number(seconds, 'f', 3).constData(), 0);
+        av_dict_set(muxerOptions, "hls_playlist_type", "event", 0);
+        av_dict_set(muxerOptions, "hls_flags", "independent_segments+temp_file", 0);
+        return;
+    }
+
+    /* MP4 seeks back to write its index at the end, which a fragmented
+     * MP4 does not need. Without a fragment index at the end, a continued
+     * file has no partial one. */
+    if (!av_match_name(name, "mp4,mov,ipod,ismv,3gp,3g2,psp") ||
+        (!fragmented && (outputFormatContext->pb->seekable & AVIO_SEEKABLE_NORMAL) &&
+         nextCheckpoint < 0))
+        return;
+    flags = "empty_moov+default_base_moof";
+    /* Fragments are completed by flushFragment() only. */
+    if (fragmented)
+        flags += "+frag_custom";
+    if (nextCheckpoint >= 0)
+        flags += "+omit_tfra";
+    if (resumePosition > 0)
+        flags += "+frag_discont";
+    av_dict_set(muxerOptions, "movflags", flags.constData(), 0);
+    if (!fragmented)
+        av_dict_set_int(muxerOptions, "frag_duration", OUTPUT_FRAGMENT_DURATION, 0);
+}
+
+/**
+ * Complete the pending fragment once the written packets reach its end,
+ * and hand everything written so far to the output.
+ * @param outputFormatContext Format context of the output file
+ * @param position            Output sample position the written packets
+ *                            reach up to
+ * @param sampleRate          Sample rate of the output in Hz
+ * @return Error code (0 if successful)
+ */
+int Transcoder::flushFragment(AVFormatContext *outputFormatContext,
+                              int64_t position, int sampleRate)
+{
+    const int64_t time = av_rescale(position, AV_TIME_BASE, sampleRate);
+    int error;
+
+    if (options.fragmentDuration <= 0 || time < nextFragment)
+        return 0;
+    nextFragment = time + options.fragmentDuration;
+    /* Muxers writing files of their own complete their segments. */
+    if (outputFormatContext->oformat->flags & AVFMT_NOFILE)
+        return 0;
+
+    if ((outputFormatContext->oformat->flags & AVFMT_ALLOW_FLUSH) &&
+        (error = av_write_frame(outputFormatContext, nullptr)) < 0) {
+        fprintf(stderr, "Could not flush output file (error '%d')\n", error);
+        return error;
+    }
+    avio_flush(outputFormatContext->pb);
+    if (outputFormatContext->pb->error < 0) {
+        fprintf(stderr, "Could not write output file (error '%d')\n",
+                outputFormatContext->pb->error);
+        return outputFormatContext->pb->error;
+    }
+    return 0;
+}
@@ -0,0 +1,343 @@
+#include "framepool.h"
+#include "memoryaccount.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+FramePool::FramePool()
+    : inPacket(nullptr), outPacket(nullptr), inFrame(nullptr), outFrame(nullptr),
+      outFrameCapacity(0), samples(nullptr), samplesCapacity(0),
+      samplesBytes(0), samplesChannels(0), samplesFormat(AV_SAMPLE_FMT_NONE)
+{
+}
+
+FramePool::~FramePool()
+{
+    release();
+}
+
+/**
+ * Hand out the packet used for reading from the input file.
+ * The packet is allocated on first use and unreferenced on every later
+ * call, so the previous contents must not be used anymore.
+ * @param[out] packet Reusable input packet
+ * @return Error code (0 if successful)
+ */
+int FramePool::inputPacket(AVPacket **packet)
+{
+    int error;
+
+    if (!inPacket && (error = initPacket(&inPacket)) < 0)
+        return error;
+    av_packet_unref(inPacket);
+    *packet = inPacket;
+    return 0;
+}
+
+/**
+ * Hand out the packet used for receiving encoded data.
+ * @param[out] packet Reusable output packet
+ * @return Error code (0 if successful)
+ */
+int FramePool::outputPacket(AVPacket **packet)
+{
+    int error;
+
+    if (!outPacket && (error = initPacket(&outPacket)) < 0)
+        return error;
+    av_packet_unref(outPacket);
+    *packet = outPacket;
+    return 0;
+}
+
+/**
+ * Hand out the frame used for receiving decoded data.
+ * @param[out] frame Reusable input frame
+ * @return Error code (0 if successful)
+ */
+int FramePool::inputFrame(AVFrame **frame)
+{
+    int error;
+
+    if (!inFrame && (error = initFrame(&inFrame)) < 0)
+        return error;
+    av_frame_unref(inFrame);
+    *frame = inFrame;
+    return 0;
+}
+
+/**
+ * Hand out the frame used for sending samples to the encoder.
+ * The sample buffer of the frame is kept between calls and only
+ * reallocated if it is too small or the output format has changed.
+ * @param[out] frame                Reusable output frame holding
+ *                                  exactly frameSize samples
+ * @param      outputCodecContext   Codec context of the output file
+ * @param      frameSize            Number of samples in the frame
+ * @return Error code (0 if successful)
+ */
+int FramePool::outputFrame(AVFrame **frame, AVCodecContext *outputCodecContext,
+                           int frameSize)
+{
+    int error;
+
+    if (!outFrame && (error = initFrame(&outFrame)) < 0)
+        return error;
+
+    if (frameSize > outFrameCapacity ||
+        outFrame->format != outputCodecContext->sample_fmt ||
+        outFrame->channel_layout != outputCodecContext->channel_layout) {
+        const int capacity = FFMAX(frameSize, outputCodecContext->frame_size);
+
+        av_frame_unref(outFrame);
+        outFrameCapacity = 0;
+        if ((error = initOutputFrame(outFrame, outputCodecContext, capacity)) < 0)
+            return error;
+        outFrameCapacity = capacity;
+    } else {
+        /* The encoder may still hold a reference to the samples of the
+         * previous frame. Only copy them away if this is the case. */
+        outFrame->nb_samples = outFrameCapacity;
+        if ((error = av_frame_make_writable(outFrame)) < 0) {
+            fprintf(stderr, "Could not make output frame writable (error '%d')\n",
+                    error);
+            return error;
+        }
+    }
+
+    outFrame->nb_samples = frameSize;
+    outFrame->pts        = AV_NOPTS_VALUE;
+    *frame = outFrame;
+    return 0;
+}
+
+/**
+ * Hand out a temporary storage for converted audio samples.
+ * The storage is reallocated only if it cannot hold frameSize samples
+ * in the output format.
+ * @param[out] samples              Array of converted samples. The
+ *                                  dimensions are channel (for
+ *                                  multi-channel audio), sample.
+ * @param      outputCodecContext   Codec context of the output file
+ * @param      frameSize            Number of samples to be stored
+ * @return Error code (0 if successful)
+ */
+int FramePool::convertedSamples(uint8_t ***samples,
+                                AVCodecContext *outputCodecContext,
+                                int frameSize)
+{
+    int error;
+
+    if (!this->samples || frameSize > samplesCapacity ||
+        samplesChannels != outputCodecContext->channels ||
+        samplesFormat != outputCodecContext->sample_fmt) {
+        freeConvertedSamples(&this->samples);
+        MemoryAccount::credit(samplesBytes);
+        samplesCapacity = 0;
+        samplesBytes    = 0;
+        if ((error = initConvertedSamples(&this->samples, outputCodecContext,
+                                          frameSize)) < 0)
+            return error;
+        samplesCapacity = frameSize;
+        samplesBytes    = av_samples_get_buffer_size(nullptr,
+                                                     outputCodecContext->channels,
+                                                     frameSize,
+                                                     outputCodecContext->sample_fmt, 0);
+        MemoryAccount::charge(samplesBytes);
+        samplesChannels = outputCodecContext->channels;
+        samplesFormat   = outputCodecContext->sample_fmt;
+    }
+
+    *samples = this->samples;
+    return 0;
+}
+
+/**
+ * Number of samples the buffer of an audio frame can hold.
+ * @param frame Frame with allocated samples
+ * @return Capacity in samples per channel
+ */
+int FramePool::frameCapacity(const AVFrame *frame)
+{
+    const enum AVSampleFormat format = (enum AVSampleFormat)frame->format;
+    const int bytes = av_get_bytes_per_sample(format);
+
+    if (!frame->buf[0] || bytes <= 0)
+        return 0;
+    if (av_sample_fmt_is_planar(format))
+        return frame->linesize[0] / bytes;
+    return frame->linesize[0] / (bytes * frame->channels);
+}
+
+/**
+ * Make a recycled frame ready to receive converted samples.
+ * Its buffer is only reallocated if it is too small or still
+ * referenced elsewhere, e.g. by an encoder.
+ * @param frame                 Frame to prepare
+ * @param outputCodecContext    Codec context of the output file
+ * @param frameSize             Number of samples to be stored
+ * @return Error code (0 if successful)
+ */
+int FramePool::prepareFrame(AVFrame *frame,
+                            AVCodecContext *outputCodecContext,
+                            int frameSize)
+{
+    int error;
+
+    if (frame->format == outputCodecContext->sample_fmt &&
+        frame->channel_layout == outputCodecContext->channel_layout &&
+        frameCapacity(frame) >= frameSize && av_frame_is_writable(frame)) {
+        frame->nb_samples = frameSize;
+        return 0;
+    }
+
+    av_frame_unref(frame);
+    frame->nb_samples     = FFMAX(frameSize, outputCodecContext->frame_size);
+    frame->channel_layout = outputCodecContext->channel_layout;
+    frame->format         = outputCodecContext->sample_fmt;
+    frame->sample_rate    = outputCodecContext->sample_rate;
+    if ((error = av_frame_get_buffer(frame, 0)) < 0) {
+        fprintf(stderr, "Could not allocate converted frame samples (error '%d')\n",
+                error);
+        return error;
+    }
+    frame->nb_samples = frameSize;
+    return 0;
+}
+
+/**
+ * Free all pooled objects. The pool can be used again afterwards.
+ */
+void FramePool::release()
+{
+    av_packet_free(&inPacket);
+    av_packet_free(&outPacket);
+    av_frame_free(&inFrame);
+    av_frame_free(&outFrame);
+    outFrameCapacity = 0;
+    freeConvertedSamples(&samples);
+    MemoryAccount::credit(samplesBytes);
+    samplesCapacity = 0;
+    samplesBytes    = 0;
+    samplesChannels = 0;
+    samplesFormat   = AV_SAMPLE_FMT_NONE;
+}
+
+/**
+ * Initialize one data packet for reading or writing.
+ * @param[out] packet Packet to be initialized
+ * @return Error code (0 if successful)
+ */
+int FramePool::initPacket(AVPacket **packet)
+{
+    if (!(*packet = av_packet_alloc())) {
+        fprintf(stderr, "Could not allocate packet\n");
+        return AVERROR(ENOMEM);
+    }
+    return 0;
+}
+
+/**
+ * Initialize one audio frame.
+ * @param[out] frame Frame to be initialized
+ * @return Error code (0 if successful)
+ */
+int FramePool::initFrame(AVFrame **frame)
+{
+    if (!(*frame = av_frame_alloc())) {
+        fprintf(stderr, "Could not allocate frame\n");
+        return AVERROR(ENOMEM);
+    }
+    return 0;
+}
+
+/**
+ * Allocate the samples of one frame for writing to the output file.
+ * The frame will be exactly frameSize samples large.
+ * @param frame                 Frame to allocate the samples for
+ * @param outputCodecContext    Codec context of the output file
+ * @param frameSize             Size of the frame
+ * @return Error code (0 if successful)
+ */
+int FramePool::initOutputFrame(AVFrame *frame,
+                               AVCodecContext *outputCodecContext,
+                               int frameSize)
+{
+    int error;
+
+    /* Set the frame's parameters, especially its size and format.
+     * av_frame_get_buffer needs this to allocate memory for the
+     * audio samples of the frame.
+     * Default channel layouts based on the number of channels
+     * are assumed for simplicity. */
+    frame->nb_samples     = frameSize;
+    frame->channel_layout = outputCodecContext->channel_layout;
+    frame->format         = outputCodecContext->sample_fmt;
+    frame->sample_rate    = outputCodecContext->sample_rate;
+
+    /* Allocate the samples of the created frame. This call will make
+     * sure that the audio frame can hold as many samples as specified. */
+    if ((error = av_frame_get_buffer(frame, 0)) < 0) {
+        fprintf(stderr, "Could not allocate output frame samples (error '%d')\n",
+                error);
+        av_frame_unref(frame);
+        return error;
+    }
+
+    return 0;
+}
+
+/**
+ * Initialize a temporary storage for the specified number of audio samples.
+ * The conversion requires temporary storage due to the different format.
+ * @param[out] convertedInputSamples   Array of converted samples. The
+ *                                     dimensions are reference, channel
+ *                                     (for multi-channel audio), sample.
+ * @param      outputCodecContext      Codec context of the output file
+ * @param      frameSize               Number of samples to be converted in
+ *                                     each round
+ * @return Error code (0 if successful)
+ */
+int FramePool::initConvertedSamples(uint8_t ***convertedInputSamples,
+                                    AVCodecContext *outputCodecContext,
+                                    int frameSize)
+{
+    int error;
+
+    /* Allocate as many pointers as there are audio channels.
+     * Each pointer will later point to the audio samples of the corresponding
+     * channels (although it may be nullptr for interleaved formats).
+     */
+    if (!(*convertedInputSamples = (uint8_t **) calloc(outputCodecContext->channels,
+                                            sizeof(**convertedInputSamples)))) {
+        fprintf(stderr, "Could not allocate converted input sample pointers\n");
+        return AVERROR(ENOMEM);
+    }
+
+    /* Allocate memory for the samples of all channels in one consecutive
+     * block for convenience. */
+    if ((error = av_samples_alloc(*convertedInputSamples, nullptr,
+                                  outputCodecContext->channels,
+                                  frameSize,
+                                  outputCodecContext->sample_fmt, 0)) < 0) {
+        fprintf(stderr,
+                "Could not allocate converted input samples (error '%d')\n",
+                error);
+        freeConvertedSamples(convertedInputSamples);
+        return error;
+    }
+    return 0;
+}
+
+/**
+ * Free a temporary sample storage created by initConvertedSamples.
+ * @param convertedInputSamples Storage to be freed. Set to nullptr.
+ */
+void FramePool::freeConvertedSamples(uint8_t ***convertedInputSamples)
+{
+    if (*convertedInputSamples) {
+        av_freep(&(*convertedInputSamples)[0]);
+        free(*convertedInputSamples);
+        *convertedInputSamples = nullptr;
+    }
+}
@@ -0,0 +1,77 @@
+#ifndef FRAMEPOOL_H
+#define FRAMEPOOL_H
+
+#ifdef __cplusplus
+extern "C" {
+    #include "libavcodec/avcodec.h"
+    #include "libavutil/frame.h"
+    #include "libavutil/samplefmt.h"
+}
+#endif
+
+/**
+ * Reusable packets, frames and sample buffers for the transcoding loop.
+ * Every object is allocated on first use and then reset and handed out
+ * again, so that the steady-state loop does not allocate memory.
+ * Buffers only grow if a request does not fit into the current capacity.
+ */
+class FramePool
+{
+    public:
+        FramePool();
+        ~FramePool();
+
+        int inputPacket(AVPacket **packet);
+
+        int outputPacket(AVPacket **packet);
+
+        int inputFrame(AVFrame **frame);
+
+        int outputFrame(AVFrame **frame, AVCodecContext *outputCodecContext,
+                        int frameSize);
+
+        int convertedSamples(uint8_t ***samples,
+                             AVCodecContext *outputCodecContext,
+                             int frameSize);
+
+        void release();
+
+        static int prepareFrame(AVFrame *frame,
+                                AVCodecContext *outputCodecContext,
+                                int frameSize);
+
+    private:
+        FramePool(const FramePool &) = delete;
+        FramePool &operator=(const FramePool &) = delete;
+
+        static int initPacket(AVPacket **packet);
+
+        static int initFrame(AVFrame **frame);
+
+        static int initOutputFrame(AVFrame *frame,
+                                   AVCodecContext *outputCodecContext,
+                                   int frameSize);
+
+        static int initConvertedSamples(uint8_t ***convertedInputSamples,
+                                        AVCodecContext *outputCodecContext,
+                                        int frameSize);
+
+        static void freeConvertedSamples(uint8_t ***convertedInputSamples);
+
+        static int frameCapacity(const AVFrame *frame);
+
+        AVPacket *inPacket;
+        AVPacket *outPacket;
+        AVFrame *inFrame;
+        AVFrame *outFrame;
+        int outFrameCapacity;
+        uint8_t **samples;
+        int samplesCapacity;
+        /* Size of the converted sample storage, as charged to the
+         * MemoryAccount. */
+        int64_t samplesBytes;
+        int samplesChannels;
+        enum AVSampleFormat samplesFormat;
+};
+
+#endif
@@ -1,14 +1,642 @@
+#include <QCommandLineParser>
+#include <QCoreApplication>
+#include <QDebug>
+#include <QDir>
+#include <QFileInfo>
+#include <QJsonDocument>
+#include <QSaveFile>
+#include <QScopedPointer>
+#include <QThread>
+
 #include "transcoder.h"
+#include "batchrunner.h"
+#include "transcodeservice.h"
+
+#include <errno.h>
+#include <stdio.h>
+
+/* Parse a bit rate given in bit/s, or in kbit/s with a 'k' suffix. */
+static int parseBitRate(QString value, bool *ok)
+{
+    int factor = 1;
+
+    if (value.endsWith('k', Qt::CaseInsensitive)) {
+        value.chop(1);
+        factor = 1000;
+    }
+    const int bitRate = value.toInt(ok) * factor;
+    *ok = *ok && bitRate > 0;
+    return bitRate;
+}
+
+/* Parse a size given in bytes, or with a 'k', 'M' or 'G' suffix. */
+static qint64 parseSize(QString value, bool *ok)
+{
+    qint64 factor = 1;
+
+    if (value.endsWith('k', Qt::CaseInsensitive))
+        factor = 1024;
+    else if (value.endsWith('M', Qt::CaseInsensitive))
+        factor = 1024 * 1024;
+    else if (value.endsWith('G', Qt::CaseInsensitive))
+        factor = 1024 * 1024 * 1024;
+    if (factor > 1)
+        value.chop(1);
+    const qint64 size = value.toLongLong(ok) * factor;
+    *ok = *ok && size >= 0;
+    return size;
+}
+
+/* Parse a rendition given as "file[,key=value...]", the keys being
+ * codec, bitrate, channels and rate. */
+static bool parseRendition(const QString &value, OutputSpec *spec)
+{
+    const QStringList fields = value.split(',');
+
+    spec->path = fields.first();
+    if (spec->path.isEmpty()) {
+        fprintf(stderr, "Rendition without output file '%s'\n",
+                value.toLocal8Bit().constData());
+        return false;
+    }
+
+    for (int i = 1; i < fields.size(); i++) {
+        const int separator   = fields.at(i).indexOf('=');
+        const QString key     = fields.at(i).left(separator);
+        const QString setting = fields.at(i).mid(separator + 1);
+        bool ok = true;
+
+        if (separator <= 0) {
+            ok = false;
+        } else if (key == "codec") {
+            spec->codec = setting;
+        } else if (key == "bitrate") {
+            spec->bitRate = parseBitRate(setting, &ok);
+        } else if (key == "channels") {
+            spec->channels = setting.toInt(&ok);
+            ok = ok && spec->channels > 0;
+        } else if (key == "rate") {
+            spec->sampleRate = setting.toInt(&ok);
+            ok = ok && spec->sampleRate > 0;
+        } else {
+            ok = false;
+        }
+        if (!ok) {
+            fprintf(stderr, "Invalid rendition setting '%s'\n",
+                    fields.at(i).toLocal8Bit().constData());
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Parse codec options given as "key=value" each. */
+static bool parseCodecOptions(const QStringList &values,
+                              QMap<QString, QString> *codecOptions)
+{
+    for (const QString &value : values) {
+        const int separator = value.indexOf('=');
+
+        if (separator <= 0) {
+            fprintf(stderr, "Invalid codec option '%s'\n",
+                    value.toLocal8Bit().constData());
+            return false;
+        }
+        codecOptions->insert(value.left(separator), value.mid(separator + 1));
+    }
+    return true;
+}
+
+/* Read the input from stdin. */
+static int readStandardInput(uint8_t *buffer, int size)
+{
+    const size_t bytes = fread(buffer, 1, size, stdin);
+
+    if (bytes == 0 && ferror(stdin))
+        return AVERROR(errno);
+    return (int)bytes;
+}
+
+/* Write the output to stdout. */
+static int writeStandardOutput(const uint8_t *buffer, int size)
+{
+    if (fwrite(buffer, 1, size, stdout) != (size_t)size)
+        return AVERROR(errno);
+    return size;
+}
+
+/* Write the metrics of the run as JSON. */
+static bool writeMetrics(const QString &path, const TranscodeMetrics &metrics)
+{
+    QSaveFile file(path);
+
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate) ||
+        file.write(QJsonDocument(metrics.json()).toJson()) < 0 ||
+        !file.commit()) {
+        fprintf(stderr, "Could not write metrics to '%s'\n",
+                path.toLocal8Bit().constData());
+        return false;
+    }
+    return true;
+}
+
+static int runBatch(const QString &source, const QString &outputDir,
+                    const QString &extension, int threadCount,
+                    const TranscoderOptions &options)
+{
+    QList<BatchJob> jobs;
+    bool ok;
+
+    if (QFileInfo(source).isDir()) {
+        if (outputDir.isEmpty()) {
+            fprintf(stderr, "An output directory is required to transcode a directory\n");
+            return 1;
+        }
+        ok = BatchRunner::scanDirectory(source, outputDir, extension, &jobs);
+    } else {
+        ok = BatchRunner::loadManifest(source, outputDir, extension, &jobs);
+    }
+    if (!ok)
+        return 1;
+
+    if (!outputDir.isEmpty() && !QDir().mkpath(outputDir)) {
+        fprintf(stderr, "Could not create output directory '%s'\n",
+                outputDir.toLocal8Bit().constData());
+        return 1;
+    }
+
+    BatchRunner runner(threadCount, options);
+    return runner.run(jobs) == 0 ? 0 : 1;
+}
 
 int main(int argc, char **argv)
 {
-    if (argc != 3) {
+    QCoreApplication app(argc, argv);
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Transcode audio files to AAC using the FFmpeg API.");
+    parser.addHelpOption();
+    parser.addPositionalArgument("input", "File to be transcoded.");
+    parser.addPositionalArgument("output", "File to be created.");
+
+    QCommandLineOption daemonOption("daemon",
+            "Run as a service taking jobs on a local socket, with -j jobs "
+            "at the same time.",
+            "socket");
+    QCommandLineOption batchOption("batch",
+            "Transcode every job of a manifest file or every file of a directory.",
+            "manifest|directory");
+    QCommandLineOption probeOption("probe",
+            "Only read the duration, format and audio parameters of the "
+            "input files, or of all files below input directories, with -j "
+            "probes at the same time, and print them as JSON lines.");
+    QCommandLineOption outputDirOption(QStringList() << "o" << "output-dir",
+            "Directory for batch outputs without an explicit output file.",
+            "directory");
+    QCommandLineOption jobsOption(QStringList() << "j" << "jobs",
+            "Number of jobs transcoded at the same time in batch mode.",
+            "count", QString::number(QThread::idealThreadCount()));
+    QCommandLineOption extensionOption("extension",
+            "Extension (and thereby container format) of batch outputs.",
+            "extension", "mp4");
+    QCommandLineOption engineOption("engine",
+            "Transcoding engine: 'sequential', 'pipelined' (decode, resample "
+            "and encode on separate threads) or 'segmented' (time ranges of "
+            "the input encoded in parallel).",
+            "engine", "sequential");
+    QCommandLineOption segmentsOption("segments",
+            "Number of time ranges encoded in parallel by the segmented engine "
+            "(default: one per core).",
+            "count", "0");
+    QCommandLineOption sampleRateOption("sample-rate",
+            "Sample rate of the output in Hz (default: the input's rate).",
+            "rate", "0");
+    QCommandLineOption startOption("start",
+            "Start of the clip to be transcoded in seconds (default: the "
+            "beginning of the input).",
+            "seconds", "0");
+    QCommandLineOption durationOption("duration",
+            "Duration of the clip to be transcoded in seconds (default: up to "
+            "the end of the input).",
+            "seconds", "0");
+    QCommandLineOption resamplerOption("resampler",
+            "Sample rate conversion quality: 'fast' (short linear filter), "
+            "'default' or 'high' (soxr if available).",
+            "quality", "default");
+    QCommandLineOption downmixOption("downmix",
+            "Matrix used to encode surround or mono input as stereo: 'itu' "
+            "(normalized), 'loro' (not normalized) or 'ltrt' (matrix "
+            "encoded surround).",
+            "matrix", "itu");
+    QCommandLineOption renditionOption("rendition",
+            "Additional output encoded from the same decoded input, as "
+            "file[,codec=name][,bitrate=96k][,channels=2][,rate=48000]. "
+            "May be given several times.",
+            "spec");
+    QCommandLineOption formatOption("format",
+            "Container format of the output (default: guessed from the file "
+            "name, fragmented mp4 for stdout).",
+            "name");
+    QCommandLineOption ioBufferOption("io-buffer",
+            "Buffer size for reading stdin and writing stdout in bytes.",
+            "bytes", QString::number(STREAM_IO_BUFFER_SIZE));
+    QCommandLineOption trustedInputOption("trusted-input",
+            "Probe only the start of well-formed inputs and skip the stream "
+            "analysis if their header describes them completely.");
+    QCommandLineOption inputFormatOption("input-format",
+            "Container format of the input (default: probed).",
+            "name");
+    QCommandLineOption audioStreamOption("audio-stream",
+            "Index of the input stream to be transcoded (default: the best "
+            "audio stream).",
+            "index", "-1");
+    QCommandLineOption copyStreamsOption("copy-streams",
+            "Copy the other streams of the input, like video or cover art, "
+            "into the output without re-encoding them.");
+    QCommandLineOption noRemuxOption("no-remux",
+            "Transcode inputs that already have the codec, channels, sample "
+            "rate and bit rate of the output instead of copying their packets.");
+    QCommandLineOption exactEncoderOption("exact-encoder",
+            "Use the encoder a codec name stands for in FFmpeg instead of "
+            "the fastest one available for the codec.");
+    QCommandLineOption encoderOptionOption("encoder-option",
+            "Option the encoders are opened with, e.g. aac_coder=fast or "
+            "profile=aac_low; may be given several times.",
+            "key=value");
+    QCommandLineOption decoderOptionOption("decoder-option",
+            "Option the decoder is opened with; may be given several times.",
+            "key=value");
+    QCommandLineOption codecThreadsOption("codec-threads",
+            "Threads every decoder and encoder may use (default: as many as "
+            "useful, shared among the jobs in batch and service mode).",
+            "count", "0");
+    QCommandLineOption analyzeOption("analyze",
+            "Measurements taken of the output in the same pass, any of "
+            "'loudness' (EBU R128 and true peak), 'silence' and 'waveform', "
+            "separated by commas; written next to the output.",
+            "measurements");
+    QCommandLineOption waveformZoomOption("waveform-zoom",
+            "Samples summarised by one waveform point.",
+            "samples", "256");
+    QCommandLineOption waveformJsonOption("waveform-json",
+            "Write the waveform as JSON instead of the binary format.");
+    QCommandLineOption silenceThresholdOption("silence-threshold",
+            "Level in dBFS below which the output counts as silent.",
+            "dB", "-60");
+    QCommandLineOption silenceDurationOption("silence-duration",
+            "Duration in seconds a silence has to last at least.",
+            "seconds", "2");
+    QCommandLineOption normalizeOption("normalize",
+            "Normalize the output to an integrated loudness in LUFS, "
+            "measured in a first pass over a temporary spill of the "
+            "decoded samples.",
+            "LUFS");
+    QCommandLineOption truePeakLimitOption("true-peak-limit",
+            "True peak in dBTP normalization may raise the output to at most.",
+            "dBTP", "-1");
+    QCommandLineOption scratchDirOption("scratch-dir",
+            "Directory of the temporary spill of normalization (default: the "
+            "system's temporary directory).",
+            "directory");
+    QCommandLineOption lowDelayOption("low-delay",
+            "Keep the codecs to slice threading, which does not delay the "
+            "frames like frame threading does.");
+    QCommandLineOption memoryBudgetOption("memory-budget",
+            "Memory the sample buffers of one job may take, e.g. 16M; caps "
+            "the FIFO size and the queue depth (default: unlimited).",
+            "bytes", "0");
+    QCommandLineOption metricsPortOption("metrics-port",
+            "Serve the metrics of the daemon to Prometheus over HTTP on this port.",
+            "port");
+    QCommandLineOption metricsJsonOption("metrics-json",
+            "Write a JSON summary of the run's metrics to this file at exit "
+            "(not in daemon mode, which runs until it is killed).",
+            "file");
+    QCommandLineOption checkpointOption("checkpoint-interval",
+            "Save the progress every so many seconds of output to "
+            "<output>" CHECKPOINT_SUFFIX ", and continue from there if the "
+            "job is run again after being stopped (default: no checkpoints).",
+            "seconds", "0");
+    QCommandLineOption fragmentOption("fragment-duration",
+            "Write MP4 output as fragments of so many seconds, each flushed "
+            "as soon as it is complete, and flush other output as often; "
+            "the segment duration of HLS (.m3u8) output (default: no "
+            "low-latency flushing, HLS segments of 2 seconds).",
+            "seconds", "0");
+    QCommandLineOption resultCacheOption("result-cache",
+            "Take the outputs of inputs transcoded before with the same "
+            "settings from this directory, and keep new outputs there.",
+            "directory");
+    QCommandLineOption resultCacheSizeOption("result-cache-size",
+            "Size the result cache is kept below by removing the least "
+            "recently used outputs, e.g. 10G (0: unlimited).",
+            "bytes", "10G");
+    QCommandLineOption noMmapOption("no-mmap",
+            "Read local input files with read() calls instead of a memory mapping.");
+    parser.addOption(daemonOption);
+    parser.addOption(batchOption);
+    parser.addOption(probeOption);
+    parser.addOption(outputDirOption);
+    parser.addOption(jobsOption);
+    parser.addOption(extensionOption);
+    parser.addOption(engineOption);
+    parser.addOption(segmentsOption);
+    parser.addOption(sampleRateOption);
+    parser.addOption(startOption);
+    parser.addOption(durationOption);
+    parser.addOption(resamplerOption);
+    parser.addOption(downmixOption);
+    parser.addOption(renditionOption);
+    parser.addOption(formatOption);
+    parser.addOption(ioBufferOption);
+    parser.addOption(trustedInputOption);
+    parser.addOption(inputFormatOption);
+    parser.addOption(audioStreamOption);
+    parser.addOption(copyStreamsOption);
+    parser.addOption(noRemuxOption);
+    parser.addOption(exactEncoderOption);
+    parser.addOption(encoderOptionOption);
+    parser.addOption(decoderOptionOption);
+    parser.addOption(codecThreadsOption);
+    parser.addOption(lowDelayOption);
+    parser.addOption(analyzeOption);
+    parser.addOption(waveformZoomOption);
+    parser.addOption(waveformJsonOption);
+    parser.addOption(silenceThresholdOption);
+    parser.addOption(silenceDurationOption);
+    parser.addOption(normalizeOption);
+    parser.addOption(truePeakLimitOption);
+    parser.addOption(scratchDirOption);
+    parser.addOption(memoryBudgetOption);
+    parser.addOption(metricsPortOption);
+    parser.addOption(metricsJsonOption);
+    parser.addOption(checkpointOption);
+    parser.addOption(fragmentOption);
+    parser.addOption(resultCacheOption);
+    parser.addOption(resultCacheSizeOption);
+    parser.addOption(noMmapOption);
+    parser.process(app);
+
+    TranscoderOptions options;
+    const QString engine = parser.value(engineOption);
+    if (engine == "pipelined") {
+        options.engine = TranscodeEngine::Pipelined;
+    } else if (engine == "segmented") {
+        options.engine   = TranscodeEngine::Segmented;
+        options.segments = parser.value(segmentsOption).toInt();
+    } else if (engine != "sequential") {
+        fprintf(stderr, "Unknown engine '%s'\n", engine.toLocal8Bit().constData());
+        return 1;
+    }
+
+    /* Probe the encoders once; every job and thread picks from them. */
+    EncoderSelector encoders;
+    if (!parser.isSet(exactEncoderOption)) {
+        encoders.probe();
+        options.encoders = &encoders;
+    }
+
+    TranscodeMetrics metrics;
+    const QString metricsJson = parser.value(metricsJsonOption);
+    if (parser.isSet(metricsPortOption) || !metricsJson.isEmpty())
+        options.metrics = &metrics;
+
+    options.mapInput     = !parser.isSet(noMmapOption);
+    options.trustedInput = parser.isSet(trustedInputOption);
+    options.inputFormat  = parser.value(inputFormatOption);
+    options.audioStream  = parser.value(audioStreamOption).toInt();
+    options.copyStreams  = parser.isSet(copyStreamsOption);
+    options.remux        = !parser.isSet(noRemuxOption);
+    options.lowDelay     = parser.isSet(lowDelayOption);
+    bool codecThreadsOk;
+    options.codecThreads = parser.value(codecThreadsOption).toInt(&codecThreadsOk);
+    if (!codecThreadsOk || options.codecThreads < 0) {
+        fprintf(stderr, "Invalid number of codec threads '%s'\n",
+                parser.value(codecThreadsOption).toLocal8Bit().constData());
+        return 1;
+    }
+    if (!parseCodecOptions(parser.values(encoderOptionOption), &options.encoderOptions) ||
+        !parseCodecOptions(parser.values(decoderOptionOption), &options.decoderOptions))
+        return 1;
+    if (parser.isSet(analyzeOption)) {
+        for (const QString &measurement : parser.value(analyzeOption).split(',')) {
+            if (measurement == "loudness") {
+                options.analysis.loudness = true;
+            } else if (measurement == "silence") {
+                options.analysis.silence = true;
+            } else if (measurement == "waveform") {
+                options.analysis.waveform = true;
+            } else {
+                fprintf(stderr, "Unknown measurement '%s'\n",
+                        measurement.toLocal8Bit().constData());
+                return 1;
+            }
+        }
+    }
+    bool zoomOk, thresholdOk, silenceOk;
+    options.analysis.waveformZoom     = parser.value(waveformZoomOption).toInt(&zoomOk);
+    options.analysis.waveformJson     = parser.isSet(waveformJsonOption);
+    options.analysis.silenceThreshold = parser.value(silenceThresholdOption).toDouble(&thresholdOk);
+    options.analysis.silenceDuration  = parser.value(silenceDurationOption).toDouble(&silenceOk);
+    if (!zoomOk || options.analysis.waveformZoom <= 0 || !thresholdOk ||
+        !silenceOk || options.analysis.silenceDuration < 0) {
+        fprintf(stderr, "Invalid waveform zoom or silence settings\n");
+        return 1;
+    }
+    bool targetOk = true, peakOk;
+    options.normalize = parser.isSet(normalizeOption);
+    if (options.normalize)
+        options.targetLoudness = parser.value(normalizeOption).toDouble(&targetOk);
+    options.truePeakLimit    = parser.value(truePeakLimitOption).toDouble(&peakOk);
+    options.scratchDirectory = parser.value(scratchDirOption);
+    if (!targetOk || !peakOk || options.targetLoudness >= 0) {
+        fprintf(stderr, "Invalid normalization settings\n");
+        return 1;
+    }
+    options.sampleRate = parser.value(sampleRateOption).toInt();
+    if (options.sampleRate < 0) {
+        fprintf(stderr, "Invalid sample rate '%s'\n",
+                parser.value(sampleRateOption).toLocal8Bit().constData());
+        return 1;
+    }
+    bool memoryBudgetOk;
+    options.memoryBudget = parseSize(parser.value(memoryBudgetOption), &memoryBudgetOk);
+    if (!memoryBudgetOk) {
+        fprintf(stderr, "Invalid memory budget '%s'\n",
+                parser.value(memoryBudgetOption).toLocal8Bit().constData());
+        return 1;
+    }
+    bool startOk, durationOk;
+    const double start    = parser.value(startOption).toDouble(&startOk);
+    const double duration = parser.value(durationOption).toDouble(&durationOk);
+    if (!startOk || !durationOk || start < 0 || duration < 0) {
+        fprintf(stderr, "Invalid clip '%s' + '%s'\n",
+                parser.value(startOption).toLocal8Bit().constData(),
+                parser.value(durationOption).toLocal8Bit().constData());
+        return 1;
+    }
+    options.trimStart    = (int64_t)(start * AV_TIME_BASE);
+    options.trimDuration = (int64_t)(duration * AV_TIME_BASE);
+    bool checkpointOk;
+    const double checkpointInterval = parser.value(checkpointOption).toDouble(&checkpointOk);
+    if (!checkpointOk || checkpointInterval < 0) {
+        fprintf(stderr, "Invalid checkpoint interval '%s'\n",
+                parser.value(checkpointOption).toLocal8Bit().constData());
+        return 1;
+    }
+    options.checkpointInterval = (int64_t)(checkpointInterval * AV_TIME_BASE);
+    bool fragmentOk;
+    const double fragmentDuration = parser.value(fragmentOption).toDouble(&fragmentOk);
+    if (!fragmentOk || fragmentDuration < 0) {
+        fprintf(stderr, "Invalid fragment duration '%s'\n",
+                parser.value(fragmentOption).toLocal8Bit().constData());
+        return 1;
+    }
+    options.fragmentDuration = (int64_t)(fragmentDuration * AV_TIME_BASE);
+    bool resultCacheSizeOk;
+    const qint64 resultCacheSize = parseSize(parser.value(resultCacheSizeOption),
+                                             &resultCacheSizeOk);
+    if (!resultCacheSizeOk) {
+        fprintf(stderr, "Invalid result cache size '%s'\n",
+                parser.value(resultCacheSizeOption).toLocal8Bit().constData());
+        return 1;
+    }
+    QScopedPointer<ResultCache> resultCache;
+    if (parser.isSet(resultCacheOption)) {
+        resultCache.reset(new ResultCache(parser.value(resultCacheOption),
+                                          resultCacheSize));
+        options.resultCache = resultCache.data();
+    }
+    const QString resampler = parser.value(resamplerOption);
+    if (resampler == "fast") {
+        options.resamplerQuality = ResamplerQuality::Fast;
+    } else if (resampler == "high") {
+        options.resamplerQuality = ResamplerQuality::High;
+    } else if (resampler != "default") {
+        fprintf(stderr, "Unknown resampler quality '%s'\n",
+                resampler.toLocal8Bit().constData());
+        return 1;
+    }
+    const QString downmix = parser.value(downmixOption);
+    if (downmix == "loro") {
+        options.downmix = DownmixMode::LoRo;
+    } else if (downmix == "ltrt") {
+        options.downmix = DownmixMode::LtRt;
+    } else if (downmix != "itu") {
+        fprintf(stderr, "Unknown downmix matrix '%s'\n",
+                downmix.toLocal8Bit().constData());
+        return 1;
+    }
+
+    QList<OutputSpec> renditions;
+    for (const QString &value : parser.values(renditionOption)) {
+        OutputSpec spec;
+        if (!parseRendition(value, &spec))
+            return 1;
+        renditions.append(spec);
+    }
+    if (!renditions.isEmpty() && (parser.isSet(batchOption) ||
+                                  parser.isSet(daemonOption) ||
+                                  options.engine != TranscodeEngine::Sequential ||
+                                  options.trimStart > 0 || options.trimDuration > 0)) {
+        fprintf(stderr, "Renditions cannot be combined with batch or daemon mode, an engine or a clip\n");
+        return 1;
+    }
+
+    if (parser.isSet(probeOption)) {
+        QStringList inputs;
+        for (const QString &path : parser.positionalArguments())
+            if (!BatchRunner::scanInputs(path, &inputs))
+                return 1;
+        if (inputs.isEmpty()) {
+            fprintf(stderr, "Usage: %s --probe <file|directory> ...\n", argv[0]);
+            return 1;
+        }
+        BatchRunner runner(parser.value(jobsOption).toInt(), options);
+        return runner.probe(inputs) == 0 ? 0 : 1;
+    }
+
+    if (parser.isSet(daemonOption)) {
+        TranscodeService service(parser.value(jobsOption).toInt(), options);
+
+        /* The daemon never exits by itself, so there is no exit to write
+         * the summary at; its metrics are queried instead. */
+        if (!metricsJson.isEmpty()) {
+            fprintf(stderr, "Metrics are not written to a file in daemon mode, "
+                            "use the metrics command or --metrics-port\n");
+            return 1;
+        }
+        if (!service.listen(parser.value(daemonOption)))
+            return 1;
+        if (parser.isSet(metricsPortOption) &&
+            !service.listenMetrics(parser.value(metricsPortOption).toUShort()))
+            return 1;
+        return app.exec();
+    }
+    if (parser.isSet(metricsPortOption)) {
+        fprintf(stderr, "Metrics are only served in daemon mode\n");
+        return 1;
+    }
+
+    if (parser.isSet(batchOption)) {
+        const int ret = runBatch(parser.value(batchOption), parser.value(outputDirOption),
+                                 parser.value(extensionOption),
+                                 parser.value(jobsOption).toInt(), options);
+        if (!metricsJson.isEmpty() && !writeMetrics(metricsJson, metrics))
+            return 1;
+        return ret;
+    }
+
+    const QStringList args = parser.positionalArguments();
+    if (args.size() != 2 && !(args.size() == 1 && !renditions.isEmpty())) {
         fprintf(stderr, "Usage: %s <input file> <output file>\n", argv[0]);
+        fprintf(stderr, "       %s <input file> [<output file>] --rendition <spec> ...\n", argv[0]);
+        fprintf(stderr, "       %s --batch <manifest|directory> [-o <output dir>] [-j <jobs>]\n", argv[0]);
         fprintf(stderr, "Example: ./qtranscoder /tmp/1.mp3 /tmp/test.mp4\n");
-        exit(1);
+        return 1;
+    }
+
+    /* The output file given as argument is the first rendition. */
+    if (args.size() == 2) {
+        OutputSpec spec;
+        spec.path   = args.at(1);
+        spec.format = parser.value(formatOption);
+        renditions.prepend(spec);
+    }
+
+    /* "-" streams the input from stdin or the output to stdout. */
+    StreamCallbacks standardInput;
+    StreamCallbacks standardOutput;
+    standardInput.read       = readStandardInput;
+    standardInput.bufferSize = parser.value(ioBufferOption).toInt();
+    standardOutput.write      = writeStandardOutput;
+    standardOutput.bufferSize = standardInput.bufferSize;
+    if (args.at(0) == "-")
+        options.inputStream = &standardInput;
+    bool standardOutputUsed = false;
+    for (OutputSpec &spec : renditions) {
+        if (spec.path != "-")
+            continue;
+        if (standardOutputUsed) {
+            fprintf(stderr, "Only one output can be written to stdout\n");
+            return 1;
+        }
+        standardOutputUsed = true;
+        spec.stream = &standardOutput;
+        if (spec.format.isEmpty())
+            spec.format = "mp4";
     }
 
-    new Transcoder(argv[1], argv[2]);
+    const QByteArray input = args.at(0).toLocal8Bit();
+    Transcoder transcoder(input.constData(), renditions, options);
+    const int error = transcoder.processInput();
+    if (!metricsJson.isEmpty() && !writeMetrics(metricsJson, metrics))
+        return 1;
+    if (error < 0)
+        return 1;
 
+    for (const OutputSpec &spec : renditions)
+        qDebug() << "File has been created successfully -> "
+                 << spec.path.toLocal8Bit().constData();
     return 0;
 }
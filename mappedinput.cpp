@@ -0,0 +1,114 @@
+#include "mappedinput.h"
+
+#include <QFileInfo>
+
+#include <stdio.h>
+#include <string.h>
+
+#ifdef Q_OS_UNIX
+#include <sys/mman.h>
+#endif
+
+extern "C" {
+    #include "libavutil/common.h"
+    #include "libavutil/error.h"
+}
+
+MappedInput::MappedInput()
+    : data(nullptr), size(0), position(0), advised(0)
+{
+    stream.read = [this](uint8_t *buffer, int size) {
+        return read(buffer, size);
+    };
+    stream.seek = [this](int64_t offset, int whence) {
+        return seek(offset, whence);
+    };
+}
+
+/**
+ * Map an input file.
+ * Only non-empty regular files are mapped; everything else, like URLs
+ * or devices, is left to libavformat.
+ * @param filename File to be mapped
+ * @return true if the file could be mapped
+ */
+bool MappedInput::open(const char *filename)
+{
+    const QString path = QString::fromLocal8Bit(filename);
+
+    if (!QFileInfo(path).isFile())
+        return false;
+
+    file.setFileName(path);
+    if (!file.open(QIODevice::ReadOnly) || file.size() <= 0)
+        return false;
+    if (!(data = file.map(0, file.size()))) {
+        file.close();
+        return false;
+    }
+    size     = file.size();
+    position = 0;
+    advised  = 0;
+
+#ifdef Q_OS_UNIX
+    madvise(const_cast<uchar *>(data), size, MADV_SEQUENTIAL);
+#endif
+    adviseReadahead();
+    return true;
+}
+
+int MappedInput::read(uint8_t *buffer, int size)
+{
+    const int64_t bytes = FFMIN((int64_t)size, this->size - position);
+
+    if (bytes <= 0)
+        return 0;
+    memcpy(buffer, data + position, bytes);
+    position += bytes;
+    adviseReadahead();
+    return (int)bytes;
+}
+
+int64_t MappedInput::seek(int64_t offset, int whence)
+{
+    int64_t target;
+
+    switch (whence & ~AVSEEK_FORCE) {
+    case AVSEEK_SIZE:
+        return size;
+    case SEEK_SET:
+        target = offset;
+        break;
+    case SEEK_CUR:
+        target = position + offset;
+        break;
+    case SEEK_END:
+        target = size + offset;
+        break;
+    default:
+        return AVERROR(EINVAL);
+    }
+    if (target < 0)
+        return AVERROR(EINVAL);
+
+    position = target;
+    /* Restart the readahead at the new position after a jump. */
+    if (position < advised - MAPPED_INPUT_READAHEAD || position > advised)
+        advised = position / MAPPED_INPUT_READAHEAD * MAPPED_INPUT_READAHEAD;
+    adviseReadahead();
+    return position;
+}
+
+/* Keep at least half of the readahead window in front of the position. */
+void MappedInput::adviseReadahead()
+{
+    while (advised < size &&
+           advised - position < MAPPED_INPUT_READAHEAD / 2) {
+        const int64_t length = FFMIN((int64_t)MAPPED_INPUT_READAHEAD,
+                                     size - advised);
+#ifdef Q_OS_UNIX
+        madvise(const_cast<uchar *>(data) + advised, length, MADV_WILLNEED);
+#endif
+        advised += length;
+    }
+}
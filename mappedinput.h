@@ -0,0 +1,45 @@
+#ifndef MAPPEDINPUT_H
+#define MAPPEDINPUT_H
+
+#include <QFile>
+
+#include "streamio.h"
+
+/* The amount of a mapped input advised to be read ahead in bytes */
+#define MAPPED_INPUT_READAHEAD (4 * 1024 * 1024)
+
+/**
+ * Input file read through a memory mapping instead of read() calls.
+ * The demuxer's buffer is filled straight from the page cache, and the
+ * kernel is told that the file is read sequentially, keeping the readahead
+ * a few megabytes in front of the demuxer.
+ */
+class MappedInput
+{
+    public:
+        MappedInput();
+
+        bool open(const char *filename);
+
+        const StreamCallbacks *callbacks() const { return &stream; }
+
+    private:
+        MappedInput(const MappedInput &) = delete;
+        MappedInput &operator=(const MappedInput &) = delete;
+
+        int read(uint8_t *buffer, int size);
+
+        int64_t seek(int64_t offset, int whence);
+
+        void adviseReadahead();
+
+        QFile file;
+        const uchar *data;
+        int64_t size;
+        int64_t position;
+        /* End of the range the readahead has been requested for. */
+        int64_t advised;
+        StreamCallbacks stream;
+};
+
+#endif
@@ -0,0 +1,47 @@
+#include "mediahandles.h"
+#include "codeccache.h"
+#include "streamio.h"
+
+void InputFormatDeleter::operator()(AVFormatContext *inputFormatContext) const
+{
+    AVIOContext *inputIOContext = nullptr;
+
+    if (!inputFormatContext)
+        return;
+    if (inputFormatContext->flags & AVFMT_FLAG_CUSTOM_IO)
+        inputIOContext = inputFormatContext->pb;
+    avformat_close_input(&inputFormatContext);
+    StreamIO::close(&inputIOContext);
+}
+
+void OutputFormatDeleter::operator()(AVFormatContext *outputFormatContext) const
+{
+    if (!outputFormatContext)
+        return;
+    if (outputFormatContext->flags & AVFMT_FLAG_CUSTOM_IO)
+        StreamIO::close(&outputFormatContext->pb);
+    else
+        avio_closep(&outputFormatContext->pb);
+    avformat_free_context(outputFormatContext);
+}
+
+void CodecContextDeleter::operator()(AVCodecContext *context) const
+{
+    if (!context)
+        return;
+    if (cache)
+        cache->release(&context);
+    else
+        avcodec_free_context(&context);
+}
+
+void ResamplerDeleter::operator()(SwrContext *resampleContext) const
+{
+    swr_free(&resampleContext);
+}
+
+void FifoDeleter::operator()(AVAudioFifo *fifo) const
+{
+    if (fifo)
+        av_audio_fifo_free(fifo);
+}
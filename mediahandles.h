@@ -0,0 +1,62 @@
+#ifndef MEDIAHANDLES_H
+#define MEDIAHANDLES_H
+
+#include <memory>
+
+#ifdef __cplusplus
+extern "C" {
+    #include "libavformat/avformat.h"
+    #include "libavcodec/avcodec.h"
+    #include "libavutil/audio_fifo.h"
+    #include "libswresample/swresample.h"
+}
+#endif
+
+class CodecContextCache;
+
+/* Closes an input opened by Transcoder::openInputFile. A caller's stream
+ * is left open, only its I/O context is freed. */
+struct InputFormatDeleter
+{
+    void operator()(AVFormatContext *inputFormatContext) const;
+};
+
+/* Closes an output opened by Transcoder::openOutputFile. A caller's stream
+ * is left open, only its I/O context is freed. */
+struct OutputFormatDeleter
+{
+    void operator()(AVFormatContext *outputFormatContext) const;
+};
+
+/* Frees a decoder or encoder, or returns it to the cache if one is set. */
+struct CodecContextDeleter
+{
+    explicit CodecContextDeleter(CodecContextCache *cache = nullptr)
+        : cache(cache)
+    {
+    }
+
+    void operator()(AVCodecContext *context) const;
+
+    CodecContextCache *cache;
+};
+
+struct ResamplerDeleter
+{
+    void operator()(SwrContext *resampleContext) const;
+};
+
+struct FifoDeleter
+{
+    void operator()(AVAudioFifo *fifo) const;
+};
+
+/* Owners of the FFmpeg objects of a run, each freeing its object the way
+ * it was opened. */
+typedef std::unique_ptr<AVFormatContext, InputFormatDeleter> InputFormatHandle;
+typedef std::unique_ptr<AVFormatContext, OutputFormatDeleter> OutputFormatHandle;
+typedef std::unique_ptr<AVCodecContext, CodecContextDeleter> CodecContextHandle;
+typedef std::unique_ptr<SwrContext, ResamplerDeleter> ResamplerHandle;
+typedef std::unique_ptr<AVAudioFifo, FifoDeleter> FifoHandle;
+
+#endif
@@ -0,0 +1,31 @@
+#include "memoryaccount.h"
+
+#include <atomic>
+
+static std::atomic<int64_t> usedBytes(0);
+static std::atomic<int64_t> peakBytes(0);
+
+void MemoryAccount::charge(int64_t bytes)
+{
+    const int64_t now = usedBytes.fetch_add(bytes, std::memory_order_relaxed) + bytes;
+    int64_t peak = peakBytes.load(std::memory_order_relaxed);
+
+    while (now > peak &&
+           !peakBytes.compare_exchange_weak(peak, now, std::memory_order_relaxed))
+        ;
+}
+
+void MemoryAccount::credit(int64_t bytes)
+{
+    usedBytes.fetch_sub(bytes, std::memory_order_relaxed);
+}
+
+int64_t MemoryAccount::used()
+{
+    return usedBytes.load(std::memory_order_relaxed);
+}
+
+int64_t MemoryAccount::peak()
+{
+    return peakBytes.load(std::memory_order_relaxed);
+}
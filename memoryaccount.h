@@ -0,0 +1,33 @@
+#ifndef MEMORYACCOUNT_H
+#define MEMORYACCOUNT_H
+
+#include <cstdint>
+
+/* Share in percent of a job's memory budget its FIFO buffers may use;
+ * the frames in flight between threads get the rest */
+#define MEMORY_BUDGET_FIFO_SHARE 50
+
+/**
+ * Process-wide account of the sample buffers held by all jobs.
+ * The FIFO buffers and the converted sample storage of every job are
+ * charged as they grow and credited once they are freed, so that the
+ * peak tells how much memory a mix of concurrent jobs needs. Buffers
+ * allocated inside FFmpeg, like decoded frames, are not accounted.
+ * May be used from any thread.
+ */
+class MemoryAccount
+{
+    public:
+        static void charge(int64_t bytes);
+
+        static void credit(int64_t bytes);
+
+        static int64_t used();
+
+        static int64_t peak();
+
+    private:
+        MemoryAccount() = delete;
+};
+
+#endif
@@ -0,0 +1,279 @@
+/**
+ * @file
+ * Two-pass loudness normalization.
+ *
+ * The first pass decodes the input and converts it to float planar at the
+ * output's rate and channels, spilling the samples to a temporary file
+ * while their loudness is measured. The second pass reads them back,
+ * applies the gain that brings the output to the target loudness, and
+ * encodes them through the FIFO buffer like the sequential engine, so
+ * that the input is demuxed and decoded only once.
+ */
+
+#include "transcoder.h"
+#include "samplespill.h"
+
+#include <cmath>
+
+/* Multiply float samples by a gain; simple enough to be vectorized. */
+static void applyGain(const float *input, float *output, int samples, float gain)
+{
+    for (int i = 0; i < samples; i++)
+        output[i] = input[i] * gain;
+}
+
+/**
+ * First pass: decode and convert the whole input, spill the samples and
+ * measure their loudness.
+ * @param inputFormatContext Format context of the input file
+ * @param inputCodecContext  Codec context of the input file
+ * @param floatCodecContext  Float planar format of the spilled samples
+ * @param resampleContext    Resample context for the conversion, or
+ *                           nullptr if the decoded samples are stored as
+ *                           they are
+ * @param spill              Store the samples are appended to
+ * @param meter              Loudness measurement of the samples
+ * @return Error code (0 if successful)
+ */
+int Transcoder::spillInput(AVFormatContext *inputFormatContext,
+                           AVCodecContext *inputCodecContext,
+                           AVCodecContext *floatCodecContext,
+                           SwrContext *resampleContext,
+                           SampleSpill *spill, AudioAnalyzer *meter)
+{
+    AVFrame *inputFrame = nullptr;
+    uint8_t **convertedSamples = nullptr;
+    int finished = 0;
+    int error;
+
+    if ((error = pool.inputFrame(&inputFrame)) < 0)
+        return error;
+
+    while (!finished) {
+        int dataPresent = 0;
+        int outputSize, converted;
+
+        if (decodeAudioFrame(inputFrame, inputFormatContext,
+                             inputCodecContext, &dataPresent, &finished))
+            return AVERROR_EXIT;
+        if (!dataPresent)
+            continue;
+
+        if (!resampleContext) {
+            meter->process(inputFrame->extended_data, inputFrame->nb_samples);
+            error = spill->append(inputFrame->extended_data,
+                                  inputFrame->nb_samples) ? 0 : AVERROR(EIO);
+            av_frame_unref(inputFrame);
+            if (error < 0)
+                return error;
+            continue;
+        }
+
+        outputSize = swr_get_out_samples(resampleContext, inputFrame->nb_samples);
+        if (outputSize < 0 ||
+            (error = pool.convertedSamples(&convertedSamples, floatCodecContext,
+                                           outputSize)) < 0 ||
+            (converted = convertSamples((const uint8_t **)inputFrame->extended_data,
+                                        inputFrame->nb_samples, convertedSamples,
+                                        outputSize, resampleContext)) < 0) {
+            av_frame_unref(inputFrame);
+            return AVERROR_EXIT;
+        }
+        av_frame_unref(inputFrame);
+        meter->process(convertedSamples, converted);
+        if (!spill->append(convertedSamples, converted))
+            return AVERROR(EIO);
+    }
+
+    /* Drain the samples still held back by the resampler. */
+    while (resampleContext) {
+        const int delayed = swr_get_out_samples(resampleContext, 0);
+        int converted;
+
+        if (delayed <= 0)
+            break;
+        if ((error = pool.convertedSamples(&convertedSamples, floatCodecContext,
+                                           delayed)) < 0)
+            return error;
+        if ((converted = convertSamples(nullptr, 0, convertedSamples, delayed,
+                                        resampleContext)) < 0)
+            return converted;
+        if (!converted)
+            break;
+        meter->process(convertedSamples, converted);
+        if (!spill->append(convertedSamples, converted))
+            return AVERROR(EIO);
+    }
+    return 0;
+}
+
+/**
+ * Second pass: apply the gain to the spilled samples, convert them to
+ * the encoder's sample format if need be, and encode them.
+ * @param spill               Store the samples are read from
+ * @param gain                Linear gain to be applied
+ * @param floatCodecContext   Float planar format of the spilled samples
+ * @param outputFormatContext Format context of the output file
+ * @param outputCodecContext  Codec context of the output file
+ * @param resampleContext     Resample context for the conversion to the
+ *                            encoder's format, or nullptr if the encoder
+ *                            takes float planar samples
+ * @param fifo                Buffer used for temporary storage
+ * @return Error code (0 if successful)
+ */
+int Transcoder::encodeSpill(SampleSpill *spill, float gain,
+                            AVCodecContext *floatCodecContext,
+                            AVFormatContext *outputFormatContext,
+                            AVCodecContext *outputCodecContext,
+                            SwrContext *resampleContext, AVAudioFifo *fifo)
+{
+    const int frameSize = outputCodecContext->frame_size;
+    const float *planes[SAMPLE_SPILL_MAX_CHANNELS];
+    uint8_t **convertedSamples = nullptr;
+    AVFrame *gained = av_frame_alloc();
+    int samples;
+    int ret = AVERROR_EXIT;
+
+    if (!gained) {
+        fprintf(stderr, "Could not allocate normalization frame\n");
+        return AVERROR(ENOMEM);
+    }
+    if (!spill->rewind())
+        goto cleanup;
+
+    while ((samples = spill->read(planes)) > 0) {
+        uint8_t **data;
+        int count = samples;
+
+        if (isCancelled())
+            goto cleanup;
+        if (FramePool::prepareFrame(gained, floatCodecContext, samples) < 0)
+            goto cleanup;
+        for (int c = 0; c < floatCodecContext->channels; c++)
+            applyGain(planes[c], (float *)gained->extended_data[c], samples, gain);
+        data = gained->extended_data;
+
+        if (resampleContext) {
+            const int outputSize = swr_get_out_samples(resampleContext, samples);
+
+            if (outputSize < 0 ||
+                pool.convertedSamples(&convertedSamples, outputCodecContext,
+                                      outputSize) < 0 ||
+                (count = convertSamples((const uint8_t **)data, samples,
+                                        convertedSamples, outputSize,
+                                        resampleContext)) < 0)
+                goto cleanup;
+            data = convertedSamples;
+        }
+
+        if (storeSamples(fifo, outputFormatContext, outputCodecContext,
+                         data, count))
+            goto cleanup;
+        while (av_audio_fifo_size(fifo) >= frameSize)
+            if (loadEncodeAndWrite(fifo, outputFormatContext,
+                                   outputCodecContext, 0))
+                goto cleanup;
+    }
+
+    /* Encode the remaining samples and those delayed by the resampler
+     * and the encoder. */
+    if (flushResampler(fifo, outputCodecContext, resampleContext))
+        goto cleanup;
+    while (av_audio_fifo_size(fifo) > 0)
+        if (loadEncodeAndWrite(fifo, outputFormatContext, outputCodecContext, 1))
+            goto cleanup;
+    ret = flushEncoder(outputFormatContext, outputCodecContext);
+
+cleanup:
+    av_frame_free(&gained);
+    return ret;
+}
+
+/**
+ * Transcode the input normalized to the target loudness of the options,
+ * without decoding it twice. The resampler of open() is not used; each
+ * pass converts with one of its own.
+ * @param inputFormatContext  Format context of the input file
+ * @param inputCodecContext   Codec context of the input file
+ * @param outputFormatContext Format context of the output file
+ * @param outputCodecContext  Codec context of the output file
+ * @param fifo                Buffer used for temporary storage
+ * @return Error code (0 if successful)
+ */
+int Transcoder::processNormalized(AVFormatContext *inputFormatContext,
+                                  AVCodecContext *inputCodecContext,
+                                  AVFormatContext *outputFormatContext,
+                                  AVCodecContext *outputCodecContext,
+                                  AVAudioFifo *fifo)
+{
+    AnalysisOptions measurement;
+    SwrContext *spillResampler  = nullptr;
+    SwrContext *encodeResampler = nullptr;
+    AVCodecContext *floatContext;
+    SampleSpill spill;
+    double loudness, gainDb;
+    int ret = AVERROR_EXIT;
+
+    /* The spilled samples are float planar at the output's rate and
+     * channels, so that the gain is applied before any conversion to the
+     * encoder's format. */
+    floatContext = avcodec_alloc_context3(nullptr);
+    if (!floatContext) {
+        fprintf(stderr, "Could not allocate a normalization context\n");
+        return AVERROR(ENOMEM);
+    }
+    floatContext->sample_fmt     = AV_SAMPLE_FMT_FLTP;
+    floatContext->sample_rate    = outputCodecContext->sample_rate;
+    floatContext->channels       = outputCodecContext->channels;
+    floatContext->channel_layout = outputCodecContext->channel_layout;
+    floatContext->frame_size     = outputCodecContext->frame_size;
+    const CodecContextHandle floatCodec(floatContext);
+
+    if (!formatsMatch(inputCodecContext, floatContext)) {
+        if (initResampler(inputCodecContext, floatContext,
+                          options.resamplerQuality, options.downmix,
+                          &spillResampler))
+            goto cleanup;
+        downmix.configure(inputCodecContext, floatContext, options.downmix,
+                          spillResampler);
+    }
+    if (!formatsMatch(floatContext, outputCodecContext) &&
+        initResampler(floatContext, outputCodecContext,
+                      options.resamplerQuality, options.downmix,
+                      &encodeResampler))
+        goto cleanup;
+    if (!spill.open(floatContext->channels, options.scratchDirectory))
+        goto cleanup;
+
+    measurement.loudness = true;
+    {
+        AudioAnalyzer meter(measurement, floatContext);
+
+        if ((ret = spillInput(inputFormatContext, inputCodecContext, floatContext,
+                              spillResampler, &spill, &meter)) < 0)
+            goto cleanup;
+        ret = AVERROR_EXIT;
+
+        /* Raise or lower the output to the target, but never its true
+         * peak above the limit. Silence is left as it is. */
+        loudness = meter.integratedLoudness();
+        gainDb   = 0.0;
+        if (!std::isfinite(loudness)) {
+            fprintf(stderr, "Input is silent, not normalizing it\n");
+        } else {
+            gainDb = FFMIN(options.targetLoudness - loudness,
+                           options.truePeakLimit - meter.truePeakLevel());
+            fprintf(stderr, "Normalizing from %.2f LUFS by %+.2f dB\n",
+                    loudness, gainDb);
+        }
+    }
+
+    ret = encodeSpill(&spill, (float)pow(10.0, gainDb / 20.0), floatContext,
+                      outputFormatContext, outputCodecContext, encodeResampler,
+                      fifo);
+
+cleanup:
+    swr_free(&spillResampler);
+    swr_free(&encodeResampler);
+    return ret;
+}
@@ -0,0 +1,317 @@
+/**
+ * @file
+ * Pipelined transcoding engine.
+ *
+ * Demux+decode, resample and encode+mux run on three threads, linked by
+ * bounded lock-free queues of frame references. Every link has a second
+ * queue returning the consumed frames to the producer, so that the frames
+ * are allocated once per run and recycled afterwards. The AVAudioFifo
+ * re-chunks the converted samples at the encoder boundary as usual.
+ *
+ * If the decoder already delivers the encoder's format, the resample stage
+ * passes the decoded frames on by reference. Frames that are exactly one
+ * encoder frame large skip the FIFO and are encoded directly.
+ *
+ * The stages share the FramePool of the Transcoder: the decode stage only
+ * uses the input packet, the encode stage only the output packet and frame.
+ */
+
+#include "transcoder.h"
+#include "spscqueue.h"
+
+#include <thread>
+#include <vector>
+
+/* Queues and contexts shared by the stages of one pipelined run. */
+struct PipelineState
+{
+    explicit PipelineState(int depth)
+        : decoded(depth), freeDecoded(depth),
+          converted(depth), freeConverted(depth),
+          abort(false), error(0)
+    {
+    }
+
+    /* Record the first error and make all stages give up. */
+    void fail(int code)
+    {
+        int expected = 0;
+        error.compare_exchange_strong(expected, code);
+        abort.store(true);
+    }
+
+    AVFormatContext *inputFormatContext;
+    AVCodecContext *inputCodecContext;
+    AVFormatContext *outputFormatContext;
+    AVCodecContext *outputCodecContext;
+    SwrContext *resampleContext;
+    AVAudioFifo *fifo;
+
+    /* Decoded frames, decode stage -> resample stage. A null pointer
+     * marks the end of the stream. */
+    SpscQueue<AVFrame *> decoded;
+    SpscQueue<AVFrame *> freeDecoded;
+    /* Converted frames, resample stage -> encode stage. */
+    SpscQueue<AVFrame *> converted;
+    SpscQueue<AVFrame *> freeConverted;
+    /* Every frame of the run, for cleanup. */
+    std::vector<AVFrame *> frames;
+
+    std::atomic<bool> abort;
+    std::atomic<int> error;
+};
+
+/**
+ * Demux and decode the input file, handing the decoded frames to the
+ * resample stage. Runs on its own thread.
+ * @param state Shared state of the pipeline
+ */
+void Transcoder::runDecodeStage(PipelineState *state)
+{
+    AVFrame *frame = nullptr;
+    int finished   = 0;
+
+    while (!finished) {
+        int dataPresent = 0;
+
+        /* A frame nothing was decoded into is used again. The resample
+         * stage is the only one returning frames to freeDecoded. */
+        if (!frame && !state->freeDecoded.pop(&frame, state->abort))
+            return;
+
+        if (decodeAudioFrame(frame, state->inputFormatContext,
+                             state->inputCodecContext, &dataPresent,
+                             &finished)) {
+            state->fail(AVERROR_EXIT);
+            return;
+        }
+
+        if (dataPresent) {
+            if (!state->decoded.push(frame, state->abort))
+                return;
+            frame = nullptr;
+        }
+    }
+
+    state->decoded.push(nullptr, state->abort);
+}
+
+/**
+ * Drain the samples delayed by the resampler at the end of the stream
+ * into one more frame for the encode stage.
+ * @param state Shared state of the pipeline
+ * @return Error code (0 if successful)
+ */
+int Transcoder::flushConvertedFrame(PipelineState *state)
+{
+    const int delayed = swr_get_out_samples(state->resampleContext, 0);
+    AVFrame *output;
+    int converted;
+
+    if (delayed <= 0)
+        return 0;
+    if (!state->freeConverted.pop(&output, state->abort))
+        return AVERROR_EXIT;
+
+    /* Counted and timed like the samples converted before. */
+    if ((converted = FramePool::prepareFrame(output, state->outputCodecContext,
+                                             delayed)) == 0)
+        converted = convertSamples(nullptr, 0, output->extended_data, delayed,
+                                   state->resampleContext);
+    /* The encode stage is the only one returning frames to
+     * freeConverted; the unused frame is freed with the pipeline. */
+    if (converted <= 0)
+        return converted;
+
+    output->nb_samples = converted;
+    if (!state->converted.push(output, state->abort))
+        return AVERROR_EXIT;
+    return 0;
+}
+
+/**
+ * Convert the decoded frames into the output sample format, handing them
+ * to the encode stage. Runs on its own thread.
+ * @param state Shared state of the pipeline
+ */
+void Transcoder::runResampleStage(PipelineState *state)
+{
+    AVFrame *input;
+
+    while (state->decoded.pop(&input, state->abort)) {
+        AVFrame *output;
+        int outputSize;
+        int error;
+
+        if (!input) {
+            if (state->resampleContext &&
+                (error = flushConvertedFrame(state)) < 0) {
+                state->fail(error);
+                return;
+            }
+            state->converted.push(nullptr, state->abort);
+            return;
+        }
+
+        if (!state->freeConverted.pop(&output, state->abort))
+            return;
+
+        /* Pass the decoded samples on by reference if they need no
+         * conversion. */
+        if (!state->resampleContext) {
+            av_frame_move_ref(output, input);
+            state->freeDecoded.tryPush(input);
+            if (!state->converted.push(output, state->abort))
+                return;
+            continue;
+        }
+
+        /* A sample rate conversion may yield more samples than decoded. */
+        outputSize = swr_get_out_samples(state->resampleContext,
+                                         input->nb_samples);
+        error = outputSize < 0 ? outputSize :
+                FramePool::prepareFrame(output, state->outputCodecContext,
+                                        outputSize);
+        if (!error)
+            error = convertSamples((const uint8_t **)input->extended_data,
+                                   input->nb_samples, output->extended_data,
+                                   outputSize, state->resampleContext);
+        if (error >= 0)
+            output->nb_samples = error;
+
+        /* Hand the decoded samples back to the decoder's buffer pool. */
+        av_frame_unref(input);
+        state->freeDecoded.tryPush(input);
+
+        if (error < 0) {
+            state->fail(error);
+            return;
+        }
+        if (!state->converted.push(output, state->abort))
+            return;
+    }
+}
+
+/**
+ * Re-chunk the converted samples to the encoder's frame size, encode and
+ * write them to the output file. Runs on the calling thread.
+ * @param state Shared state of the pipeline
+ * @return Error code (0 if successful)
+ */
+int Transcoder::runEncodeStage(PipelineState *state)
+{
+    const int outputFrameSize = state->outputCodecContext->frame_size;
+    AVFrame *frame;
+
+    while (state->converted.pop(&frame, state->abort)) {
+        int error;
+
+        /* At the end of the stream, encode the remaining samples
+         * and the frames delayed by the encoder. */
+        if (!frame) {
+            while (av_audio_fifo_size(state->fifo) > 0)
+                if (loadEncodeAndWrite(state->fifo, state->outputFormatContext,
+                                       state->outputCodecContext, 1))
+                    return AVERROR_EXIT;
+            return flushEncoder(state->outputFormatContext,
+                                state->outputCodecContext);
+        }
+
+        /* A frame lining up with the encoder's frames skips the FIFO. */
+        if (av_audio_fifo_size(state->fifo) == 0 &&
+            frame->nb_samples == outputFrameSize) {
+            int dataWritten;
+
+            frame->channel_layout = state->outputCodecContext->channel_layout;
+            error = encodeAudioFrame(frame, state->outputFormatContext,
+                                     state->outputCodecContext, &dataWritten);
+        } else {
+            error = storeSamples(state->fifo, state->outputFormatContext,
+                                 state->outputCodecContext, frame->extended_data,
+                                 frame->nb_samples);
+        }
+
+        /* Frames passed through by reference hold the decoder's buffers,
+         * which have to be returned to it. */
+        if (!state->resampleContext)
+            av_frame_unref(frame);
+        state->freeConverted.tryPush(frame);
+        if (error)
+            return error;
+
+        while (av_audio_fifo_size(state->fifo) >= outputFrameSize)
+            if (loadEncodeAndWrite(state->fifo, state->outputFormatContext,
+                                   state->outputCodecContext, 0))
+                return AVERROR_EXIT;
+    }
+
+    /* One of the other stages gave up. */
+    return state->error ? state->error.load() : AVERROR_EXIT;
+}
+
+/**
+ * Transcode the whole input with demux+decode, resample and encode+mux
+ * running concurrently.
+ * @param inputFormatContext  Format context of the input file
+ * @param inputCodecContext   Codec context of the input file
+ * @param outputFormatContext Format context of the output file
+ * @param outputCodecContext  Codec context of the output file
+ * @param resampleContext     Resample context for the conversion
+ * @param fifo                Buffer used for re-chunking the samples
+ * @return Error code (0 if successful)
+ */
+int Transcoder::processPipelined(AVFormatContext *inputFormatContext,
+                                 AVCodecContext *inputCodecContext,
+                                 AVFormatContext *outputFormatContext,
+                                 AVCodecContext *outputCodecContext,
+                                 SwrContext *resampleContext,
+                                 AVAudioFifo *fifo)
+{
+    /* Every slot of the queues holds a decoded and a converted frame. */
+    const int depth = framesInFlight(inputCodecContext, 2);
+    PipelineState state(depth);
+    int ret = 0;
+
+    state.inputFormatContext  = inputFormatContext;
+    state.inputCodecContext   = inputCodecContext;
+    state.outputFormatContext = outputFormatContext;
+    state.outputCodecContext  = outputCodecContext;
+    state.resampleContext     = resampleContext;
+    state.fifo                = fifo;
+
+    /* Allocate all frames in flight up front; they are recycled
+     * through the free queues afterwards. */
+    for (int i = 0; i < depth && !ret; i++) {
+        AVFrame *decodedFrame   = av_frame_alloc();
+        AVFrame *convertedFrame = av_frame_alloc();
+
+        if (decodedFrame)
+            state.frames.push_back(decodedFrame);
+        if (convertedFrame)
+            state.frames.push_back(convertedFrame);
+        if (!decodedFrame || !convertedFrame) {
+            fprintf(stderr, "Could not allocate pipeline frames\n");
+            ret = AVERROR(ENOMEM);
+            break;
+        }
+        state.freeDecoded.tryPush(decodedFrame);
+        state.freeConverted.tryPush(convertedFrame);
+    }
+
+    if (!ret) {
+        std::thread decodeThread(&Transcoder::runDecodeStage, this, &state);
+        std::thread resampleThread(&Transcoder::runResampleStage, this, &state);
+
+        ret = runEncodeStage(&state);
+        if (ret < 0)
+            state.fail(ret);
+
+        decodeThread.join();
+        resampleThread.join();
+    }
+
+    for (AVFrame *frame : state.frames)
+        av_frame_free(&frame);
+
+    return ret;
+}
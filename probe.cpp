@@ -0,0 +1,71 @@
+/**
+ * @file
+ * Probe-only mode.
+ *
+ * The input is opened and its stream parameters are read with the reduced
+ * probing of trusted inputs, but no decoder is opened and no packet is
+ * decoded. The result tells whether a transcode would find an audio
+ * stream and a decoder for it.
+ */
+
+#include "transcoder.h"
+
+#include <QJsonObject>
+
+/**
+ * Read the duration, format and audio parameters of an input.
+ * @param      filename File to be probed
+ * @param      options  Input format and audio stream of the run
+ * @param[out] info     Parameters of the input; "ok" tells whether it can
+ *                      be transcoded, "error" why not
+ * @return Error code (0 if successful)
+ */
+int Transcoder::probeInput(const char *filename, const TranscoderOptions &options,
+                           QJsonObject *info)
+{
+    TranscoderOptions probeOptions = options;
+    AVFormatContext *inputFormatContext = nullptr;
+    const AVCodecParameters *parameters;
+    char message[AV_ERROR_MAX_STRING_SIZE];
+    int index, error;
+
+    info->insert("input", QString::fromLocal8Bit(filename));
+    info->insert("ok", false);
+
+    probeOptions.trustedInput = true;
+    if ((error = openInputContainer(filename, nullptr, probeOptions,
+                                    &inputFormatContext)) < 0) {
+        av_strerror(error, message, sizeof(message));
+        info->insert("error", QString::fromLocal8Bit(message));
+        return error;
+    }
+
+    info->insert("format", QString::fromLatin1(inputFormatContext->iformat->name));
+    info->insert("duration", inputFormatContext->duration > 0 ?
+                             QJsonValue(inputFormatContext->duration / (double)AV_TIME_BASE) :
+                             QJsonValue());
+    info->insert("bit_rate", (qint64)inputFormatContext->bit_rate);
+    info->insert("streams", (int)inputFormatContext->nb_streams);
+
+    if ((index = av_find_best_stream(inputFormatContext, AVMEDIA_TYPE_AUDIO,
+                                     options.audioStream, -1, nullptr, 0)) < 0) {
+        info->insert("error", QString("no audio stream"));
+        closeInputFile(&inputFormatContext);
+        return index;
+    }
+    parameters = inputFormatContext->streams[index]->codecpar;
+    info->insert("audio_stream", index);
+    info->insert("codec", QString::fromLatin1(avcodec_get_name(parameters->codec_id)));
+    info->insert("sample_rate", parameters->sample_rate);
+    info->insert("channels", parameters->channels);
+    info->insert("audio_bit_rate", (qint64)parameters->bit_rate);
+
+    if (!avcodec_find_decoder(parameters->codec_id)) {
+        info->insert("error", QString("no decoder"));
+        closeInputFile(&inputFormatContext);
+        return AVERROR_DECODER_NOT_FOUND;
+    }
+    info->insert("ok", true);
+    closeInputFile(&inputFormatContext);
+    return 0;
+}
@@ -0,0 +1,6 @@
+TEMPLATE = app
+TARGET = qtranscoder-bench
+
+include(qtranscoder.pri)
+
+SOURCES += bench.cpp
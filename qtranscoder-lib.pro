@@ -0,0 +1,21 @@
+TEMPLATE = lib
+TARGET = qtranscoder
+
+# A static library unless configured with CONFIG+=shared.
+!shared: CONFIG += staticlib
+
+include(qtranscoder.pri)
+
+# The job service can be embedded as well.
+QT += network
+
+HEADERS += transcodeservice.h
+
+SOURCES += transcodeservice.cpp
+
+isEmpty(PREFIX): PREFIX = /usr/local
+
+target.path = $$PREFIX/lib
+headers.files = $$HEADERS
+headers.path = $$PREFIX/include/qtranscoder
+INSTALLS += target headers
@@ -0,0 +1,49 @@
+# Transcoding core shared by the command line tool and the benchmark.
+CONFIG += warn_on c++11
+QT += core widgets
+
+INCLUDEPATH += /usr/local/ffmpeg/include
+LIBS += -L/usr/local/ffmpeg/lib -lavdevice -lavformat -lavfilter -lavcodec -lswresample -lswscale -lavutil
+
+HEADERS += $$PWD/transcoder.h \
+           $$PWD/analysis.h \
+           $$PWD/checkpoint.h \
+           $$PWD/codeccache.h \
+           $$PWD/downmix.h \
+           $$PWD/encoderselector.h \
+           $$PWD/framepool.h \
+           $$PWD/mediahandles.h \
+           $$PWD/memoryaccount.h \
+           $$PWD/resultcache.h \
+           $$PWD/samplespill.h \
+           $$PWD/batchrunner.h \
+           $$PWD/spscqueue.h \
+           $$PWD/transcodestats.h \
+           $$PWD/transcodemetrics.h \
+           $$PWD/streamio.h \
+           $$PWD/mappedinput.h
+
+SOURCES += $$PWD/transcoder.cpp \
+           $$PWD/analysis.cpp \
+           $$PWD/checkpoint.cpp \
+           $$PWD/codeccache.cpp \
+           $$PWD/codecoptions.cpp \
+           $$PWD/downmix.cpp \
+           $$PWD/encoderselector.cpp \
+           $$PWD/framepool.cpp \
+           $$PWD/mediahandles.cpp \
+           $$PWD/memoryaccount.cpp \
+           $$PWD/resultcache.cpp \
+           $$PWD/samplespill.cpp \
+           $$PWD/batchrunner.cpp \
+           $$PWD/pipeline.cpp \
+           $$PWD/segmented.cpp \
+           $$PWD/fanout.cpp \
+           $$PWD/fragments.cpp \
+           $$PWD/normalize.cpp \
+           $$PWD/probe.cpp \
+           $$PWD/streamcopy.cpp \
+           $$PWD/transcodestats.cpp \
+           $$PWD/transcodemetrics.cpp \
+           $$PWD/streamio.cpp \
+           $$PWD/mappedinput.cpp
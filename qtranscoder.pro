@@ -1,11 +1,10 @@
-CONFIG += warn_on
 TEMPLATE = app
-QT += core widgets
 
-INCLUDEPATH += /usr/local/ffmpeg/include
-LIBS += -L/usr/local/ffmpeg/lib -lavdevice -lavformat -lavfilter -lavcodec -lswresample -lswscale -lavutil
+include(qtranscoder.pri)
 
-HEADERS += transcoder.h 
+QT += network
 
-SOURCES += transcoder.cpp \
-           main.cpp
+HEADERS += transcodeservice.h
+
+SOURCES += main.cpp \
+           transcodeservice.cpp
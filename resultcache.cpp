@@ -0,0 +1,266 @@
+/**
+ * @file
+ * Cache of finished outputs.
+ *
+ * Before a run opens its input, the input file is hashed and every output
+ * is looked up by that digest and its encoder settings. If all outputs
+ * are cached, they are put into place and nothing is transcoded; otherwise
+ * the run transcodes as usual and stores its outputs once it succeeded.
+ */
+
+#include "resultcache.h"
+#include "transcoder.h"
+
+#include <QCryptographicHash>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QMutexLocker>
+#include <QStringList>
+
+#include <stdio.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utime.h>
+
+/* Codec options as one key field, in the key order of the map. */
+static QString optionsField(const QMap<QString, QString> &options)
+{
+    QStringList pairs;
+
+    for (auto it = options.constBegin(); it != options.constEnd(); ++it)
+        pairs << it.key() + "=" + it.value();
+    return pairs.join(':');
+}
+
+/**
+ * @param directory Directory the entries are kept in; created if needed
+ * @param capacity  Bytes the entries may take (0: unlimited)
+ */
+ResultCache::ResultCache(const QString &directory, int64_t capacity)
+    : directory(directory), capacity(capacity)
+{
+    QDir().mkpath(directory);
+}
+
+/**
+ * Hash the bytes of an input file.
+ * @param filename Input file
+ * @return SHA-256 digest, empty if the file cannot be read
+ */
+QByteArray ResultCache::inputDigest(const char *filename)
+{
+    QFile file(QString::fromLocal8Bit(filename));
+    QCryptographicHash hash(QCryptographicHash::Sha256);
+
+    if (!file.open(QIODevice::ReadOnly) || !hash.addData(&file))
+        return QByteArray();
+    return hash.result();
+}
+
+/**
+ * Derive the key of an output from the input digest and everything the
+ * output bytes depend on.
+ * @param inputDigest Digest of the input file
+ * @param spec        Output to be looked up
+ * @param options     Settings of the run
+ * @return Key of the output, in hex
+ */
+QByteArray ResultCache::key(const QByteArray &inputDigest,
+                            const OutputSpec &spec,
+                            const TranscoderOptions &options)
+{
+    const QString container = spec.format.isEmpty() ?
+                              QFileInfo(spec.path).suffix().toLower() :
+                              spec.format;
+    QStringList fields;
+
+    fields << QString::number(RESULT_CACHE_VERSION)
+           << QString::fromLatin1(inputDigest.toHex())
+           << spec.codec << container
+           << QString::number(spec.bitRate)
+           << QString::number(spec.channels)
+           << QString::number(spec.sampleRate)
+           << QString::number((int)options.resamplerQuality)
+           << QString::number((int)options.downmix)
+           << QString::number(options.audioStream)
+           << QString::number((int)options.copyStreams)
+           << QString::number((int)options.remux)
+           << QString::number((int)(options.encoders != nullptr))
+           << QString::number((int)(options.checkpointInterval > 0))
+           << QString::number((qint64)options.trimStart)
+           << QString::number((qint64)options.trimDuration)
+           << QString::number(options.normalize ? options.targetLoudness : 0.0)
+           << QString::number(options.normalize ? options.truePeakLimit : 0.0)
+           << QString::number((qint64)options.fragmentDuration)
+           << QString::number((int)options.lowDelay)
+           << optionsField(options.decoderOptions)
+           << optionsField(options.encoderOptions);
+    return QCryptographicHash::hash(fields.join(' ').toUtf8(),
+                                    QCryptographicHash::Sha256).toHex();
+}
+
+bool ResultCache::contains(const QByteArray &key) const
+{
+    QMutexLocker locker(&mutex);
+
+    return QFile::exists(entryPath(key));
+}
+
+/**
+ * Put a cached output into place and mark it as recently used.
+ * @param key    Key of the output
+ * @param output Path the output is to be created at
+ * @return true if the output has been created from the cache
+ */
+bool ResultCache::fetch(const QByteArray &key, const QString &output)
+{
+    QMutexLocker locker(&mutex);
+    const QString entry = entryPath(key);
+
+    if (!QFile::exists(entry))
+        return false;
+    /* Replace the output rather than writing through a link it may share
+     * with another entry. */
+    QFile::remove(output);
+    if (!linkOrCopy(entry, output))
+        return false;
+    utime(QFile::encodeName(entry).constData(), nullptr);
+    return true;
+}
+
+/**
+ * Keep a finished output, then evict the least recently used entries
+ * beyond the capacity.
+ * @param key    Key of the output
+ * @param output Finished output file
+ */
+void ResultCache::store(const QByteArray &key, const QString &output)
+{
+    QMutexLocker locker(&mutex);
+    const QString entry = entryPath(key);
+    const QString part  = entry + ".part";
+
+    /* Entries appear complete or not at all. */
+    QFile::remove(part);
+    if (!linkOrCopy(output, part) ||
+        rename(QFile::encodeName(part).constData(),
+               QFile::encodeName(entry).constData()) < 0) {
+        fprintf(stderr, "Could not store '%s' in the result cache\n",
+                output.toLocal8Bit().constData());
+        QFile::remove(part);
+        return;
+    }
+    evict();
+}
+
+/**
+ * Remove an output that is about to be written if it is a hard link, so
+ * that a new file is written instead of the cache entry it may share.
+ * @param output Output file to be written
+ */
+void ResultCache::detach(const QString &output)
+{
+    struct stat status;
+
+    if (stat(QFile::encodeName(output).constData(), &status) == 0 &&
+        S_ISREG(status.st_mode) && status.st_nlink > 1)
+        QFile::remove(output);
+}
+
+int64_t ResultCache::size() const
+{
+    QMutexLocker locker(&mutex);
+    int64_t used = 0;
+
+    for (const QFileInfo &entry : QDir(directory).entryInfoList(QDir::Files))
+        used += entry.size();
+    return used;
+}
+
+QString ResultCache::entryPath(const QByteArray &key) const
+{
+    return QDir(directory).filePath(QString::fromLatin1(key));
+}
+
+/* Hard link a file, or copy it if the file system cannot link it. */
+bool ResultCache::linkOrCopy(const QString &source, const QString &target)
+{
+    if (link(QFile::encodeName(source).constData(),
+             QFile::encodeName(target).constData()) == 0)
+        return true;
+    return QFile::copy(source, target);
+}
+
+/* Remove the least recently used entries beyond the capacity. */
+void ResultCache::evict()
+{
+    int64_t used = 0;
+
+    if (capacity <= 0)
+        return;
+    /* Most recently used first. */
+    for (const QFileInfo &entry : QDir(directory).entryInfoList(QDir::Files,
+                                                                 QDir::Time)) {
+        used += entry.size();
+        if (used > capacity)
+            QFile::remove(entry.absoluteFilePath());
+    }
+}
+
+/**
+ * Take every output of the run from the result cache if all of them are
+ * cached. Otherwise remember their keys for storing them after the run.
+ * @return true if the outputs have been created from the cache
+ */
+bool Transcoder::fetchCachedOutputs()
+{
+    ResultCache *cache = options.resultCache;
+    QByteArray digest;
+    bool cached = true;
+
+    cacheKeys.clear();
+    /* Streams can be neither hashed up front nor linked. */
+    if (options.inputStream)
+        return false;
+    for (const OutputSpec &spec : outputs)
+        if (spec.stream)
+            return false;
+    /* Playlists come with segments, which are not cached along. */
+    for (const OutputSpec &spec : outputs) {
+        const QByteArray path   = spec.path.toLocal8Bit();
+        const QByteArray format = spec.format.toLatin1();
+        const AVOutputFormat *outputFormat =
+            av_guess_format(format.isEmpty() ? nullptr : format.constData(),
+                            path.constData(), nullptr);
+
+        if (outputFormat && (outputFormat->flags & AVFMT_NOFILE))
+            return false;
+    }
+    if ((digest = ResultCache::inputDigest(inputFile)).isEmpty())
+        return false;
+
+    for (const OutputSpec &spec : outputs) {
+        cacheKeys.append(ResultCache::key(digest, spec, options));
+        cached = cached && cache->contains(cacheKeys.last());
+    }
+    for (int i = 0; cached && i < outputs.size(); i++)
+        cached = cache->fetch(cacheKeys.at(i), outputs.at(i).path);
+    if (options.metrics)
+        options.metrics->add(cached ? MetricCounter::CacheHits :
+                                      MetricCounter::CacheMisses);
+    if (cached)
+        return true;
+
+    for (const OutputSpec &spec : outputs)
+        ResultCache::detach(spec.path);
+    return false;
+}
+
+/* Store the outputs of a successful run in the result cache. */
+void Transcoder::storeCachedOutputs()
+{
+    for (int i = 0; i < cacheKeys.size() && i < outputs.size(); i++)
+        options.resultCache->store(cacheKeys.at(i), outputs.at(i).path);
+    cacheKeys.clear();
+}
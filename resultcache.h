@@ -0,0 +1,62 @@
+#ifndef RESULTCACHE_H
+#define RESULTCACHE_H
+
+#include <QByteArray>
+#include <QMutex>
+#include <QString>
+
+#include <cstdint>
+
+struct OutputSpec;
+struct TranscoderOptions;
+
+/* Bumped whenever a change of the transcoder changes its output, so that
+ * results of older versions are not taken from the cache */
+#define RESULT_CACHE_VERSION 2
+
+/**
+ * Outputs of finished runs kept on disk, keyed by the digest of the input
+ * file and the settings the output was encoded with. A run whose outputs
+ * are all cached links or copies them into place instead of transcoding.
+ * Entries are hard links to the outputs where the file system allows it,
+ * copies otherwise; every hit refreshes the entry, and the least recently
+ * used entries are removed once the cache exceeds its capacity.
+ * The cache may be used from several threads at once.
+ */
+class ResultCache
+{
+    public:
+        ResultCache(const QString &directory, int64_t capacity);
+
+        static QByteArray inputDigest(const char *filename);
+
+        static QByteArray key(const QByteArray &inputDigest,
+                              const OutputSpec &spec,
+                              const TranscoderOptions &options);
+
+        bool contains(const QByteArray &key) const;
+
+        bool fetch(const QByteArray &key, const QString &output);
+
+        void store(const QByteArray &key, const QString &output);
+
+        static void detach(const QString &output);
+
+        int64_t size() const;
+
+    private:
+        ResultCache(const ResultCache &) = delete;
+        ResultCache &operator=(const ResultCache &) = delete;
+
+        QString entryPath(const QByteArray &key) const;
+
+        static bool linkOrCopy(const QString &source, const QString &target);
+
+        void evict();
+
+        QString directory;
+        int64_t capacity;
+        mutable QMutex mutex;
+};
+
+#endif
@@ -0,0 +1,110 @@
+#include "samplespill.h"
+
+#include <QDir>
+
+#include <stdio.h>
+#include <string.h>
+
+#ifdef Q_OS_UNIX
+#include <sys/mman.h>
+#endif
+
+SampleSpill::SampleSpill()
+    : channels(0), written(0), data(nullptr), position(0)
+{
+}
+
+/**
+ * Create the temporary file.
+ * @param channels  Number of channels of the samples
+ * @param directory Directory the file is created in (empty: the
+ *                  system's temporary directory)
+ * @return true if the file could be created
+ */
+bool SampleSpill::open(int channels, const QString &directory)
+{
+    const QString path = directory.isEmpty() ? QDir::tempPath() : directory;
+
+    if (channels <= 0 || channels > SAMPLE_SPILL_MAX_CHANNELS)
+        return false;
+    this->channels = channels;
+    written        = 0;
+    data           = nullptr;
+    position       = 0;
+
+    file.setFileTemplate(QDir(path).filePath("qtranscoder-XXXXXX.spill"));
+    if (!file.open()) {
+        fprintf(stderr, "Could not create a sample spill in '%s'\n",
+                path.toLocal8Bit().constData());
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Append a block of samples.
+ * @param planes  Float planes of all channels
+ * @param samples Number of samples per channel
+ * @return true if the samples were written
+ */
+bool SampleSpill::append(const uint8_t *const *planes, int samples)
+{
+    const qint64 bytes = (qint64)samples * sizeof(float);
+    const int32_t count = samples;
+
+    if (samples <= 0)
+        return true;
+    if (file.write((const char *)&count, sizeof(count)) != sizeof(count))
+        goto fail;
+    for (int c = 0; c < channels; c++)
+        if (file.write((const char *)planes[c], bytes) != bytes)
+            goto fail;
+    written += sizeof(count) + channels * bytes;
+    return true;
+
+fail:
+    fprintf(stderr, "Could not write to the sample spill '%s'\n",
+            file.fileName().toLocal8Bit().constData());
+    return false;
+}
+
+/**
+ * Finish writing and map the file to read the blocks from the start.
+ * @return true if the file could be mapped
+ */
+bool SampleSpill::rewind()
+{
+    position = 0;
+    if (!written)
+        return true;
+    if (!file.flush() || !(data = file.map(0, written))) {
+        fprintf(stderr, "Could not map the sample spill '%s'\n",
+                file.fileName().toLocal8Bit().constData());
+        return false;
+    }
+#ifdef Q_OS_UNIX
+    madvise(const_cast<uchar *>(data), written, MADV_SEQUENTIAL);
+#endif
+    return true;
+}
+
+/**
+ * Read the next block of samples.
+ * @param[out] planes Float planes of all channels, valid until the spill
+ *                    is destroyed
+ * @return Number of samples per channel (0 at the end)
+ */
+int SampleSpill::read(const float **planes)
+{
+    int32_t count;
+
+    if (!data || position + (int64_t)sizeof(count) > written)
+        return 0;
+    memcpy(&count, data + position, sizeof(count));
+    position += sizeof(count);
+    for (int c = 0; c < channels; c++) {
+        planes[c] = (const float *)(data + position);
+        position += (int64_t)count * sizeof(float);
+    }
+    return count;
+}
@@ -0,0 +1,46 @@
+#ifndef SAMPLESPILL_H
+#define SAMPLESPILL_H
+
+#include <QString>
+#include <QTemporaryFile>
+
+#include <cstdint>
+
+/* The maximum number of channels a spill can hold */
+#define SAMPLE_SPILL_MAX_CHANNELS 64
+
+/**
+ * Temporary store of float planar samples, written once and read back
+ * once in the same order.
+ * Samples are appended in blocks, each one a sample count followed by the
+ * planes of all channels, to a temporary file that is removed with the
+ * store. For reading the file is mapped, and the planes of a block are
+ * handed out straight from the page cache without copying them.
+ */
+class SampleSpill
+{
+    public:
+        SampleSpill();
+
+        bool open(int channels, const QString &directory);
+
+        bool append(const uint8_t *const *planes, int samples);
+
+        bool rewind();
+
+        int read(const float **planes);
+
+        int64_t size() const { return written; }
+
+    private:
+        SampleSpill(const SampleSpill &) = delete;
+        SampleSpill &operator=(const SampleSpill &) = delete;
+
+        QTemporaryFile file;
+        int channels;
+        int64_t written;
+        const uchar *data;
+        int64_t position;
+};
+
+#endif
@@ -0,0 +1,557 @@
+/**
+ * @file
+ * Segment-parallel transcoding engine.
+ *
+ * The input is split into time ranges aligned to the encoder's frame size.
+ * Every range is decoded and encoded on its own thread with its own
+ * demuxer, decoder, resampler and encoder, and the encoded packets are
+ * stitched into the single output file in order.
+ *
+ * To make the joins gapless, every segment starts encoding a few frames
+ * before its range (so that the encoder's overlap and psychoacoustic state
+ * is warmed up) and keeps encoding a few frames after it. Each segment then
+ * keeps exactly the packets a single encoder run would have produced for
+ * its range: the packet grid of the whole output is split at
+ * range start - initial padding. Timestamps are derived from the sample
+ * position of each range, not from a running counter.
+ *
+ * The same range transcoding also extracts a clip of the input and
+ * continues an output from a checkpoint.
+ */
+
+#include "transcoder.h"
+#include "mappedinput.h"
+
+#include <QThread>
+
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+
+/* Frames encoded before a range to warm up the encoder. */
+#define SEGMENT_ENCODER_PREROLL 4
+/* Frames encoded after a range so that its last packets see real input. */
+#define SEGMENT_ENCODER_POSTROLL 4
+/* Decoded audio in milliseconds before the encoder preroll, to warm up
+ * the decoder after seeking to the preceding keyframe. */
+#define SEGMENT_DECODER_PREROLL_MS 200
+/* Segments shorter than this are not worth the extra seeking and warm-up. */
+#define SEGMENT_MIN_SECONDS 30
+
+/* One time range of the input, in samples of the output stream. */
+struct SegmentJob
+{
+    /* First sample of the range. */
+    int64_t start;
+    /* End of the range (exclusive), or -1 for the end of the input. */
+    int64_t end;
+    /* Encoder settings of the output file. */
+    const OutputSpec *spec;
+    /* Whether the output container requires global headers. */
+    bool globalHeader;
+    /* Packets of the range in output order, owned by the job. */
+    std::vector<AVPacket *> packets;
+    int error;
+    /* Raised by the stitching thread to stop all segments. */
+    std::atomic<bool> *abort;
+};
+
+/**
+ * Point to the samples of a frame starting at a given offset.
+ * @param      frame    Decoded frame
+ * @param      offset   Number of samples to skip
+ * @param[out] data     Sample pointers, one per plane
+ */
+static void offsetSamples(const AVFrame *frame, int offset, const uint8_t **data)
+{
+    const enum AVSampleFormat format = (enum AVSampleFormat)frame->format;
+    const int planar = av_sample_fmt_is_planar(format);
+    const int planes = planar ? frame->channels : 1;
+    const int stride = av_get_bytes_per_sample(format) *
+                       (planar ? 1 : frame->channels);
+
+    for (int i = 0; i < planes; i++)
+        data[i] = frame->extended_data[i] + offset * stride;
+}
+
+/**
+ * Seek the input close to, but not after, a sample position.
+ * The demuxer positions at the preceding keyframe.
+ * @param inputFormatContext    Format context of the input file
+ * @param streamIndex           Index of the audio stream
+ * @param sampleRate            Sample rate of the position
+ * @param position              Sample position to be reached
+ * @return Error code (0 if successful)
+ */
+static int seekInput(AVFormatContext *inputFormatContext, int streamIndex,
+                     int sampleRate, int64_t position)
+{
+    AVStream *stream = inputFormatContext->streams[streamIndex];
+    const int64_t startTime = stream->start_time != AV_NOPTS_VALUE ?
+                              stream->start_time : 0;
+    const int64_t timestamp = startTime +
+                              av_rescale_q(position, av_make_q(1, sampleRate),
+                                           stream->time_base);
+    int error;
+
+    if ((error = av_seek_frame(inputFormatContext, streamIndex, timestamp,
+                               AVSEEK_FLAG_BACKWARD)) < 0) {
+        fprintf(stderr, "Could not seek input (error '%d')\n", error);
+        return error;
+    }
+    return 0;
+}
+
+/**
+ * Keep an encoded packet if it belongs to the range of this segment.
+ * @param packet                Encoded packet, timestamps in samples
+ * @param outputCodecContext    Codec context of the segment's encoder
+ * @return Error code (0 if successful)
+ */
+int Transcoder::storeSegmentPacket(AVPacket *packet,
+                                   AVCodecContext *outputCodecContext)
+{
+    const int64_t padding = outputCodecContext->initial_padding;
+    AVPacket *copy;
+
+    if (segment->start > 0 && packet->pts < segment->start - padding)
+        return 0;
+    if (segment->end >= 0 && packet->pts >= segment->end - padding)
+        return 0;
+
+    if (!(copy = av_packet_clone(packet)))
+        return AVERROR(ENOMEM);
+    segment->packets.push_back(copy);
+    return 0;
+}
+
+/**
+ * Store the part of a decoded frame that lies within [written, last) in
+ * the FIFO buffer. Samples before written, which have either been stored
+ * already or lie before the range, are dropped; a gap in the input
+ * timestamps is filled with silence.
+ * @param         frame                 Decoded frame
+ * @param         position              Sample position of the frame
+ * @param         last                  End of the range (-1: unlimited)
+ * @param[in,out] written               Next sample position to be stored
+ * @param         outputFormatContext   Format context of the output file
+ *                                      (nullptr if the packets are kept
+ *                                      for stitching)
+ * @param         outputCodecContext    Codec context of the output file
+ * @param         resampleContext       Resample context for the conversion
+ *                                      (nullptr if the formats match)
+ * @param         fifo                  Buffer to add the samples to
+ * @return Error code (0 if successful)
+ */
+int Transcoder::storeRangeSamples(AVFrame *frame, int64_t position,
+                                  int64_t last, int64_t *written,
+                                  AVFormatContext *outputFormatContext,
+                                  AVCodecContext *outputCodecContext,
+                                  SwrContext *resampleContext,
+                                  AVAudioFifo *fifo)
+{
+    const uint8_t *input[AV_NUM_DATA_POINTERS * 8];
+    uint8_t **convertedSamples;
+    int64_t end = position + frame->nb_samples;
+    int offset, count, converted, error;
+
+    if (last >= 0)
+        end = FFMIN(end, last);
+    if (end <= *written)
+        return 0;
+
+    /* Fill gaps in the input timestamps, one encoder frame at a time. */
+    while (*written < FFMIN(position, end)) {
+        const int silence = (int)FFMIN(FFMIN(position, end) - *written,
+                                       (int64_t)outputCodecContext->frame_size);
+        const int samples = (int)av_rescale(silence, outputCodecContext->sample_rate,
+                                            frame->sample_rate);
+
+        if ((error = pool.convertedSamples(&convertedSamples,
+                                           outputCodecContext, samples)) < 0)
+            return error;
+        av_samples_set_silence(convertedSamples, 0, samples,
+                               outputCodecContext->channels,
+                               outputCodecContext->sample_fmt);
+        if ((error = storeSamples(fifo, outputFormatContext, outputCodecContext,
+                                  convertedSamples, samples)) < 0)
+            return error;
+        *written += silence;
+    }
+    if (*written >= end)
+        return 0;
+
+    offset = (int)(*written - position);
+    count  = (int)(end - *written);
+    if (frame->channels > (int)(sizeof(input) / sizeof(*input)))
+        return AVERROR(EINVAL);
+    offsetSamples(frame, offset, input);
+
+    /* Without a resampler the decoded samples are stored as they are. */
+    if (resampleContext) {
+        const int outputSize = swr_get_out_samples(resampleContext, count);
+
+        if (outputSize < 0)
+            return outputSize;
+        if ((error = pool.convertedSamples(&convertedSamples, outputCodecContext,
+                                           outputSize)) < 0)
+            return error;
+        if ((converted = convertSamples(input, count, convertedSamples,
+                                        outputSize, resampleContext)) < 0)
+            return converted;
+    } else {
+        convertedSamples = (uint8_t **)input;
+        converted        = count;
+    }
+    if ((error = storeSamples(fifo, outputFormatContext, outputCodecContext,
+                              convertedSamples, converted)) < 0)
+        return error;
+
+    *written = end;
+    return 0;
+}
+
+/**
+ * Decode the input from the current position, store the samples of
+ * [first, last) and encode them. The input must have been positioned
+ * at or before first.
+ * @param inputFormatContext  Format context of the input file
+ * @param inputCodecContext   Codec context of the input file
+ * @param outputFormatContext Format context of the output file (nullptr
+ *                            if the packets are kept for stitching)
+ * @param outputCodecContext  Codec context of the output file
+ * @param resampleContext     Resample context for the conversion
+ * @param fifo                Buffer used for temporary storage
+ * @param first               First sample to be encoded
+ * @param last                End of the range (-1 for the end of the input)
+ * @return Error code (0 if successful)
+ */
+int Transcoder::transcodeRange(AVFormatContext *inputFormatContext,
+                               AVCodecContext *inputCodecContext,
+                               AVFormatContext *outputFormatContext,
+                               AVCodecContext *outputCodecContext,
+                               SwrContext *resampleContext,
+                               AVAudioFifo *fifo,
+                               int64_t first, int64_t last)
+{
+    AVStream *stream = inputFormatContext->streams[inputStreamIndex];
+    /* Positions are counted in samples of the input. */
+    const AVRational sampleTimeBase = av_make_q(1, inputCodecContext->sample_rate);
+    const int64_t startTime = stream->start_time != AV_NOPTS_VALUE ?
+                              stream->start_time : 0;
+    int64_t position = first;
+    int64_t written  = first;
+    int finished     = 0;
+
+    while (!finished && (last < 0 || written < last)) {
+        AVFrame *frame;
+        int dataPresent = 0;
+        int error = 0;
+
+        if (segment && segment->abort->load())
+            return AVERROR_EXIT;
+
+        if (pool.inputFrame(&frame))
+            return AVERROR_EXIT;
+        if (decodeAudioFrame(frame, inputFormatContext, inputCodecContext,
+                             &dataPresent, &finished))
+            return AVERROR_EXIT;
+
+        if (dataPresent) {
+            /* Trust the demuxer's timestamps after seeking; count samples
+             * for frames without one. */
+            if (frame->best_effort_timestamp != AV_NOPTS_VALUE)
+                position = av_rescale_q(frame->best_effort_timestamp - startTime,
+                                        stream->time_base, sampleTimeBase);
+            error = storeRangeSamples(frame, position, last, &written,
+                                      outputFormatContext, outputCodecContext,
+                                      resampleContext, fifo);
+            position += frame->nb_samples;
+        }
+        av_frame_unref(frame);
+        if (error < 0)
+            return error;
+
+        while (av_audio_fifo_size(fifo) >= outputCodecContext->frame_size)
+            if (loadEncodeAndWrite(fifo, outputFormatContext,
+                                   outputCodecContext, 0))
+                return AVERROR_EXIT;
+    }
+
+    /* Samples delayed by a sample rate conversion belong to the range. */
+    if (flushResampler(fifo, outputCodecContext, resampleContext))
+        return AVERROR_EXIT;
+    while (av_audio_fifo_size(fifo) > 0)
+        if (loadEncodeAndWrite(fifo, outputFormatContext, outputCodecContext, 1))
+            return AVERROR_EXIT;
+    return flushEncoder(outputFormatContext, outputCodecContext);
+}
+
+/**
+ * Decode and encode the range of one segment with contexts of its own.
+ * Runs on a thread of its own, on a separate Transcoder instance.
+ * @param job Segment to be encoded
+ * @return Error code (0 if successful)
+ */
+int Transcoder::encodeSegment(SegmentJob *job)
+{
+    MappedInput mapping;
+    AVFormatContext *inputFormatContext = nullptr;
+    AVCodecContext *inputCodecContext = nullptr;
+    AVCodecContext *outputCodecContext = nullptr;
+    SwrContext *resampleContext = nullptr;
+    AVAudioFifo *fifo = nullptr;
+    InputFormatHandle input;
+    CodecContextHandle decoder, encoder;
+    ResamplerHandle resampler;
+    FifoHandle samples;
+    int64_t first, last, decoderPreroll;
+    int ret = AVERROR_EXIT;
+
+    segment = job;
+
+    if (openInputFile(inputFile, inputSource(&mapping), options,
+                      &inputFormatContext, &inputCodecContext,
+                      &inputStreamIndex))
+        goto cleanup;
+    input.reset(inputFormatContext);
+    decoder = CodecContextHandle(inputCodecContext,
+                                 CodecContextDeleter(options.codecCache));
+    if (openEncoder(*job->spec, outputSampleRate(*job->spec, inputCodecContext),
+                    job->globalHeader, options, &outputCodecContext))
+        goto cleanup;
+    encoder = CodecContextHandle(outputCodecContext,
+                                 CodecContextDeleter(options.codecCache));
+    if (!formatsMatch(inputCodecContext, outputCodecContext) &&
+        initResampler(inputCodecContext, outputCodecContext,
+                      options.resamplerQuality, options.downmix,
+                      &resampleContext))
+        goto cleanup;
+    resampler.reset(resampleContext);
+    downmix.configure(inputCodecContext, outputCodecContext, options.downmix,
+                      resampleContext);
+    if (initFifo(&fifo, inputCodecContext, outputCodecContext))
+        goto cleanup;
+    samples.reset(fifo);
+
+    first = FFMAX((int64_t)0, job->start -
+                  SEGMENT_ENCODER_PREROLL * outputCodecContext->frame_size);
+    last  = job->end < 0 ? -1 :
+            job->end + SEGMENT_ENCODER_POSTROLL * outputCodecContext->frame_size;
+    decoderPreroll = av_rescale(SEGMENT_DECODER_PREROLL_MS,
+                                inputCodecContext->sample_rate, 1000);
+
+    if (first > 0 && seekInput(inputFormatContext, inputStreamIndex,
+                               inputCodecContext->sample_rate,
+                               FFMAX((int64_t)0, first - decoderPreroll)))
+        goto cleanup;
+
+    /* The frames of this segment start at its first sample. */
+    pts = first;
+    ret = transcodeRange(inputFormatContext, inputCodecContext, nullptr,
+                         outputCodecContext, resampleContext, fifo,
+                         first, last);
+
+cleanup:
+    segment = nullptr;
+
+    return ret;
+}
+
+/**
+ * Continue an output from the checkpoint of an earlier run: encode the
+ * input from shortly before the checkpoint's position, warming up the
+ * encoder like a segment, and append the packets from the position on.
+ * @param inputFormatContext  Format context of the input file
+ * @param inputCodecContext   Codec context of the input file
+ * @param outputFormatContext Format context of the output file,
+ *                            positioned at the checkpoint
+ * @param outputCodecContext  Codec context of the output file
+ * @param resampleContext     Resample context for the conversion
+ * @param fifo                Buffer used for temporary storage
+ * @return Error code (0 if successful)
+ */
+int Transcoder::processResumed(AVFormatContext *inputFormatContext,
+                               AVCodecContext *inputCodecContext,
+                               AVFormatContext *outputFormatContext,
+                               AVCodecContext *outputCodecContext,
+                               SwrContext *resampleContext,
+                               AVAudioFifo *fifo)
+{
+    const int64_t first = FFMAX((int64_t)0, resumePosition -
+                                SEGMENT_ENCODER_PREROLL * outputCodecContext->frame_size);
+    const int64_t decoderPreroll = av_rescale(SEGMENT_DECODER_PREROLL_MS,
+                                              inputCodecContext->sample_rate, 1000);
+
+    if (first > 0 && seekInput(inputFormatContext, inputStreamIndex,
+                               inputCodecContext->sample_rate,
+                               FFMAX((int64_t)0, first - decoderPreroll)))
+        return AVERROR_EXIT;
+
+    pts = first;
+    return transcodeRange(inputFormatContext, inputCodecContext,
+                          outputFormatContext, outputCodecContext,
+                          resampleContext, fifo, first, -1);
+}
+
+/**
+ * Transcode the clip of the input given by the trim options: seek to
+ * shortly before its start, drop the samples decoded before its first
+ * sample and stop reading at its end. The output starts at timestamp 0.
+ * @param inputFormatContext  Format context of the input file
+ * @param inputCodecContext   Codec context of the input file
+ * @param outputFormatContext Format context of the output file
+ * @param outputCodecContext  Codec context of the output file
+ * @param resampleContext     Resample context for the conversion
+ * @param fifo                Buffer used for temporary storage
+ * @return Error code (0 if successful)
+ */
+int Transcoder::processTrimmed(AVFormatContext *inputFormatContext,
+                               AVCodecContext *inputCodecContext,
+                               AVFormatContext *outputFormatContext,
+                               AVCodecContext *outputCodecContext,
+                               SwrContext *resampleContext,
+                               AVAudioFifo *fifo)
+{
+    const int sampleRate = inputCodecContext->sample_rate;
+    const int64_t first  = av_rescale(options.trimStart, sampleRate, AV_TIME_BASE);
+    const int64_t last   = options.trimDuration > 0 ?
+                           first + av_rescale(options.trimDuration, sampleRate,
+                                              AV_TIME_BASE) : -1;
+    const int64_t decoderPreroll = av_rescale(SEGMENT_DECODER_PREROLL_MS,
+                                              sampleRate, 1000);
+
+    if (first > 0 && seekInput(inputFormatContext, inputStreamIndex, sampleRate,
+                               FFMAX((int64_t)0, first - decoderPreroll)))
+        return AVERROR_EXIT;
+
+    pts = 0;
+    return transcodeRange(inputFormatContext, inputCodecContext,
+                          outputFormatContext, outputCodecContext,
+                          resampleContext, fifo, first, last);
+}
+
+/**
+ * Transcode the input as several time ranges in parallel and write the
+ * stitched packets to the output file. Falls back to the sequential
+ * engine if the input is too short, its duration is unknown, it is a
+ * stream or its sample rate has to be converted.
+ * @param inputFormatContext  Format context of the input file
+ * @param inputCodecContext   Codec context of the input file
+ * @param outputFormatContext Format context of the output file
+ * @param outputCodecContext  Codec context of the output file
+ * @param resampleContext     Resample context for the conversion
+ * @param fifo                Buffer used for temporary storage
+ * @return Error code (0 if successful)
+ */
+int Transcoder::processSegmented(AVFormatContext *inputFormatContext,
+                                 AVCodecContext *inputCodecContext,
+                                 AVFormatContext *outputFormatContext,
+                                 AVCodecContext *outputCodecContext,
+                                 SwrContext *resampleContext,
+                                 AVAudioFifo *fifo)
+{
+    const int frameSize  = outputCodecContext->frame_size;
+    const int sampleRate = outputCodecContext->sample_rate;
+    const int64_t duration = inputFormatContext->duration;
+    int count = options.segments > 0 ? options.segments :
+                                       QThread::idealThreadCount();
+    int64_t totalSamples = 0;
+    int64_t length;
+    std::atomic<bool> abort(false);
+    int ret = 0;
+
+    if (duration == AV_NOPTS_VALUE || duration <= 0 || frameSize <= 0) {
+        fprintf(stderr, "Input duration unknown, transcoding sequentially\n");
+        count = 1;
+    } else if (analyzer) {
+        /* The analysis takes the samples in order. */
+        fprintf(stderr, "Analysis taps, transcoding sequentially\n");
+        count = 1;
+    } else if (options.inputStream) {
+        /* Every segment opens the input on its own. */
+        fprintf(stderr, "Input is a stream, transcoding sequentially\n");
+        count = 1;
+    } else if (sampleRate != inputCodecContext->sample_rate) {
+        /* The ranges are cut at input sample positions, which only line
+         * up with the output samples without a sample rate conversion. */
+        fprintf(stderr, "Sample rate conversion, transcoding sequentially\n");
+        count = 1;
+    } else {
+        totalSamples = av_rescale(duration, sampleRate, AV_TIME_BASE);
+        count = (int)FFMIN((int64_t)count,
+                           totalSamples / ((int64_t)SEGMENT_MIN_SECONDS * sampleRate));
+    }
+    if (count < 2)
+        return processSequential(inputFormatContext, inputCodecContext,
+                                 outputFormatContext, outputCodecContext,
+                                 resampleContext, fifo);
+
+    /* Split into ranges of whole encoder frames. The last range runs
+     * up to the end of the input, whatever the container claimed. */
+    length = (totalSamples + count - 1) / count;
+    length = (length + frameSize - 1) / frameSize * frameSize;
+
+    /* The segments share the cores among their codecs. */
+    TranscoderOptions workerOptions = options;
+    workerOptions.codecThreads = codecThreadShare(options, count);
+
+    std::vector<std::unique_ptr<SegmentJob>> jobs;
+    std::vector<std::unique_ptr<Transcoder>> workers;
+    std::vector<std::thread> threads;
+    for (int i = 0; i < count; i++) {
+        std::unique_ptr<SegmentJob> job(new SegmentJob);
+        job->start        = i * length;
+        job->end          = i == count - 1 ? -1 : (i + 1) * length;
+        job->spec         = &outputs.first();
+        job->globalHeader = outputFormatContext->oformat->flags & AVFMT_GLOBALHEADER;
+        job->error        = 0;
+        job->abort        = &abort;
+        jobs.push_back(std::move(job));
+        workers.emplace_back(new Transcoder(inputFile, nullptr, workerOptions));
+        workers.back()->owner = this;
+    }
+    for (int i = 0; i < count; i++) {
+        Transcoder *worker = workers[i].get();
+        SegmentJob *job    = jobs[i].get();
+        threads.emplace_back([worker, job]() {
+            job->error = worker->encodeSegment(job);
+        });
+    }
+
+    /* Write the segments in order as soon as each one is finished. */
+    for (int i = 0; i < count; i++) {
+        SegmentJob *job = jobs[i].get();
+
+        threads[i].join();
+        if (!ret && job->error < 0) {
+            ret = job->error;
+            abort.store(true);
+        }
+        for (AVPacket *packet : job->packets) {
+            int error;
+
+            if (!ret) {
+                StageTimer timer(options.stats);
+                const int64_t packetEnd = packet->pts + packet->duration +
+                                          outputCodecContext->initial_padding;
+
+                timer.start(TranscodeStage::Write);
+                if ((error = writeAudioPacket(outputFormatContext,
+                                              outputCodecContext, packet)) < 0 ||
+                    (error = flushFragment(outputFormatContext, packetEnd,
+                                           outputCodecContext->sample_rate)) < 0) {
+                    fprintf(stderr, "Could not write frame (error '%d')\n",
+                            error);
+                    ret = error;
+                    abort.store(true);
+                }
+            }
+            av_packet_free(&packet);
+        }
+        job->packets.clear();
+    }
+
+    return ret;
+}
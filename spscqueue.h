@@ -0,0 +1,103 @@
+#ifndef SPSCQUEUE_H
+#define SPSCQUEUE_H
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <thread>
+#include <vector>
+
+/**
+ * Lock-free bounded ring buffer for exactly one producer and one consumer
+ * thread. The blocking push/pop variants provide backpressure: a producer
+ * waits as long as the queue is full, a consumer as long as it is empty.
+ * Both give up as soon as the shared abort flag is raised.
+ */
+template <typename T>
+class SpscQueue
+{
+    public:
+        explicit SpscQueue(size_t capacity)
+            : ring(capacity + 1), head(0), tail(0)
+        {
+        }
+
+        /* Append one element. Returns false if the queue is full. */
+        bool tryPush(const T &value)
+        {
+            const size_t current = tail.load(std::memory_order_relaxed);
+            const size_t next    = increment(current);
+
+            if (next == head.load(std::memory_order_acquire))
+                return false;
+            ring[current] = value;
+            tail.store(next, std::memory_order_release);
+            return true;
+        }
+
+        /* Remove the oldest element. Returns false if the queue is empty. */
+        bool tryPop(T *value)
+        {
+            const size_t current = head.load(std::memory_order_relaxed);
+
+            if (current == tail.load(std::memory_order_acquire))
+                return false;
+            *value = ring[current];
+            head.store(increment(current), std::memory_order_release);
+            return true;
+        }
+
+        /* Append one element, waiting for room. Returns false on abort. */
+        bool push(const T &value, const std::atomic<bool> &abort)
+        {
+            for (int spins = 0; !tryPush(value); spins++) {
+                if (abort.load(std::memory_order_relaxed))
+                    return false;
+                backoff(spins);
+            }
+            return true;
+        }
+
+        /* Remove the oldest element, waiting for one. Returns false on abort. */
+        bool pop(T *value, const std::atomic<bool> &abort)
+        {
+            for (int spins = 0; !tryPop(value); spins++) {
+                if (abort.load(std::memory_order_relaxed))
+                    return false;
+                backoff(spins);
+            }
+            return true;
+        }
+
+    private:
+        SpscQueue(const SpscQueue &) = delete;
+        SpscQueue &operator=(const SpscQueue &) = delete;
+
+        size_t increment(size_t index) const
+        {
+            return index + 1 == ring.size() ? 0 : index + 1;
+        }
+
+        /* Spin shortly first, as the other side usually only needs a few
+         * microseconds per frame, then stop burning the core. */
+        static void backoff(int spins)
+        {
+            if (spins < 64)
+                return;
+            if (spins < 128)
+                std::this_thread::yield();
+            else
+                std::this_thread::sleep_for(std::chrono::microseconds(50));
+        }
+
+        std::vector<T> ring;
+        /* Keep both indices on their own cache lines to avoid false sharing.
+         * Padding rather than alignas, so that queues can be allocated on
+         * the heap without C++17 aligned new. */
+        char headPadding[64];
+        std::atomic<size_t> head;
+        char tailPadding[64 - sizeof(std::atomic<size_t>)];
+        std::atomic<size_t> tail;
+};
+
+#endif
@@ -0,0 +1,367 @@
+/**
+ * @file
+ * Stream copy of the input streams that are not transcoded.
+ *
+ * Video, cover art, further audio tracks and subtitles of the input are
+ * passed to the output muxer packet by packet, without decoding. Their
+ * timestamps are shifted by the start time of the transcoded audio
+ * stream, whose output timestamps start at 0, to keep them in sync.
+ *
+ * Audio that already has the codec and settings of the output is remuxed
+ * the same way, instead of being decoded and encoded again.
+ */
+
+#include "transcoder.h"
+
+/**
+ * Create an output stream for every input stream to be copied.
+ * Streams the output container cannot hold are dropped with a note.
+ * Must be called before the header of the output file is written.
+ * @param inputFormatContext  Format context of the input file
+ * @param outputFormatContext Format context of the output file
+ * @return Error code (0 if successful)
+ */
+int Transcoder::addCopiedStreams(AVFormatContext *inputFormatContext,
+                                 AVFormatContext *outputFormatContext)
+{
+    int error;
+
+    streamMap = QVector<int>((int)inputFormatContext->nb_streams, -1);
+    for (unsigned int i = 0; i < inputFormatContext->nb_streams; i++) {
+        AVStream *inputStream = inputFormatContext->streams[i];
+        const AVCodecParameters *parameters = inputStream->codecpar;
+        AVStream *stream;
+
+        if ((int)i == inputStreamIndex)
+            continue;
+        if (parameters->codec_type == AVMEDIA_TYPE_ATTACHMENT ||
+            parameters->codec_id == AV_CODEC_ID_NONE ||
+            avformat_query_codec(outputFormatContext->oformat,
+                                 parameters->codec_id,
+                                 FF_COMPLIANCE_NORMAL) == 0) {
+            fprintf(stderr, "Stream %u (%s) cannot be copied, dropping it\n",
+                    i, avcodec_get_name(parameters->codec_id));
+            inputStream->discard = AVDISCARD_ALL;
+            continue;
+        }
+
+        if (!(stream = avformat_new_stream(outputFormatContext, nullptr))) {
+            fprintf(stderr, "Could not create new stream\n");
+            return AVERROR(ENOMEM);
+        }
+        if ((error = avcodec_parameters_copy(stream->codecpar, parameters)) < 0) {
+            fprintf(stderr, "Could not copy stream parameters (error '%d')\n",
+                    error);
+            return error;
+        }
+        /* The tag of the input container may mean something else in the
+         * output container. */
+        stream->codecpar->codec_tag = 0;
+        stream->time_base   = inputStream->time_base;
+        stream->disposition = inputStream->disposition;
+        av_dict_copy(&stream->metadata, inputStream->metadata, 0);
+        streamMap[i] = stream->index;
+    }
+    copyOutput = outputFormatContext->nb_streams > 1 ? outputFormatContext : nullptr;
+    return 0;
+}
+
+/**
+ * Write a packet of a copied stream to the output file.
+ * Packets of streams that are not copied are ignored.
+ * @param inputFormatContext Format context of the input file
+ * @param packet             Packet read from the input; unreferenced
+ * @return Error code (0 if successful)
+ */
+int Transcoder::copyPacket(AVFormatContext *inputFormatContext, AVPacket *packet)
+{
+    const int index = packet->stream_index < streamMap.size() ?
+                      streamMap.at(packet->stream_index) : -1;
+    const AVStream *audioStream = inputFormatContext->streams[inputStreamIndex];
+    StageTimer timer(options.stats);
+    AVStream *stream;
+    int64_t offset = 0;
+    int error;
+
+    if (!copyOutput || index < 0) {
+        av_packet_unref(packet);
+        return 0;
+    }
+    stream = copyOutput->streams[index];
+
+    av_packet_rescale_ts(packet,
+                         inputFormatContext->streams[packet->stream_index]->time_base,
+                         stream->time_base);
+    if (audioStream->start_time != AV_NOPTS_VALUE)
+        offset = av_rescale_q(audioStream->start_time, audioStream->time_base,
+                              stream->time_base);
+    if (packet->pts != AV_NOPTS_VALUE)
+        packet->pts -= offset;
+    if (packet->dts != AV_NOPTS_VALUE)
+        packet->dts -= offset;
+    packet->stream_index = index;
+    packet->pos          = -1;
+
+    timer.start(TranscodeStage::Write);
+    if ((error = av_interleaved_write_frame(copyOutput, packet)) < 0)
+        fprintf(stderr, "Could not write copied packet (error '%d')\n", error);
+    av_packet_unref(packet);
+    return error;
+}
+
+/**
+ * Write an encoded audio packet to the output file. Along with copied
+ * streams the packets have to be interleaved by the muxer; otherwise they
+ * are written as they come. Muxers like MPEG-TS choose a time base of
+ * their own, so the encoder's timestamps are always rescaled.
+ * @param outputFormatContext Format context of the output file
+ * @param outputCodecContext  Codec context of the encoder
+ * @param packet              Encoded packet
+ * @return Error code (0 if successful)
+ */
+int Transcoder::writeAudioPacket(AVFormatContext *outputFormatContext,
+                                 AVCodecContext *outputCodecContext,
+                                 AVPacket *packet)
+{
+    packet->stream_index = 0;
+    av_packet_rescale_ts(packet, outputCodecContext->time_base,
+                         outputFormatContext->streams[0]->time_base);
+    if (copyOutput != outputFormatContext)
+        return av_write_frame(outputFormatContext, packet);
+    return av_interleaved_write_frame(outputFormatContext, packet);
+}
+
+/**
+ * Check whether the audio stream of the input is already what an output
+ * asks for, so that it can be remuxed instead of transcoded: the same
+ * codec, channel count and sample rate, at a bit rate not more than
+ * REMUX_BIT_RATE_TOLERANCE percent above the requested one.
+ * @param spec       Output file and encoder settings
+ * @param sampleRate Sample rate of the output in Hz
+ * @param parameters Parameters of the input audio stream
+ * @return true if the packets can be copied
+ */
+bool Transcoder::canRemux(const OutputSpec &spec, int sampleRate,
+                          const AVCodecParameters *parameters)
+{
+    const QByteArray codecName = spec.codec.toLatin1();
+    const QByteArray path      = spec.path.toLocal8Bit();
+    const QByteArray format    = spec.format.toLatin1();
+    const AVCodec *encoder = codecName.isEmpty() ?
+                             avcodec_find_encoder(AV_CODEC_ID_AAC) :
+                             avcodec_find_encoder_by_name(codecName.constData());
+    const AVOutputFormat *outputFormat;
+
+    if (!encoder || encoder->id != parameters->codec_id ||
+        parameters->channels != spec.channels ||
+        parameters->sample_rate != sampleRate)
+        return false;
+    /* An unknown bit rate might be far above the requested one. */
+    if (parameters->bit_rate <= 0 ||
+        parameters->bit_rate > (int64_t)spec.bitRate *
+                               (100 + REMUX_BIT_RATE_TOLERANCE) / 100)
+        return false;
+
+    outputFormat = av_guess_format(format.isEmpty() ? nullptr : format.constData(),
+                                   path.constData(), nullptr);
+    return outputFormat && avformat_query_codec(outputFormat, parameters->codec_id,
+                                                FF_COMPLIANCE_NORMAL) != 0;
+}
+
+/**
+ * Prepare the bitstream filter converting ADTS framed AAC, as found in
+ * raw .aac files and MPEG-TS, into the raw packets most containers expect.
+ * @param      parameters Parameters of the input audio stream
+ * @param      timeBase   Time base of the input audio stream
+ * @param[out] filter     Bitstream filter, nullptr if none is needed
+ * @return Error code (0 if successful)
+ */
+static int initRemuxFilter(const AVCodecParameters *parameters,
+                           AVRational timeBase, AVBSFContext **filter)
+{
+    const AVBitStreamFilter *adtsToAsc;
+    int error;
+
+    *filter = nullptr;
+    if (parameters->codec_id != AV_CODEC_ID_AAC)
+        return 0;
+    if (!(adtsToAsc = av_bsf_get_by_name("aac_adtstoasc"))) {
+        fprintf(stderr, "Could not find the aac_adtstoasc bitstream filter\n");
+        return AVERROR_BSF_NOT_FOUND;
+    }
+    if ((error = av_bsf_alloc(adtsToAsc, filter)) < 0)
+        return error;
+    (*filter)->time_base_in = timeBase;
+    if ((error = avcodec_parameters_copy((*filter)->par_in, parameters)) < 0 ||
+        (error = av_bsf_init(*filter)) < 0) {
+        fprintf(stderr, "Could not initialize bitstream filter (error '%d')\n",
+                error);
+        av_bsf_free(filter);
+        return error;
+    }
+    return 0;
+}
+
+/**
+ * Write a remuxed audio packet, timestamps starting at 0 like those of
+ * transcoded audio.
+ * @param outputFormatContext Format context of the output file
+ * @param inputStream         Input audio stream
+ * @param timeBase            Time base of the packet
+ * @param packet              Packet to be written; unreferenced
+ * @return Error code (0 if successful)
+ */
+static int writeRemuxedPacket(AVFormatContext *outputFormatContext,
+                              const AVStream *inputStream, AVRational timeBase,
+                              AVPacket *packet)
+{
+    const AVStream *stream = outputFormatContext->streams[0];
+    const int64_t offset   = inputStream->start_time != AV_NOPTS_VALUE ?
+                             inputStream->start_time : 0;
+    int error;
+
+    if (packet->pts != AV_NOPTS_VALUE)
+        packet->pts -= av_rescale_q(offset, inputStream->time_base, timeBase);
+    if (packet->dts != AV_NOPTS_VALUE)
+        packet->dts -= av_rescale_q(offset, inputStream->time_base, timeBase);
+    av_packet_rescale_ts(packet, timeBase, stream->time_base);
+    packet->stream_index = 0;
+    packet->pos          = -1;
+
+    if ((error = av_interleaved_write_frame(outputFormatContext, packet)) < 0)
+        fprintf(stderr, "Could not write frame (error '%d')\n", error);
+    av_packet_unref(packet);
+    return error;
+}
+
+/**
+ * Pass a packet of the input audio stream through the bitstream filter,
+ * if there is one, and write the result.
+ * @param outputFormatContext Format context of the output file
+ * @param inputStream         Input audio stream
+ * @param filter              Bitstream filter, or nullptr
+ * @param timeBase            Time base of the written packets
+ * @param packet              Packet to be written, or nullptr at the end of
+ *                            the input to drain the filter; unreferenced
+ * @param filtered            Packet receiving the filter's output
+ * @return Error code (0 if successful)
+ */
+static int filterAndWrite(AVFormatContext *outputFormatContext,
+                          const AVStream *inputStream, AVBSFContext *filter,
+                          AVRational timeBase, AVPacket *packet,
+                          AVPacket *filtered)
+{
+    int error;
+
+    if (!filter)
+        return packet ? writeRemuxedPacket(outputFormatContext, inputStream,
+                                           timeBase, packet) : 0;
+
+    if ((error = av_bsf_send_packet(filter, packet)) < 0) {
+        fprintf(stderr, "Could not filter packet (error '%d')\n", error);
+        return error;
+    }
+    while ((error = av_bsf_receive_packet(filter, filtered)) >= 0)
+        if ((error = writeRemuxedPacket(outputFormatContext, inputStream,
+                                        timeBase, filtered)) < 0)
+            break;
+    return error == AVERROR(EAGAIN) || error == AVERROR_EOF ? 0 : error;
+}
+
+/**
+ * Copy the packets of the input audio stream into the output file
+ * without decoding them, along with the other copied streams.
+ * @param inputFormatContext Format context of the input file
+ * @return Error code (0 if successful)
+ */
+int Transcoder::processRemux(AVFormatContext *inputFormatContext)
+{
+    const AVStream *inputStream = inputFormatContext->streams[inputStreamIndex];
+    AVFormatContext *outputFormatContext = nullptr;
+    AVBSFContext *filter = nullptr;
+    AVRational timeBase = inputStream->time_base;
+    StageTimer timer(options.stats);
+    AVPacket *packet, *filtered;
+    AVStream *stream;
+    int error;
+
+    if ((error = openOutputContainer(outputs.first(), &outputFormatContext)) < 0)
+        return error;
+    if ((error = initRemuxFilter(inputStream->codecpar, inputStream->time_base,
+                                 &filter)) < 0)
+        goto cleanup;
+    if (!(stream = avformat_new_stream(outputFormatContext, nullptr))) {
+        fprintf(stderr, "Could not create new stream\n");
+        error = AVERROR(ENOMEM);
+        goto cleanup;
+    }
+    if ((error = avcodec_parameters_copy(stream->codecpar,
+                                         filter ? filter->par_out :
+                                                  inputStream->codecpar)) < 0)
+        goto cleanup;
+    if (filter)
+        timeBase = filter->time_base_out;
+    stream->codecpar->codec_tag = 0;
+    stream->time_base           = timeBase;
+    if (options.copyStreams &&
+        (error = addCopiedStreams(inputFormatContext, outputFormatContext)) < 0)
+        goto cleanup;
+    if ((error = writeOutputFileHeader(outputFormatContext)) < 0)
+        goto cleanup;
+    if ((error = pool.inputPacket(&packet)) < 0 ||
+        (error = pool.outputPacket(&filtered)) < 0)
+        goto cleanup;
+
+    while (1) {
+        if (isCancelled()) {
+            fprintf(stderr, "Transcoding cancelled\n");
+            error = AVERROR_EXIT;
+            goto cleanup;
+        }
+        timer.start(TranscodeStage::Decode);
+        if ((error = av_read_frame(inputFormatContext, packet)) < 0) {
+            if (error != AVERROR_EOF) {
+                fprintf(stderr, "Could not read frame (error '%d')\n", error);
+                goto cleanup;
+            }
+            break;
+        }
+        reportProgress(inputFormatContext, packet);
+        if (options.metrics) {
+            options.metrics->add(MetricCounter::PacketsRead);
+            if (packet->stream_index == inputStreamIndex && packet->duration > 0)
+                options.metrics->add(MetricCounter::MediaMicroseconds,
+                                     av_rescale_q(packet->duration,
+                                                  inputStream->time_base,
+                                                  av_get_time_base_q()));
+        }
+
+        if (packet->stream_index != inputStreamIndex) {
+            timer.stop();
+            error = copyPacket(inputFormatContext, packet);
+        } else {
+            timer.start(TranscodeStage::Write);
+            error = filterAndWrite(outputFormatContext, inputStream, filter,
+                                   timeBase, packet, filtered);
+        }
+        av_packet_unref(packet);
+        if (error < 0)
+            goto cleanup;
+    }
+
+    /* Drain the packets held back by the bitstream filter. */
+    timer.start(TranscodeStage::Write);
+    if ((error = filterAndWrite(outputFormatContext, inputStream, filter,
+                                timeBase, nullptr, filtered)) < 0)
+        goto cleanup;
+    timer.stop();
+
+    error = writeOutputFileTrailer(outputFormatContext);
+
+cleanup:
+    copyOutput = nullptr;
+    streamMap.clear();
+    av_bsf_free(&filter);
+    closeOutputFile(&outputFormatContext);
+    return error < 0 ? error : 0;
+}
@@ -0,0 +1,77 @@
+#include "streamio.h"
+
+#include <stdio.h>
+
+extern "C" {
+    #include "libavutil/error.h"
+    #include "libavutil/mem.h"
+}
+
+/**
+ * Create an I/O context reading from or writing to a caller's stream.
+ * @param      stream   Callbacks of the stream
+ * @param      write    Whether the context is used for writing
+ * @param[out] context  I/O context to be used as pb of a format context
+ * @return Error code (0 if successful)
+ */
+int StreamIO::open(const StreamCallbacks *stream, bool write,
+                   AVIOContext **context)
+{
+    const int bufferSize = stream->bufferSize > 0 ? stream->bufferSize :
+                                                    STREAM_IO_BUFFER_SIZE;
+    unsigned char *buffer;
+
+    if (write ? !stream->write : !stream->read) {
+        fprintf(stderr, "Stream has no %s callback\n", write ? "write" : "read");
+        return AVERROR(EINVAL);
+    }
+
+    if (!(buffer = (unsigned char *)av_malloc(bufferSize))) {
+        fprintf(stderr, "Could not allocate stream buffer\n");
+        return AVERROR(ENOMEM);
+    }
+
+    *context = avio_alloc_context(buffer, bufferSize, write ? 1 : 0,
+                                  const_cast<StreamCallbacks *>(stream),
+                                  write ? nullptr : readPacket,
+                                  write ? writePacket : nullptr,
+                                  stream->seek ? seek : nullptr);
+    if (!*context) {
+        fprintf(stderr, "Could not allocate stream I/O context\n");
+        av_free(buffer);
+        return AVERROR(ENOMEM);
+    }
+    return 0;
+}
+
+/**
+ * Flush and free an I/O context created by open(). The stream itself
+ * stays untouched.
+ * @param context I/O context to be freed
+ */
+void StreamIO::close(AVIOContext **context)
+{
+    if (!*context)
+        return;
+    if ((*context)->write_flag)
+        avio_flush(*context);
+    av_freep(&(*context)->buffer);
+    avio_context_free(context);
+}
+
+int StreamIO::readPacket(void *opaque, uint8_t *buffer, int size)
+{
+    const int bytes = static_cast<StreamCallbacks *>(opaque)->read(buffer, size);
+
+    return bytes == 0 ? AVERROR_EOF : bytes;
+}
+
+int StreamIO::writePacket(void *opaque, uint8_t *buffer, int size)
+{
+    return static_cast<StreamCallbacks *>(opaque)->write(buffer, size);
+}
+
+int64_t StreamIO::seek(void *opaque, int64_t offset, int whence)
+{
+    return static_cast<StreamCallbacks *>(opaque)->seek(offset, whence);
+}
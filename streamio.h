@@ -0,0 +1,57 @@
+#ifndef STREAMIO_H
+#define STREAMIO_H
+
+#include <functional>
+
+#ifdef __cplusplus
+extern "C" {
+    #include "libavformat/avio.h"
+}
+#endif
+
+/* The default buffer size of stream input and output in bytes */
+#define STREAM_IO_BUFFER_SIZE (64 * 1024)
+
+/**
+ * Byte stream provided by the caller in place of an input or output file,
+ * e.g. a pipe, a socket or an object storage transfer.
+ * Only read is needed for an input and only write for an output. Without
+ * seek, the stream is treated as not seekable; for MP4 output this means
+ * that a fragmented file is written.
+ */
+struct StreamCallbacks
+{
+    /* Read up to size bytes. Returns the number of bytes read, 0 at the
+     * end of the stream or a negative AVERROR code. */
+    std::function<int(uint8_t *buffer, int size)> read;
+    /* Write size bytes. Returns the number of bytes written or a negative
+     * AVERROR code. */
+    std::function<int(const uint8_t *buffer, int size)> write;
+    /* Seek as fseek() does, or return the stream size for AVSEEK_SIZE.
+     * Returns the new position or a negative AVERROR code. */
+    std::function<int64_t(int64_t offset, int whence)> seek;
+    /* Size of the buffer between the stream and libavformat. */
+    int bufferSize = STREAM_IO_BUFFER_SIZE;
+};
+
+/**
+ * AVIOContexts on top of StreamCallbacks.
+ * The callbacks have to outlive the context.
+ */
+class StreamIO
+{
+    public:
+        static int open(const StreamCallbacks *stream, bool write,
+                        AVIOContext **context);
+
+        static void close(AVIOContext **context);
+
+    private:
+        static int readPacket(void *opaque, uint8_t *buffer, int size);
+
+        static int writePacket(void *opaque, uint8_t *buffer, int size);
+
+        static int64_t seek(void *opaque, int64_t offset, int whence);
+};
+
+#endif
@@ -0,0 +1,179 @@
+#include "transcodemetrics.h"
+#include "memoryaccount.h"
+
+#include <QJsonArray>
+
+/* Upper bounds of the encode latency buckets in us; the last one is +Inf. */
+static const int64_t latencyBounds[METRICS_LATENCY_BUCKETS - 1] = {
+    25, 50, 100, 250, 500, 1000, 2500, 5000, 10000, 25000
+};
+
+TranscodeMetrics::TranscodeMetrics()
+    : fifoHighWater(0), latencySum(0)
+{
+    for (int i = 0; i < (int)MetricCounter::Count; i++)
+        counters[i].store(0, std::memory_order_relaxed);
+    for (int i = 0; i < METRICS_LATENCY_BUCKETS; i++)
+        latencyBuckets[i].store(0, std::memory_order_relaxed);
+}
+
+/**
+ * Account for the number of samples a FIFO buffer holds.
+ * @param samples Samples in the buffer after a write
+ */
+void TranscodeMetrics::raiseFifoDepth(int64_t samples)
+{
+    int64_t highWater = fifoHighWater.load(std::memory_order_relaxed);
+
+    while (samples > highWater &&
+           !fifoHighWater.compare_exchange_weak(highWater, samples,
+                                                std::memory_order_relaxed))
+        ;
+}
+
+/**
+ * Account for the time the encoder took for one frame.
+ * @param nanoseconds Time spent sending the frame and receiving its packets
+ */
+void TranscodeMetrics::observeEncodeLatency(int64_t nanoseconds)
+{
+    const int64_t microseconds = nanoseconds / 1000;
+    int bucket = 0;
+
+    while (bucket < METRICS_LATENCY_BUCKETS - 1 &&
+           microseconds > latencyBounds[bucket])
+        bucket++;
+    latencyBuckets[bucket].fetch_add(1, std::memory_order_relaxed);
+    latencySum.fetch_add(nanoseconds, std::memory_order_relaxed);
+}
+
+int64_t TranscodeMetrics::value(MetricCounter counter) const
+{
+    return counters[(int)counter].load(std::memory_order_relaxed);
+}
+
+/**
+ * Speed of the finished jobs relative to playback.
+ * Jobs running concurrently each count with their own wall clock time.
+ * @return Seconds of audio transcoded per second of job time, 0 if no
+ *         job has finished yet
+ */
+double TranscodeMetrics::realtimeFactor() const
+{
+    const int64_t elapsed = value(MetricCounter::JobMicroseconds);
+
+    return elapsed > 0 ? (double)value(MetricCounter::MediaMicroseconds) / elapsed : 0.0;
+}
+
+/**
+ * Render the metrics in the Prometheus text exposition format.
+ * @return Metrics, one sample per line
+ */
+QByteArray TranscodeMetrics::prometheus() const
+{
+    QByteArray text;
+    int64_t cumulated = 0;
+
+    for (int i = 0; i < (int)MetricCounter::Count; i++) {
+        const QByteArray name = QByteArray("qtranscoder_") +
+                                counterName((MetricCounter)i) + "_total";
+
+        text += "# TYPE " + name + " counter\n";
+        text += name + ' ' + QByteArray::number((qlonglong)value((MetricCounter)i)) + '\n';
+    }
+
+    text += "# TYPE qtranscoder_fifo_high_water_samples gauge\n";
+    text += "qtranscoder_fifo_high_water_samples " +
+            QByteArray::number((qlonglong)fifoHighWater.load(std::memory_order_relaxed)) + '\n';
+    text += "# TYPE qtranscoder_memory_used_bytes gauge\n";
+    text += "qtranscoder_memory_used_bytes " +
+            QByteArray::number((qlonglong)MemoryAccount::used()) + '\n';
+    text += "# TYPE qtranscoder_memory_peak_bytes gauge\n";
+    text += "qtranscoder_memory_peak_bytes " +
+            QByteArray::number((qlonglong)MemoryAccount::peak()) + '\n';
+    text += "# TYPE qtranscoder_realtime_factor gauge\n";
+    text += "qtranscoder_realtime_factor " + QByteArray::number(realtimeFactor()) + '\n';
+
+    text += "# TYPE qtranscoder_encode_latency_seconds histogram\n";
+    for (int i = 0; i < METRICS_LATENCY_BUCKETS; i++) {
+        cumulated += latencyBuckets[i].load(std::memory_order_relaxed);
+        text += "qtranscoder_encode_latency_seconds_bucket{le=\"";
+        text += i < METRICS_LATENCY_BUCKETS - 1 ?
+                QByteArray::number(latencyBounds[i] / 1e6) : QByteArray("+Inf");
+        text += "\"} " + QByteArray::number((qlonglong)cumulated) + '\n';
+    }
+    text += "qtranscoder_encode_latency_seconds_sum " +
+            QByteArray::number(latencySum.load(std::memory_order_relaxed) / 1e9) + '\n';
+    text += "qtranscoder_encode_latency_seconds_count " +
+            QByteArray::number((qlonglong)cumulated) + '\n';
+    return text;
+}
+
+/**
+ * Summarize the metrics as a JSON object, the latency buckets given as
+ * the number of frames per bucket.
+ * @return Summary of the metrics
+ */
+QJsonObject TranscodeMetrics::json() const
+{
+    QJsonObject summary;
+    QJsonArray buckets;
+
+    for (int i = 0; i < (int)MetricCounter::Count; i++)
+        summary.insert(counterName((MetricCounter)i),
+                       (qint64)value((MetricCounter)i));
+    summary.insert("fifo_high_water_samples",
+                   (qint64)fifoHighWater.load(std::memory_order_relaxed));
+    summary.insert("memory_used_bytes", (qint64)MemoryAccount::used());
+    summary.insert("memory_peak_bytes", (qint64)MemoryAccount::peak());
+    summary.insert("realtime_factor", realtimeFactor());
+
+    for (int i = 0; i < METRICS_LATENCY_BUCKETS; i++) {
+        QJsonObject bucket;
+
+        bucket.insert("le_us", i < METRICS_LATENCY_BUCKETS - 1 ?
+                               QJsonValue((qint64)latencyBounds[i]) :
+                               QJsonValue(QString("+Inf")));
+        bucket.insert("frames",
+                      (qint64)latencyBuckets[i].load(std::memory_order_relaxed));
+        buckets.append(bucket);
+    }
+    summary.insert("encode_latency", buckets);
+    summary.insert("encode_latency_sum_us",
+                   (qint64)(latencySum.load(std::memory_order_relaxed) / 1000));
+    return summary;
+}
+
+const char *TranscodeMetrics::counterName(MetricCounter counter)
+{
+    switch (counter) {
+    case MetricCounter::PacketsRead:
+        return "packets_read";
+    case MetricCounter::FramesDecoded:
+        return "frames_decoded";
+    case MetricCounter::SamplesDecoded:
+        return "samples_decoded";
+    case MetricCounter::MediaMicroseconds:
+        return "media_microseconds";
+    case MetricCounter::SamplesConverted:
+        return "samples_converted";
+    case MetricCounter::FramesEncoded:
+        return "frames_encoded";
+    case MetricCounter::PacketsWritten:
+        return "packets_written";
+    case MetricCounter::BytesWritten:
+        return "bytes_written";
+    case MetricCounter::JobsSucceeded:
+        return "jobs_succeeded";
+    case MetricCounter::JobsFailed:
+        return "jobs_failed";
+    case MetricCounter::JobMicroseconds:
+        return "job_microseconds";
+    case MetricCounter::CacheHits:
+        return "cache_hits";
+    case MetricCounter::CacheMisses:
+        return "cache_misses";
+    default:
+        return "unknown";
+    }
+}
@@ -0,0 +1,81 @@
+#ifndef TRANSCODEMETRICS_H
+#define TRANSCODEMETRICS_H
+
+#include <QByteArray>
+#include <QJsonObject>
+
+#include <atomic>
+#include <cstdint>
+
+/* The number of buckets of the encode latency histogram, +Inf included */
+#define METRICS_LATENCY_BUCKETS 11
+
+/* Counters kept by TranscodeMetrics. */
+enum class MetricCounter
+{
+    /* Packets read from the inputs, of all streams. */
+    PacketsRead,
+    FramesDecoded,
+    SamplesDecoded,
+    /* Duration of the decoded or remuxed audio in us. */
+    MediaMicroseconds,
+    /* Samples put out by the resampler or the downmix. */
+    SamplesConverted,
+    FramesEncoded,
+    PacketsWritten,
+    /* Size of the finished output files, container included. */
+    BytesWritten,
+    JobsSucceeded,
+    JobsFailed,
+    /* Wall clock time of the finished jobs in us. */
+    JobMicroseconds,
+    /* Runs whose outputs were all taken from the result cache, and runs
+     * looked up there in vain. */
+    CacheHits,
+    CacheMisses,
+    Count
+};
+
+/**
+ * Counters of one or several transcoding runs, to be scraped while they
+ * run or summarized once they are done.
+ * Like TranscodeStats, every update is a relaxed atomic operation, so
+ * that all threads of all jobs may share one instance.
+ */
+class TranscodeMetrics
+{
+    public:
+        TranscodeMetrics();
+
+        void add(MetricCounter counter, int64_t value = 1)
+        {
+            counters[(int)counter].fetch_add(value, std::memory_order_relaxed);
+        }
+
+        void raiseFifoDepth(int64_t samples);
+
+        void observeEncodeLatency(int64_t nanoseconds);
+
+        int64_t value(MetricCounter counter) const;
+
+        double realtimeFactor() const;
+
+        QByteArray prometheus() const;
+
+        QJsonObject json() const;
+
+        static const char *counterName(MetricCounter counter);
+
+    private:
+        TranscodeMetrics(const TranscodeMetrics &) = delete;
+        TranscodeMetrics &operator=(const TranscodeMetrics &) = delete;
+
+        std::atomic<int64_t> counters[(int)MetricCounter::Count];
+        /* Most samples any FIFO buffer has held at once. */
+        std::atomic<int64_t> fifoHighWater;
+        /* Encoded frames per latency bucket, not cumulated. */
+        std::atomic<int64_t> latencyBuckets[METRICS_LATENCY_BUCKETS];
+        std::atomic<int64_t> latencySum;
+};
+
+#endif
@@ -29,94 +29,251 @@
  */
 
 #include "transcoder.h"
-#include "QDebug"
+#include "mappedinput.h"
 
-/* Global timestamp for the audio frames. */
-static int64_t pts = 0;
+#include <QFile>
 
-Transcoder::Transcoder(const char *input, const char *output)
+Transcoder::Transcoder(const char *input, const char *output,
+                       const TranscoderOptions &options)
+    : options(options), cancelled(false)
 {
     inputFile = input;
-    outputFile = output;
+    if (output) {
+        OutputSpec spec;
+        spec.path       = QString::fromLocal8Bit(output);
+        spec.sampleRate = options.sampleRate;
+        outputs.append(spec);
+    }
+    pts = 0;
+    segment = nullptr;
+    owner = nullptr;
+    nextProgress = 0;
+    inputStreamIndex = 0;
+    copyOutput = nullptr;
+    fifoBytes = 0;
+    remuxing = false;
+    nextCheckpoint = -1;
+    nextFragment = options.fragmentDuration;
+    resumePosition = 0;
+    fromCache = false;
+}
+
+Transcoder::Transcoder(const char *input, const QList<OutputSpec> &outputs,
+                       const TranscoderOptions &options)
+    : options(options), outputs(outputs), cancelled(false)
+{
+    inputFile = input;
+    /* The sample rate of the options applies to every rendition
+     * without one of its own. */
+    for (OutputSpec &spec : this->outputs)
+        if (spec.sampleRate <= 0)
+            spec.sampleRate = options.sampleRate;
+    pts = 0;
+    segment = nullptr;
+    owner = nullptr;
+    nextProgress = 0;
+    inputStreamIndex = 0;
+    copyOutput = nullptr;
+    fifoBytes = 0;
+    remuxing = false;
+    nextCheckpoint = -1;
+    nextFragment = options.fragmentDuration;
+    resumePosition = 0;
+    fromCache = false;
+}
 
-    int ret = processInput();
-    if (ret == 0) {
-        qDebug() << "File has been created successfully -> " << output;
-        exit(0);
+Transcoder::~Transcoder()
+{
+    close();
+}
+
+/**
+ * Check whether the demuxer found all parameters needed for decoding in
+ * the header already, so that no packets have to be probed.
+ * @param inputFormatContext Format context of the opened input
+ * @return true if every stream is described completely
+ */
+static bool streamInfoComplete(const AVFormatContext *inputFormatContext)
+{
+    if (inputFormatContext->nb_streams == 0)
+        return false;
+    for (unsigned int i = 0; i < inputFormatContext->nb_streams; i++) {
+        const AVCodecParameters *parameters = inputFormatContext->streams[i]->codecpar;
+
+        if (parameters->codec_id == AV_CODEC_ID_NONE ||
+            parameters->sample_rate <= 0 || parameters->channels <= 0)
+            return false;
     }
+    return true;
 }
 
 /**
- * Open an input file and the required decoder.
+ * Open an input file and its container format and read its stream
+ * parameters, without opening any decoder.
  * @param      filename             File to be opened
+ * @param      stream               Stream read instead of the file, or nullptr
+ * @param      options              Probing settings of the run
  * @param[out] inputFormatContext Format context of opened file
- * @param[out] inputCodecContext  Codec context of opened file
  * @return Error code (0 if successful)
  */
-int Transcoder::openInputFile(const char *filename,
-                           AVFormatContext **inputFormatContext,
-                           AVCodecContext **inputCodecContext)
+int Transcoder::openInputContainer(const char *filename,
+                                   const StreamCallbacks *stream,
+                                   const TranscoderOptions &options,
+                                   AVFormatContext **inputFormatContext)
 {
-    AVCodecContext *codecContext;
-    AVCodec *inputCodec;
+    const QByteArray formatName = options.inputFormat.toLatin1();
+    AVInputFormat *inputFormat = nullptr;
+    AVIOContext *inputIOContext = nullptr;
     int error;
 
-    /* Open the input file to read from it. */
-    if ((error = avformat_open_input(inputFormatContext, filename, nullptr,
+    if (!formatName.isEmpty() &&
+        !(inputFormat = av_find_input_format(formatName.constData()))) {
+        fprintf(stderr, "Unknown input format '%s'\n", formatName.constData());
+        return AVERROR(EINVAL);
+    }
+
+    if (!(*inputFormatContext = avformat_alloc_context())) {
+        fprintf(stderr, "Could not allocate input format context\n");
+        return AVERROR(ENOMEM);
+    }
+    /* Inputs known to be well-formed are probed as little as possible. */
+    if (options.trustedInput) {
+        (*inputFormatContext)->probesize            = INPUT_TRUSTED_PROBE_SIZE;
+        (*inputFormatContext)->max_analyze_duration = INPUT_TRUSTED_ANALYZE_DURATION;
+    }
+
+    /* Read from the caller's stream instead of the file if one is given. */
+    if (stream) {
+        if ((error = StreamIO::open(stream, false, &inputIOContext)) < 0) {
+            avformat_free_context(*inputFormatContext);
+            *inputFormatContext = nullptr;
+            return error;
+        }
+        (*inputFormatContext)->pb     = inputIOContext;
+        (*inputFormatContext)->flags |= AVFMT_FLAG_CUSTOM_IO;
+    }
+
+    /* Open the input file to read from it. With a stream the name only
+     * serves as a hint for probing. */
+    if ((error = avformat_open_input(inputFormatContext, filename, inputFormat,
                                      nullptr)) < 0) {
         fprintf(stderr, "Could not open input file '%s' (error '%d')\n",
                 filename, error);
+        /* The format context has been freed, but the stream's is ours. */
+        StreamIO::close(&inputIOContext);
         *inputFormatContext = nullptr;
         return error;
     }
 
-    /* Get information on the input file (number of streams etc.). */
-    if ((error = avformat_find_stream_info(*inputFormatContext, nullptr)) < 0) {
+    /* Get information on the input file (number of streams etc.). A
+     * trusted input whose header describes it completely needs none. */
+    if (!(options.trustedInput && streamInfoComplete(*inputFormatContext)) &&
+        (error = avformat_find_stream_info(*inputFormatContext, nullptr)) < 0) {
         fprintf(stderr, "Could not open find stream info (error '%d')\n",
                 error);
-        avformat_close_input(inputFormatContext);
+        closeInputFile(inputFormatContext);
         return error;
     }
+    return 0;
+}
 
-    /* Make sure that there is only one stream in the input file. */
-    if ((*inputFormatContext)->nb_streams != 1) {
-        fprintf(stderr, "Expected one audio input stream, but found %d\n",
-                (*inputFormatContext)->nb_streams);
-        avformat_close_input(inputFormatContext);
-        return AVERROR_EXIT;
-    }
+/**
+ * Open an input file and the required decoder.
+ * @param      filename             File to be opened
+ * @param      stream               Stream read instead of the file, or nullptr
+ * @param      options              Probing settings, audio stream, codec
+ *                                  options and codec cache of the run
+ * @param[out] inputFormatContext Format context of opened file
+ * @param[out] inputCodecContext  Codec context of opened file
+ * @param[out] streamIndex        Index of the audio stream to be decoded
+ * @return Error code (0 if successful)
+ */
+int Transcoder::openInputFile(const char *filename,
+                           const StreamCallbacks *stream,
+                           const TranscoderOptions &options,
+                           AVFormatContext **inputFormatContext,
+                           AVCodecContext **inputCodecContext,
+                           int *streamIndex)
+{
+    const AVCodecParameters *parameters;
+    AVCodecContext *codecContext;
+    AVCodec *inputCodec = nullptr;
+    AVDictionary *decoderOptions = nullptr;
+    CodecKey key;
+    int index, error;
 
-    /* Find a decoder for the audio stream. */
-    if (!(inputCodec = avcodec_find_decoder((*inputFormatContext)->streams[0]->codecpar->codec_id))) {
-        fprintf(stderr, "Could not find input codec\n");
-        avformat_close_input(inputFormatContext);
-        return AVERROR_EXIT;
+    if ((error = openInputContainer(filename, stream, options,
+                                    inputFormatContext)) < 0)
+        return error;
+
+    /* Pick the audio stream to be transcoded and its decoder: the one
+     * chosen by the caller, or the best one of the input. */
+    if ((index = av_find_best_stream(*inputFormatContext, AVMEDIA_TYPE_AUDIO,
+                                     options.audioStream, -1,
+                                     &inputCodec, 0)) < 0) {
+        if (index == AVERROR_DECODER_NOT_FOUND)
+            fprintf(stderr, "Could not find input codec\n");
+        else
+            fprintf(stderr, "Could not find audio input stream (error '%d')\n",
+                    index);
+        closeInputFile(inputFormatContext);
+        return index;
+    }
+    parameters = (*inputFormatContext)->streams[index]->codecpar;
+
+    /* The demuxer may skip the other streams unless they are copied. */
+    for (unsigned int i = 0; i < (*inputFormatContext)->nb_streams; i++)
+        if ((int)i != index && !options.copyStreams)
+            (*inputFormatContext)->streams[i]->discard = AVDISCARD_ALL;
+    *streamIndex = index;
+
+    /* Reuse the decoder of an earlier input with the same parameters
+     * and options. */
+    key = CodecKey::decoder(inputCodec, parameters);
+    if ((error = codecOptions(inputCodec, options.decoderOptions, options,
+                              &decoderOptions, &key)) < 0) {
+        av_dict_free(&decoderOptions);
+        closeInputFile(inputFormatContext);
+        return error;
+    }
+    if (options.codecCache &&
+        (*inputCodecContext = options.codecCache->take(key))) {
+        av_dict_free(&decoderOptions);
+        return 0;
     }
 
     /* Allocate a new decoding context. */
     codecContext = avcodec_alloc_context3(inputCodec);
     if (!codecContext) {
         fprintf(stderr, "Could not allocate a decoding context\n");
-        avformat_close_input(inputFormatContext);
+        av_dict_free(&decoderOptions);
+        closeInputFile(inputFormatContext);
         return AVERROR(ENOMEM);
     }
 
     /* Initialize the stream parameters with demuxer information. */
-    error = avcodec_parameters_to_context(codecContext, (*inputFormatContext)->streams[0]->codecpar);
+    error = avcodec_parameters_to_context(codecContext, parameters);
     if (error < 0) {
-        avformat_close_input(inputFormatContext);
+        av_dict_free(&decoderOptions);
+        closeInputFile(inputFormatContext);
         avcodec_free_context(&codecContext);
         return error;
     }
 
     /* Open the decoder for the audio stream to use it later. */
-    if ((error = avcodec_open2(codecContext, inputCodec, nullptr)) < 0) {
+    if ((error = avcodec_open2(codecContext, inputCodec, &decoderOptions)) < 0) {
         fprintf(stderr, "Could not open input codec (error '%d')\n",
                 error);
+        av_dict_free(&decoderOptions);
         avcodec_free_context(&codecContext);
-        avformat_close_input(inputFormatContext);
+        closeInputFile(inputFormatContext);
         return error;
     }
+    reportUnusedOptions(inputCodec, decoderOptions);
+    av_dict_free(&decoderOptions);
+
+    if (options.codecCache)
+        options.codecCache->adopt(key, codecContext);
 
     /* Save the decoder context for easier access later. */
     *inputCodecContext = codecContext;
@@ -125,29 +282,225 @@ int Transcoder::openInputFile(const char *filename,
 }
 
 /**
- * Open an output file and the required encoder.
+ * Close an input file opened by openInputFile.
+ * A caller's stream is left open, only its I/O context is freed.
+ * @param inputFormatContext Format context of the input file
+ */
+void Transcoder::closeInputFile(AVFormatContext **inputFormatContext)
+{
+    InputFormatDeleter()(*inputFormatContext);
+    *inputFormatContext = nullptr;
+}
+
+/**
+ * Choose where the input is read from: the caller's stream if one is
+ * given, otherwise a memory mapping of the input file if it can be mapped.
+ * @param mapping Mapping of the input file; must outlive the input
+ * @return Stream to be passed to openInputFile, or nullptr to let
+ *         libavformat read the file
+ */
+const StreamCallbacks *Transcoder::inputSource(MappedInput *mapping) const
+{
+    if (options.inputStream)
+        return options.inputStream;
+    if (options.mapInput && mapping->open(inputFile))
+        return mapping->callbacks();
+    return nullptr;
+}
+
+/**
+ * Open the encoder for the output audio stream.
  * Also set some basic encoder parameters.
- * Some of these parameters are based on the input file's parameters.
- * @param      filename              File to be opened
- * @param      inputCodecContext   Codec context of input file
+ * @param      spec                Encoder, bit rate and channels to be used
+ * @param      sampleRate          Sample rate of the output in Hz
+ * @param      globalHeader        Whether the container requires global
+ *                                 headers
+ * @param      options             Encoder selection, codec options and
+ *                                 codec cache to be used
+ * @param[out] outputCodecContext  Codec context of the encoder
+ * @return Error code (0 if successful)
+ */
+int Transcoder::openEncoder(const OutputSpec &spec,
+                            int sampleRate, bool globalHeader,
+                            const TranscoderOptions &options,
+                            AVCodecContext **outputCodecContext)
+{
+    const QByteArray codecName = spec.codec.toLatin1();
+    CodecContextCache *cache   = options.codecCache;
+    AVCodecContext *avctx      = nullptr;
+    AVCodec *outputCodec       = nullptr;
+    AVDictionary *dictionary   = nullptr;
+    CodecKey key;
+    int error;
+
+    /* Find the encoder to be used, the fastest one of the codec if
+     * encoders are selected, or else by its name. */
+    if (options.encoders) {
+        if (!(outputCodec = options.encoders->select(codecName, sampleRate,
+                                                     spec.channels)) ||
+            outputCodec->type != AVMEDIA_TYPE_AUDIO) {
+            fprintf(stderr, "Could not find audio encoder '%s'\n",
+                    codecName.isEmpty() ? "aac" : codecName.constData());
+            return AVERROR_EXIT;
+        }
+    } else if (codecName.isEmpty()) {
+        if (!(outputCodec = avcodec_find_encoder(AV_CODEC_ID_AAC))) {
+            fprintf(stderr, "Could not find an AAC encoder.\n");
+            return AVERROR_EXIT;
+        }
+    } else if (!(outputCodec = avcodec_find_encoder_by_name(codecName.constData())) ||
+               outputCodec->type != AVMEDIA_TYPE_AUDIO) {
+        fprintf(stderr, "Could not find audio encoder '%s'\n",
+                codecName.constData());
+        return AVERROR_EXIT;
+    }
+    if (spec.channels <= 0) {
+        fprintf(stderr, "Invalid number of output channels %d\n", spec.channels);
+        return AVERROR(EINVAL);
+    }
+    /* The first sample format the encoder lists is the one it is fed. */
+    if (!outputCodec->sample_fmts ||
+        outputCodec->sample_fmts[0] == AV_SAMPLE_FMT_NONE) {
+        fprintf(stderr, "Encoder '%s' does not list its sample formats\n",
+                outputCodec->name);
+        return AVERROR(EINVAL);
+    }
+
+    /* Refuse sample rates the encoder cannot handle up front. */
+    if (outputCodec->supported_samplerates) {
+        const int *rate = outputCodec->supported_samplerates;
+
+        while (*rate && *rate != sampleRate)
+            rate++;
+        if (!*rate) {
+            fprintf(stderr, "Sample rate %d Hz is not supported by the encoder\n",
+                    sampleRate);
+            return AVERROR(EINVAL);
+        }
+    }
+
+    /* Reuse the encoder of an earlier output with the same settings
+     * and options. */
+    key.codec         = outputCodec;
+    key.format        = outputCodec->sample_fmts[0];
+    key.sampleRate    = sampleRate;
+    key.channels      = spec.channels;
+    key.channelLayout = av_get_default_channel_layout(spec.channels);
+    key.bitRate       = spec.bitRate;
+    key.flags         = globalHeader ? AV_CODEC_FLAG_GLOBAL_HEADER : 0;
+    if ((error = codecOptions(outputCodec, options.encoderOptions, options,
+                              &dictionary, &key)) < 0) {
+        av_dict_free(&dictionary);
+        return error;
+    }
+    if (cache && (*outputCodecContext = cache->take(key))) {
+        av_dict_free(&dictionary);
+        return 0;
+    }
+
+    avctx = avcodec_alloc_context3(outputCodec);
+    if (!avctx) {
+        fprintf(stderr, "Could not allocate an encoding context\n");
+        av_dict_free(&dictionary);
+        return AVERROR(ENOMEM);
+    }
+
+    /* Set the basic encoder parameters. */
+    avctx->channels       = spec.channels;
+    avctx->channel_layout = av_get_default_channel_layout(spec.channels);
+    avctx->sample_rate    = sampleRate;
+    avctx->sample_fmt     = outputCodec->sample_fmts[0];
+    avctx->bit_rate       = spec.bitRate;
+
+    /* Allow the use of the experimental AAC encoder. */
+    avctx->strict_std_compliance = FF_COMPLIANCE_EXPERIMENTAL;
+
+    /* Some container formats (like MP4) require global headers to be present.
+     * Mark the encoder so that it behaves accordingly. */
+    if (globalHeader)
+        avctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+
+    /* Open the encoder for the audio stream to use it later. */
+    if ((error = avcodec_open2(avctx, outputCodec, &dictionary)) < 0) {
+        fprintf(stderr, "Could not open output codec (error '%d')\n",
+                error);
+        av_dict_free(&dictionary);
+        avcodec_free_context(&avctx);
+        return error;
+    }
+    reportUnusedOptions(outputCodec, dictionary);
+    av_dict_free(&dictionary);
+
+    /* Encoders without a fixed frame size (like PCM) get frames of a
+     * reasonable size from the FIFO buffer all the same. */
+    if (avctx->frame_size <= 0)
+        avctx->frame_size = ENCODER_DEFAULT_FRAME_SIZE;
+
+    if (cache)
+        cache->adopt(key, avctx);
+    *outputCodecContext = avctx;
+    return 0;
+}
+
+/**
+ * Open an output file and its container format, without any streams.
+ * @param      spec                Output file and container format
  * @param[out] outputFormatContext Format context of output file
- * @param[out] outputCodecContext  Codec context of output file
+ * @param      appendAt            Size of an existing output file to be
+ *                                 continued, or -1 to start a new file
  * @return Error code (0 if successful)
  */
-int Transcoder::openOutputFile(const char *filename,
-                            AVCodecContext *inputCodecContext,
-                            AVFormatContext **ouputFormatContext,
-                            AVCodecContext **ouputCodecContext)
+int Transcoder::openOutputContainer(const OutputSpec &spec,
+                                    AVFormatContext **ouputFormatContext,
+                                    int64_t appendAt)
 {
-    AVCodecContext *avctx       = nullptr;
+    const QByteArray path       = spec.path.toLocal8Bit();
+    const QByteArray format     = spec.format.toLatin1();
+    const char *filename        = path.constData();
     AVIOContext *ouputIOContext = nullptr;
-    AVStream *stream            = nullptr;
-    AVCodec *outputCodec        = nullptr;
+    AVDictionary *ioOptions     = nullptr;
+    AVOutputFormat *outputFormat;
     int error;
 
-    /* Open the output file to write to it. */
-    if ((error = avio_open(&ouputIOContext, filename,
-                           AVIO_FLAG_WRITE)) < 0) {
+    /* Guess the desired container format based on its name or the file
+     * extension. */
+    if (!(outputFormat = av_guess_format(format.isEmpty() ? nullptr : format.constData(),
+                                         filename, nullptr))) {
+        fprintf(stderr, "Could not find output file format\n");
+        return AVERROR_EXIT;
+    }
+    /* Muxers like HLS open the files they write themselves. */
+    if ((outputFormat->flags & AVFMT_NOFILE) && spec.stream) {
+        fprintf(stderr, "Format '%s' writes files of its own, not a stream\n",
+                outputFormat->name);
+        return AVERROR(EINVAL);
+    }
+
+    /* Open the output file to write to it, or the caller's stream.
+     * Use large blocks so that the muxer's output reaches the file in few
+     * big writes instead of one small write per packet. */
+    if (outputFormat->flags & AVFMT_NOFILE) {
+        error = 0;
+    } else if (spec.stream) {
+        error = StreamIO::open(spec.stream, true, &ouputIOContext);
+    } else {
+        av_dict_set_int(&ioOptions, "blocksize", OUTPUT_IO_BLOCK_SIZE, 0);
+        /* A resumed run keeps what the file holds up to its checkpoint. */
+        if (appendAt >= 0)
+            av_dict_set_int(&ioOptions, "truncate", 0, 0);
+        error = avio_open2(&ouputIOContext, filename, AVIO_FLAG_WRITE, nullptr,
+                           &ioOptions);
+        av_dict_free(&ioOptions);
+        if (error >= 0 && appendAt > 0) {
+            const int64_t position = avio_seek(ouputIOContext, appendAt, SEEK_SET);
+
+            if (position < 0) {
+                error = (int)position;
+                avio_closep(&ouputIOContext);
+            }
+        }
+    }
+    if (error < 0) {
         fprintf(stderr, "Could not open output file '%s' (error '%d')\n",
                 filename, error);
         return error;
@@ -156,30 +509,53 @@ int Transcoder::openOutputFile(const char *filename,
     /* Create a new format context for the output container format. */
     if (!(*ouputFormatContext = avformat_alloc_context())) {
         fprintf(stderr, "Could not allocate output format context\n");
+        if (spec.stream)
+            StreamIO::close(&ouputIOContext);
+        else
+            avio_closep(&ouputIOContext);
         return AVERROR(ENOMEM);
     }
 
     /* Associate the output file (pointer) with the container format context. */
     (*ouputFormatContext)->pb = ouputIOContext;
+    if (spec.stream)
+        (*ouputFormatContext)->flags |= AVFMT_FLAG_CUSTOM_IO;
 
-    /* Guess the desired container format based on the file extension. */
-    if (!((*ouputFormatContext)->oformat = av_guess_format(nullptr, filename,
-                                                              nullptr))) {
-        fprintf(stderr, "Could not find output file format\n");
-        goto cleanup;
-    }
+    (*ouputFormatContext)->oformat = outputFormat;
 
     if (!((*ouputFormatContext)->url = av_strdup(filename))) {
         fprintf(stderr, "Could not allocate url.\n");
-        error = AVERROR(ENOMEM);
-        goto cleanup;
+        closeOutputFile(ouputFormatContext);
+        return AVERROR(ENOMEM);
     }
+    return 0;
+}
 
-    /* Find the encoder to be used by its name. */
-    if (!(outputCodec = avcodec_find_encoder(AV_CODEC_ID_AAC))) {
-        fprintf(stderr, "Could not find an AAC encoder.\n");
-        goto cleanup;
-    }
+/**
+ * Open an output file and the required encoder.
+ * @param      spec                Output file and encoder settings
+ * @param      sampleRate          Sample rate of the output in Hz
+ * @param      options             Encoder selection and codec cache to be
+ *                                 used
+ * @param[out] outputFormatContext Format context of output file
+ * @param[out] outputCodecContext  Codec context of output file
+ * @param      appendAt            Size of an existing output file to be
+ *                                 continued, or -1 to start a new file
+ * @return Error code (0 if successful)
+ */
+int Transcoder::openOutputFile(const OutputSpec &spec,
+                            int sampleRate,
+                            const TranscoderOptions &options,
+                            AVFormatContext **ouputFormatContext,
+                            AVCodecContext **ouputCodecContext,
+                            int64_t appendAt)
+{
+    AVCodecContext *avctx = nullptr;
+    AVStream *stream      = nullptr;
+    int error;
+
+    if ((error = openOutputContainer(spec, ouputFormatContext, appendAt)) < 0)
+        return error;
 
     /* Create a new audio stream in the output file container. */
     if (!(stream = avformat_new_stream(*ouputFormatContext, nullptr))) {
@@ -188,40 +564,15 @@ int Transcoder::openOutputFile(const char *filename,
         goto cleanup;
     }
 
-    avctx = avcodec_alloc_context3(outputCodec);
-    if (!avctx) {
-        fprintf(stderr, "Could not allocate an encoding context\n");
-        error = AVERROR(ENOMEM);
+    if ((error = openEncoder(spec, sampleRate,
+                             (*ouputFormatContext)->oformat->flags & AVFMT_GLOBALHEADER,
+                             options, &avctx)) < 0)
         goto cleanup;
-    }
-
-    /* Set the basic encoder parameters.
-     * The input file's sample rate is used to avoid a sample rate conversion. */
-    avctx->channels       = OUTPUT_CHANNELS;
-    avctx->channel_layout = av_get_default_channel_layout(OUTPUT_CHANNELS);
-    avctx->sample_rate    = inputCodecContext->sample_rate;
-    avctx->sample_fmt     = outputCodec->sample_fmts[0];
-    avctx->bit_rate       = OUTPUT_BIT_RATE;
-
-    /* Allow the use of the experimental AAC encoder. */
-    avctx->strict_std_compliance = FF_COMPLIANCE_EXPERIMENTAL;
 
     /* Set the sample rate for the container. */
-    stream->time_base.den = inputCodecContext->sample_rate;
+    stream->time_base.den = sampleRate;
     stream->time_base.num = 1;
 
-    /* Some container formats (like MP4) require global headers to be present.
-     * Mark the encoder so that it behaves accordingly. */
-    if ((*ouputFormatContext)->oformat->flags & AVFMT_GLOBALHEADER)
-        avctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
-
-    /* Open the encoder for the audio stream to use it later. */
-    if ((error = avcodec_open2(avctx, outputCodec, nullptr)) < 0) {
-        fprintf(stderr, "Could not open output codec (error '%d')\n",
-                error);
-        goto cleanup;
-    }
-
     error = avcodec_parameters_from_context(stream->codecpar, avctx);
     if (error < 0) {
         fprintf(stderr, "Could not initialize stream parameters\n");
@@ -234,68 +585,99 @@ int Transcoder::openOutputFile(const char *filename,
     return 0;
 
     cleanup:
-        avcodec_free_context(&avctx);
-        avio_closep(&(*ouputFormatContext)->pb);
-        avformat_free_context(*ouputFormatContext);
-        *ouputFormatContext = nullptr;
+        closeCodec(options.codecCache, &avctx);
+        closeOutputFile(ouputFormatContext);
         return error < 0 ? error : AVERROR_EXIT;
 }
 
 /**
- * Initialize one data packet for reading or writing.
- * @param[out] packet Packet to be initialized
- * @return Error code (0 if successful)
+ * Close an output file opened by openOutputFile.
+ * A caller's stream is left open, only its I/O context is freed.
+ * @param outputFormatContext Format context of the output file
  */
-int Transcoder::initPacket(AVPacket **packet)
+void Transcoder::closeOutputFile(AVFormatContext **outputFormatContext)
 {
-    if (!(*packet = av_packet_alloc())) {
-        fprintf(stderr, "Could not allocate packet\n");
-        return AVERROR(ENOMEM);
-    }
-    return 0;
+    OutputFormatDeleter()(*outputFormatContext);
+    *outputFormatContext = nullptr;
 }
 
 /**
- * Initialize one audio frame for reading from the input file.
- * @param[out] frame Frame to be initialized
- * @return Error code (0 if successful)
+ * Close a decoder or encoder, keeping it for later use if it is cached.
+ * @param cache   Cache the context may have been taken from, or nullptr
+ * @param context Context to be closed; set to nullptr
  */
-int Transcoder::initInputFrame(AVFrame **frame)
+void Transcoder::closeCodec(CodecContextCache *cache, AVCodecContext **context)
 {
-    if (!(*frame = av_frame_alloc())) {
-        fprintf(stderr, "Could not allocate input frame\n");
-        return AVERROR(ENOMEM);
-    }
-    return 0;
+    const CodecContextDeleter close(cache);
+
+    close(*context);
+    *context = nullptr;
+}
+
+/**
+ * Check whether the decoder already delivers the encoder's sample format,
+ * channel count and sample rate, so that the samples need no conversion.
+ * @param inputCodecContext  Codec context of the input file
+ * @param outputCodecContext Codec context of the output file
+ * @return true if the samples can be passed through unchanged
+ */
+bool Transcoder::formatsMatch(AVCodecContext *inputCodecContext,
+                              AVCodecContext *outputCodecContext)
+{
+    /* The resampler assumes default channel layouts, so the channel
+     * count is all that has to match. */
+    return inputCodecContext->sample_fmt  == outputCodecContext->sample_fmt &&
+           inputCodecContext->channels    == outputCodecContext->channels &&
+           inputCodecContext->sample_rate == outputCodecContext->sample_rate;
+}
+
+/**
+ * Sample rate an output file is encoded with.
+ * @param spec              Settings of the output file
+ * @param inputCodecContext Codec context of the input file
+ * @return Sample rate in Hz
+ */
+int Transcoder::outputSampleRate(const OutputSpec &spec,
+                                 AVCodecContext *inputCodecContext)
+{
+    return spec.sampleRate > 0 ? spec.sampleRate :
+                                 inputCodecContext->sample_rate;
 }
 
 /**
  * Initialize the audio resampler based on the input and output codec settings.
- * If the input and output sample formats differ, a conversion is required
- * libswresample takes care of this, but requires initialization.
+ * If the input and output sample formats or rates differ, a conversion is
+ * required libswresample takes care of this, but requires initialization.
  * @param      inputCodecContext  Codec context of the input file
  * @param      outputCodecContext Codec context of the output file
+ * @param      quality            Filter used for a sample rate conversion
+ * @param      mode               Matrix used for a stereo downmix
  * @param[out] resampleContext    Resample context for the required conversion
  * @return Error code (0 if successful)
  */
 int Transcoder::initResampler(AVCodecContext *inputCodecContext,
                           AVCodecContext *outputCodecContext,
+                          ResamplerQuality quality,
+                          DownmixMode mode,
                           SwrContext **resampleContext)
 {
+    const uint64_t inputLayout = Downmix::inputLayout(inputCodecContext);
+    double matrix[DOWNMIX_OUTPUTS][DOWNMIX_MAX_INPUTS];
     int error;
 
     /*
      * Create a resampler context for the conversion.
      * Set the conversion parameters.
-     * Default channel layouts based on the number of channels
-     * are assumed for simplicity (they are sometimes not detected
-     * properly by the demuxer and/or decoder).
+     * The input's channel layout is used if it matches its channel
+     * count; default channel layouts based on the number of channels
+     * are assumed otherwise (they are sometimes not detected properly
+     * by the demuxer and/or decoder).
      */
     *resampleContext = swr_alloc_set_opts(nullptr,
                                           av_get_default_channel_layout(outputCodecContext->channels),
                                           outputCodecContext->sample_fmt,
                                           outputCodecContext->sample_rate,
-                                          av_get_default_channel_layout(inputCodecContext->channels),
+                                          inputLayout,
                                           inputCodecContext->sample_fmt,
                                           inputCodecContext->sample_rate,
                                           0, nullptr);
@@ -303,15 +685,40 @@ int Transcoder::initResampler(AVCodecContext *inputCodecContext,
         fprintf(stderr, "Could not allocate resample context\n");
         return AVERROR(ENOMEM);
     }
-    /*
-    * Perform a sanity check so that the number of converted samples is
-    * not greater than the number of samples to be converted.
-    * If the sample rates differ, this case has to be handled differently
-    */
-    av_assert0(outputCodecContext->sample_rate == inputCodecContext->sample_rate);
-
-    /* Open the resampler with the specified parameters. */
-    if ((error = swr_init(*resampleContext)) < 0) {
+
+    /* Select the filter used if the sample rates differ. */
+    if (quality == ResamplerQuality::Fast) {
+        av_opt_set_int(*resampleContext, "filter_size", 4, 0);
+        av_opt_set_int(*resampleContext, "phase_shift", 6, 0);
+        av_opt_set_int(*resampleContext, "linear_interp", 1, 0);
+    } else if (quality == ResamplerQuality::High) {
+        av_opt_set_int(*resampleContext, "resampler", SWR_ENGINE_SOXR, 0);
+        av_opt_set_int(*resampleContext, "precision", 28, 0);
+    }
+
+    /* Fold the input into stereo with the requested matrix, the same
+     * one the float planar downmix kernels use. */
+    if (Downmix::coefficients(inputLayout, outputCodecContext->channels,
+                              mode, matrix) &&
+        (error = swr_set_matrix(*resampleContext, matrix[0],
+                                DOWNMIX_MAX_INPUTS)) < 0) {
+        fprintf(stderr, "Could not set downmix matrix (error '%d')\n", error);
+        swr_free(resampleContext);
+        return error;
+    }
+
+    /* Open the resampler with the specified parameters.
+     * libswresample may have been built without soxr; use a long filter
+     * of the built-in resampler instead then. */
+    error = swr_init(*resampleContext);
+    if (error < 0 && quality == ResamplerQuality::High) {
+        fprintf(stderr, "soxr resampler not available, using swr\n");
+        av_opt_set_int(*resampleContext, "resampler", SWR_ENGINE_SWR, 0);
+        av_opt_set_int(*resampleContext, "filter_size", 64, 0);
+        av_opt_set_int(*resampleContext, "phase_shift", 12, 0);
+        error = swr_init(*resampleContext);
+    }
+    if (error < 0) {
         fprintf(stderr, "Could not open resample context\n");
         swr_free(resampleContext);
         return error;
@@ -321,30 +728,121 @@ int Transcoder::initResampler(AVCodecContext *inputCodecContext,
 
 /**
  * Initialize a FIFO buffer for the audio samples to be encoded.
+ * The buffer is sized up front so that it usually never has to grow:
+ * it holds less than one encoder frame between two decoded frames.
  * @param[out] fifo                 Sample buffer
+ * @param      inputCodecContext    Codec context of the input file
  * @param      outputCodecContext   Codec context of the output file
  * @return Error code (0 if successful)
  */
-int Transcoder::initFifo(AVAudioFifo **fifo, AVCodecContext *outputCodecContext)
+int Transcoder::initFifo(AVAudioFifo **fifo, AVCodecContext *inputCodecContext,
+                         AVCodecContext *outputCodecContext)
 {
+    /* Many decoders only know their frame size after the first frame. */
+    const int inputFrameSize = inputCodecContext->frame_size > 0 ?
+                               inputCodecContext->frame_size :
+                               FIFO_DEFAULT_INPUT_FRAME_SIZE;
+    /* A decoded frame holds more or fewer samples after a sample rate
+     * conversion. */
+    const int convertedFrameSize = (int)av_rescale_rnd(inputFrameSize,
+                                                       outputCodecContext->sample_rate,
+                                                       inputCodecContext->sample_rate,
+                                                       AV_ROUND_UP);
+    const int capacity = 2 * (convertedFrameSize + outputCodecContext->frame_size);
+    int bytes;
+
     /* Create the FIFO buffer based on the specified output sample format. */
     if (!(*fifo = av_audio_fifo_alloc(outputCodecContext->sample_fmt,
-                                      outputCodecContext->channels, 1))) {
+                                      outputCodecContext->channels, capacity))) {
         fprintf(stderr, "Could not allocate FIFO\n");
         return AVERROR(ENOMEM);
     }
+    bytes = av_samples_get_buffer_size(nullptr, outputCodecContext->channels,
+                                       capacity, outputCodecContext->sample_fmt, 1);
+    MemoryAccount::charge(bytes);
+    fifoBytes += bytes;
     return 0;
 }
 
+/**
+ * Most samples a FIFO buffer should hold under the memory budget.
+ * Never less than two encoder frames, so that re-chunking still works.
+ * @param outputCodecContext Codec context of the output file
+ * @return Number of samples, or 0 if there is no budget
+ */
+int Transcoder::fifoLimit(AVCodecContext *outputCodecContext) const
+{
+    const int sampleBytes = av_get_bytes_per_sample(outputCodecContext->sample_fmt) *
+                            outputCodecContext->channels;
+
+    if (options.memoryBudget <= 0 || sampleBytes <= 0)
+        return 0;
+    return (int)FFMIN(FFMAX(options.memoryBudget * MEMORY_BUDGET_FIFO_SHARE / 100 /
+                            sampleBytes,
+                            (int64_t)2 * outputCodecContext->frame_size),
+                      (int64_t)INT_MAX / 2);
+}
+
+/**
+ * Number of frames each queue between two threads may hold.
+ * Under a memory budget, the queue depth of the options is reduced so
+ * that all frames in flight fit into the part of the budget the FIFO
+ * buffers leave.
+ * @param inputCodecContext Codec context of the input file
+ * @param buffers           Number of frames held per queue slot
+ * @return Queue depth, at least 2
+ */
+int Transcoder::framesInFlight(AVCodecContext *inputCodecContext, int buffers) const
+{
+    const int frameSize = inputCodecContext->frame_size > 0 ?
+                          inputCodecContext->frame_size :
+                          FIFO_DEFAULT_INPUT_FRAME_SIZE;
+    /* Converted frames may be float even if the decoded ones are not. */
+    const int64_t frameBytes = (int64_t)FFMAX(av_get_bytes_per_sample(inputCodecContext->sample_fmt),
+                                              (int)sizeof(float)) *
+                               inputCodecContext->channels * frameSize;
+    int64_t depth = FFMAX(options.queueDepth, 2);
+
+    if (options.memoryBudget > 0 && frameBytes > 0)
+        depth = FFMIN(depth, options.memoryBudget * (100 - MEMORY_BUDGET_FIFO_SHARE) / 100 /
+                             (frameBytes * FFMAX(buffers, 1)));
+    return (int)FFMAX(depth, (int64_t)2);
+}
+
 /**
  * Write the header of the output file container.
+ * A resumed output has its header already; the muxer's is discarded.
  * @param outputFormatContext Format context of the output file
  * @return Error code (0 if successful)
  */
 int Transcoder::writeOutputFileHeader(AVFormatContext *outputFormatContext)
 {
+    AVDictionary *muxerOptions = nullptr;
+    AVIOContext *outputIOContext = nullptr;
+    uint8_t *header;
     int error;
-    if ((error = avformat_write_header(outputFormatContext, nullptr)) < 0) {
+
+    fragmentOptions(outputFormatContext, &muxerOptions);
+
+    if (resumePosition > 0) {
+        outputIOContext = outputFormatContext->pb;
+        if ((error = avio_open_dyn_buf(&outputFormatContext->pb)) < 0) {
+            fprintf(stderr, "Could not allocate header buffer (error '%d')\n",
+                    error);
+            outputFormatContext->pb = outputIOContext;
+            av_dict_free(&muxerOptions);
+            return error;
+        }
+    }
+
+    error = avformat_write_header(outputFormatContext, &muxerOptions);
+    av_dict_free(&muxerOptions);
+    if (outputIOContext) {
+        avio_close_dyn_buf(outputFormatContext->pb, &header);
+        av_free(header);
+        outputFormatContext->pb = outputIOContext;
+    }
+    if (error < 0) {
         fprintf(stderr, "Could not write output file header (error '%d')\n",
                 error);
         return error;
@@ -354,6 +852,10 @@ int Transcoder::writeOutputFileHeader(AVFormatContext *outputFormatContext)
 
 /**
  * Decode one audio frame from the input file.
+ * A frame the decoder already holds is returned right away. Only if the
+ * decoder needs more data, the next packet is read and sent to it, so
+ * that decoders producing several frames per packet are drained
+ * completely before the input is read again.
  * @param      frame                Audio frame to be decoded
  * @param      inputFormatContext Format context of the input file
  * @param      inputCodecContext  Codec context of the input file
@@ -372,128 +874,159 @@ int Transcoder::decodeAudioFrame(AVFrame *frame,
 {
     /* Packet used for temporary storage. */
     AVPacket *inputPacket;
+    StageTimer timer(options.stats);
     int error;
 
-    error = initPacket(&inputPacket);
-    if (error < 0)
-        return error;
+    timer.start(TranscodeStage::Decode);
+    while (1) {
+        if (isCancelled()) {
+            fprintf(stderr, "Transcoding cancelled\n");
+            return AVERROR_EXIT;
+        }
 
-    /* Read one audio frame from the input file into a temporary packet. */
-    if ((error = av_read_frame(inputFormatContext, inputPacket)) < 0) {
-        /* If we are at the end of the file, flush the decoder below. */
-        if (error == AVERROR_EOF)
+        /* Receive one frame from the decoder. */
+        error = avcodec_receive_frame(inputCodecContext, frame);
+        if (error == 0) {
+            *dataPresent = 1;
+            if (options.metrics) {
+                options.metrics->add(MetricCounter::FramesDecoded);
+                options.metrics->add(MetricCounter::SamplesDecoded, frame->nb_samples);
+                if (inputCodecContext->sample_rate > 0)
+                    options.metrics->add(MetricCounter::MediaMicroseconds,
+                                         av_rescale(frame->nb_samples, AV_TIME_BASE,
+                                                    inputCodecContext->sample_rate));
+            }
+            return 0;
+        /* If the decoder has been flushed completely, stop decoding. */
+        } else if (error == AVERROR_EOF) {
             *finished = 1;
-        else {
-            fprintf(stderr, "Could not read frame (error '%d')\n",
+            return 0;
+        } else if (error != AVERROR(EAGAIN)) {
+            fprintf(stderr, "Could not decode frame (error '%d')\n",
                     error);
-            goto cleanup;
+            return error;
         }
-    }
 
-    /* Send the audio frame stored in the temporary packet to the decoder.
-     * The input audio stream decoder is used to do this. */
-    if ((error = avcodec_send_packet(inputCodecContext, inputPacket)) < 0) {
-        fprintf(stderr, "Could not send packet for decoding (error '%d')\n",
-                error);
-        goto cleanup;
-    }
-
-    /* Receive one frame from the decoder. */
-    error = avcodec_receive_frame(inputCodecContext, frame);
-    /* If the decoder asks for more data to be able to decode a frame,
-     * return indicating that no data is present. */
-    if (error == AVERROR(EAGAIN)) {
-        error = 0;
-        goto cleanup;
-    /* If the end of the input file is reached, stop decoding. */
-    } else if (error == AVERROR_EOF) {
-        *finished = 1;
-        error = 0;
-        goto cleanup;
-    } else if (error < 0) {
-        fprintf(stderr, "Could not decode frame (error '%d')\n",
-                error);
-        goto cleanup;
-    /* Default case: Return decoded data. */
-    } else {
-        *dataPresent = 1;
-        goto cleanup;
-    }
-
-cleanup:
-    av_packet_free(&inputPacket);
-    return error;
-}
+        /* The decoder asks for more data to be able to decode a frame. */
+        error = pool.inputPacket(&inputPacket);
+        if (error < 0)
+            return error;
 
-/**
- * Initialize a temporary storage for the specified number of audio samples.
- * The conversion requires temporary storage due to the different format.
- * The number of audio samples to be allocated is specified in frame_size.
- * @param[out] convertedInputSamples   Array of converted samples. The
- *                                     dimensions are reference, channel
- *                                     (for multi-channel audio), sample.
- * @param      outputCodecContext      Codec context of the output file
- * @param      frameSize               Number of samples to be converted in
- *                                     each round
- * @return Error code (0 if successful)
- */
-int Transcoder::initConvertedSamples(uint8_t ***convertedInputSamples,
-                                  AVCodecContext *outputCodecContext,
-                                  int frameSize)
-{
-    int error;
+        /* Read one audio frame from the input file into a temporary packet.
+         * If we are at the end of the file, the empty packet flushes the
+         * decoder. */
+        if ((error = av_read_frame(inputFormatContext, inputPacket)) < 0 &&
+            error != AVERROR_EOF) {
+            fprintf(stderr, "Could not read frame (error '%d')\n",
+                    error);
+            return error;
+        }
+        if (error == 0) {
+            reportProgress(inputFormatContext, inputPacket);
+            if (options.metrics)
+                options.metrics->add(MetricCounter::PacketsRead);
+        }
 
-    /* Allocate as many pointers as there are audio channels.
-     * Each pointer will later point to the audio samples of the corresponding
-     * channels (although it may be nullptr for interleaved formats).
-     */
-    if (!(*convertedInputSamples = (uint8_t **) calloc(outputCodecContext->channels,
-                                            sizeof(**convertedInputSamples)))) {
-        fprintf(stderr, "Could not allocate converted input sample pointers\n");
-        return AVERROR(ENOMEM);
-    }
+        /* Packets of the other streams are copied or dropped. */
+        if (error == 0 && inputPacket->stream_index != inputStreamIndex) {
+            if ((error = copyPacket(inputFormatContext, inputPacket)) < 0)
+                return error;
+            continue;
+        }
 
-    /* Allocate memory for the samples of all channels in one consecutive
-     * block for convenience. */
-    if ((error = av_samples_alloc(*convertedInputSamples, nullptr,
-                                  outputCodecContext->channels,
-                                  frameSize,
-                                  outputCodecContext->sample_fmt, 0)) < 0) {
-        fprintf(stderr,
-                "Could not allocate converted input samples (error '%d')\n",
-                error);
-        av_freep(&(*convertedInputSamples)[0]);
-        free(*convertedInputSamples);
-        return error;
+        /* Send the audio frame stored in the temporary packet to the decoder.
+         * The input audio stream decoder is used to do this. */
+        error = avcodec_send_packet(inputCodecContext, inputPacket);
+        av_packet_unref(inputPacket);
+        if (error < 0) {
+            fprintf(stderr, "Could not send packet for decoding (error '%d')\n",
+                    error);
+            return error;
+        }
     }
-    return 0;
 }
 
 /**
  * Convert the input audio samples into the output sample format.
- * The conversion happens on a per-frame basis, the size of which is
- * specified by frame_size.
+ * The conversion happens on a per-frame basis. If the sample rates
+ * differ, the resampler holds back some samples for its filter, so
+ * that the number of converted samples varies from frame to frame.
  * @param      inputData        Samples to be decoded. The dimensions are
  *                              channel (for multi-channel audio), sample.
+ *                              nullptr to drain the delayed samples.
+ * @param      inputSize        Number of samples to be converted
  * @param[out] convertedData    Converted samples. The dimensions are channel
  *                              (for multi-channel audio), sample.
- * @param      frameSize        Number of samples to be converted
+ * @param      outputSize       Number of samples convertedData can hold
  * @param      resampleContext  Resample context for the conversion
- * @return Error code (0 if successful)
+ * @return Number of converted samples, or a negative error code
  */
-int Transcoder::convertSamples(const uint8_t **inputData,
-                           uint8_t **convertedData, const int frameSize,
+int Transcoder::convertSamples(const uint8_t **inputData, const int inputSize,
+                           uint8_t **convertedData, const int outputSize,
                            SwrContext *resampleContext)
 {
-    int error;
+    StageTimer timer(options.stats);
+    int converted;
+
+    /* A plain downmix bypasses the resampler; it delays no samples. */
+    if (downmix.replaces(resampleContext)) {
+        if (!inputData)
+            return 0;
+        timer.start(TranscodeStage::Convert);
+        converted = FFMIN(inputSize, outputSize);
+        downmix.process(inputData, convertedData, converted);
+        timer.stop();
+    } else {
+        /* Convert the samples using the resampler. */
+        timer.start(TranscodeStage::Convert);
+        converted = swr_convert(resampleContext,
+                                convertedData, outputSize,
+                                inputData    , inputSize);
+        timer.stop();
+        if (converted < 0) {
+            fprintf(stderr, "Could not convert input samples (error '%d')\n",
+                    converted);
+            return converted;
+        }
+    }
 
-    /* Convert the samples using the resampler. */
-    if ((error = swr_convert(resampleContext,
-                             convertedData, frameSize,
-                             inputData    , frameSize)) < 0) {
-        fprintf(stderr, "Could not convert input samples (error '%d')\n",
-                error);
-        return error;
+    if (options.metrics)
+        options.metrics->add(MetricCounter::SamplesConverted, converted);
+    return converted;
+}
+
+/**
+ * Store the samples still delayed by the resampler in the FIFO buffer.
+ * Has to be called once the input is finished, as a sample rate
+ * conversion holds back the end of the signal otherwise.
+ * @param fifo                 Buffer used for temporary storage
+ * @param outputCodecContext   Codec context of the output file
+ * @param resampleContext      Resample context for the conversion
+ *                             (nullptr if the formats match)
+ * @return Error code (0 if successful)
+ */
+int Transcoder::flushResampler(AVAudioFifo *fifo,
+                               AVCodecContext *outputCodecContext,
+                               SwrContext *resampleContext)
+{
+    uint8_t **convertedSamples = nullptr;
+    int delayed, converted, error;
+
+    if (!resampleContext)
+        return 0;
+
+    while ((delayed = swr_get_out_samples(resampleContext, 0)) > 0) {
+        if ((error = pool.convertedSamples(&convertedSamples, outputCodecContext,
+                                           delayed)) < 0)
+            return error;
+        if ((converted = convertSamples(nullptr, 0, convertedSamples, delayed,
+                                        resampleContext)) < 0)
+            return converted;
+        if (!converted)
+            break;
+        if ((error = addSamplesToFifo(fifo, outputCodecContext, convertedSamples,
+                                      converted)) < 0)
+            return error;
     }
 
     return 0;
@@ -502,22 +1035,42 @@ int Transcoder::convertSamples(const uint8_t **inputData,
 /**
  * Add converted input audio samples to the FIFO buffer for later processing.
  * @param fifo                    Buffer to add the samples to
+ * @param outputCodecContext      Codec context of the output file, giving
+ *                                the format of the samples
  * @param convertedInputSamples   Samples to be added. The dimensions are channel
  *                                (for multi-channel audio), sample.
  * @param frameSize               Number of samples to be converted
  * @return Error code (0 if successful)
  */
 int Transcoder::addSamplesToFifo(AVAudioFifo *fifo,
+                               AVCodecContext *outputCodecContext,
                                uint8_t **convertedInputSamples,
                                const int frameSize)
 {
+    StageTimer timer(options.stats);
     int error;
 
-    /* Make the FIFO as large as it needs to be to hold both,
-     * the old and the new samples. */
-    if ((error = av_audio_fifo_realloc(fifo, av_audio_fifo_size(fifo) + frameSize)) < 0) {
-        fprintf(stderr, "Could not reallocate FIFO\n");
-        return error;
+    timer.start(TranscodeStage::Fifo);
+    /* Make the FIFO large enough to hold both, the old and the new samples.
+     * Grow it geometrically so that odd frame sizes do not cause a
+     * reallocation for every frame. */
+    if (av_audio_fifo_space(fifo) < frameSize) {
+        const int size = av_audio_fifo_size(fifo);
+        const int capacity = FFMAX(size + frameSize,
+                                   2 * (size + av_audio_fifo_space(fifo)));
+
+        const int grown = av_samples_get_buffer_size(nullptr,
+                                                     outputCodecContext->channels,
+                                                     capacity - size -
+                                                     av_audio_fifo_space(fifo),
+                                                     outputCodecContext->sample_fmt, 1);
+
+        if ((error = av_audio_fifo_realloc(fifo, capacity)) < 0) {
+            fprintf(stderr, "Could not reallocate FIFO\n");
+            return error;
+        }
+        MemoryAccount::charge(grown);
+        fifoBytes += grown;
     }
 
     /* Store the new samples in the FIFO buffer. */
@@ -526,17 +1079,89 @@ int Transcoder::addSamplesToFifo(AVAudioFifo *fifo,
         fprintf(stderr, "Could not write data to FIFO\n");
         return AVERROR_EXIT;
     }
+    if (options.metrics)
+        options.metrics->raiseFifoDepth(av_audio_fifo_size(fifo));
+    return 0;
+}
+
+/**
+ * Point to the samples of a buffer starting at a given offset.
+ * @param      format   Sample format of the buffer
+ * @param      channels Number of channels of the buffer
+ * @param      samples  Samples, one pointer per plane
+ * @param      offset   Number of samples to skip
+ * @param[out] data     Sample pointers, one per plane
+ */
+static void offsetPlanes(enum AVSampleFormat format, int channels,
+                         uint8_t *const *samples, int offset, uint8_t **data)
+{
+    const int planar = av_sample_fmt_is_planar(format);
+    const int planes = planar ? channels : 1;
+    const int stride = av_get_bytes_per_sample(format) * (planar ? 1 : channels);
+
+    for (int i = 0; i < planes; i++)
+        data[i] = samples[i] + offset * stride;
+}
+
+/**
+ * Add samples to the FIFO buffer, keeping it within its limit under a
+ * memory budget. Samples beyond the limit are stored by parts, encoding
+ * full frames in between, which holds back the decoder until the
+ * encoder has caught up.
+ * @param fifo                Buffer to add the samples to
+ * @param outputFormatContext Format context of the output file
+ * @param outputCodecContext  Codec context of the output file
+ * @param samples             Samples to be added, in the output format
+ * @param count               Number of samples to be added
+ * @return Error code (0 if successful)
+ */
+int Transcoder::storeSamples(AVAudioFifo *fifo,
+                             AVFormatContext *outputFormatContext,
+                             AVCodecContext *outputCodecContext,
+                             uint8_t **samples, int count)
+{
+    const int limit     = fifoLimit(outputCodecContext);
+    const int frameSize = outputCodecContext->frame_size;
+    uint8_t *part[AV_NUM_DATA_POINTERS * 8];
+    int stored = 0;
+    int error;
+
+    if (!limit || av_audio_fifo_size(fifo) + count <= limit)
+        return addSamplesToFifo(fifo, outputCodecContext, samples, count);
+    if (outputCodecContext->channels > (int)(sizeof(part) / sizeof(*part)))
+        return AVERROR(EINVAL);
+
+    while (stored < count) {
+        const int size = FFMIN(count - stored,
+                               FFMAX(limit - av_audio_fifo_size(fifo), frameSize));
+
+        offsetPlanes(outputCodecContext->sample_fmt, outputCodecContext->channels,
+                     samples, stored, part);
+        if ((error = addSamplesToFifo(fifo, outputCodecContext, part, size)) < 0)
+            return error;
+        stored += size;
+
+        while (stored < count && av_audio_fifo_size(fifo) >= frameSize)
+            if (loadEncodeAndWrite(fifo, outputFormatContext,
+                                   outputCodecContext, 0))
+                return AVERROR_EXIT;
+    }
     return 0;
 }
 
 /**
  * Read one audio frame from the input file, decode, convert and store
  * it in the FIFO buffer.
+ * Without a resampler, the decoded samples are stored without conversion.
+ * If the FIFO buffer is empty and the frame is exactly one encoder frame
+ * large, it is even encoded by reference right away.
  * @param      fifo                 Buffer used for temporary storage
  * @param      input_format_context Format context of the input file
  * @param      input_codec_context  Codec context of the input file
+ * @param      output_format_context Format context of the output file
  * @param      output_codec_context Codec context of the output file
  * @param      resampler_context    Resample context for the conversion
+ *                                  (nullptr if the formats match)
  * @param[out] finished             Indicates whether the end of file has
  *                                  been reached and all data has been
  *                                  decoded. If this flag is false,
@@ -548,6 +1173,7 @@ int Transcoder::addSamplesToFifo(AVAudioFifo *fifo,
 int Transcoder::readDecodeConvertAndStore(AVAudioFifo *fifo,
                                          AVFormatContext *inputFormatContext,
                                          AVCodecContext *inputCodecContext,
+                                         AVFormatContext *outputFormatContext,
                                          AVCodecContext *outputCodecContext,
                                          SwrContext *resamplerContext,
                                          int *finished)
@@ -559,8 +1185,8 @@ int Transcoder::readDecodeConvertAndStore(AVAudioFifo *fifo,
     int dataPresent = 0;
     int ret = AVERROR_EXIT;
 
-    /* Initialize temporary storage for one input frame. */
-    if (initInputFrame(&inputFrame))
+    /* Get the reusable storage for one input frame. */
+    if (pool.inputFrame(&inputFrame))
         goto cleanup;
     /* Decode one frame worth of audio samples. */
     if (decodeAudioFrame(inputFrame, inputFormatContext,
@@ -573,76 +1199,73 @@ int Transcoder::readDecodeConvertAndStore(AVAudioFifo *fifo,
         ret = 0;
         goto cleanup;
     }
-    /* If there is decoded data, convert and store it. */
-    if (dataPresent) {
-        /* Initialize the temporary storage for the converted input samples. */
-        if (initConvertedSamples(&convertedInputSamples, outputCodecContext,
-                                   inputFrame->nb_samples))
+    /* If the decoded data lines up with the encoder's frames, encode it
+     * without copying it at all. */
+    if (dataPresent && !resamplerContext && av_audio_fifo_size(fifo) == 0 &&
+        inputFrame->nb_samples == outputCodecContext->frame_size) {
+        int dataWritten;
+
+        inputFrame->channel_layout = outputCodecContext->channel_layout;
+        if (encodeAudioFrame(inputFrame, outputFormatContext,
+                             outputCodecContext, &dataWritten))
             goto cleanup;
-
-        /* Convert the input samples to the desired output sample format.
-         * This requires a temporary storage provided by converted_input_samples. */
-        if (convertSamples((const uint8_t**)inputFrame->extended_data, convertedInputSamples,
-                            inputFrame->nb_samples, resamplerContext))
+    /* If the decoded data needs no conversion, store it as it is. */
+    } else if (dataPresent && !resamplerContext) {
+        if (storeSamples(fifo, outputFormatContext, outputCodecContext,
+                         inputFrame->extended_data, inputFrame->nb_samples))
             goto cleanup;
-
-        /* Add the converted input samples to the FIFO buffer for later processing. */
-        if (addSamplesToFifo(fifo, convertedInputSamples,
-                                inputFrame->nb_samples))
+    /* If there is decoded data, convert and store it. Under a memory
+     * budget a large frame is converted by parts, so that the converted
+     * sample storage stays as small as the FIFO buffer. */
+    } else if (dataPresent) {
+        const int limit = fifoLimit(outputCodecContext);
+        const int total = inputFrame->nb_samples;
+        const int part  = limit ? FFMIN(total, limit) : total;
+        uint8_t *input[AV_NUM_DATA_POINTERS * 8];
+
+        if (inputFrame->channels > (int)(sizeof(input) / sizeof(*input)))
             goto cleanup;
-    }
-    ret = 0;
 
-    cleanup:
-        if (convertedInputSamples) {
-            // av_freep(&convertedInputSamples[0]);
-            free(convertedInputSamples);
-        }
-        av_frame_free(&inputFrame);
+        for (int offset = 0; offset < total; offset += part) {
+            const int count = FFMIN(part, total - offset);
+            /* Upper bound of the converted samples, including those delayed
+             * by the resampler from previous frames. */
+            const int outputSize = swr_get_out_samples(resamplerContext, count);
+            int converted;
 
-    return ret;
-}
+            if (outputSize < 0)
+                goto cleanup;
 
-/**
- * Initialize one input frame for writing to the output file.
- * The frame will be exactly frame_size samples large.
- * @param[out] frame                Frame to be initialized
- * @param      output_codec_context Codec context of the output file
- * @param      frame_size           Size of the frame
- * @return Error code (0 if successful)
- */
-int Transcoder::initOutputFrame(AVFrame **frame,
-                             AVCodecContext *outputCodecContext,
-                             int frameSize)
-{
-    int error;
+            /* Get the reusable temporary storage for the converted input samples. */
+            if (pool.convertedSamples(&convertedInputSamples, outputCodecContext,
+                                      outputSize))
+                goto cleanup;
 
-    /* Create a new frame to store the audio samples. */
-    if (!(*frame = av_frame_alloc())) {
-        fprintf(stderr, "Could not allocate output frame\n");
-        return AVERROR_EXIT;
-    }
+            /* Convert the input samples to the desired output sample format.
+             * This requires a temporary storage provided by converted_input_samples. */
+            offsetPlanes((enum AVSampleFormat)inputFrame->format,
+                         inputFrame->channels, inputFrame->extended_data,
+                         offset, input);
+            if ((converted = convertSamples((const uint8_t**)input, count,
+                                            convertedInputSamples, outputSize,
+                                            resamplerContext)) < 0)
+                goto cleanup;
 
-    /* Set the frame's parameters, especially its size and format.
-     * av_frame_get_buffer needs this to allocate memory for the
-     * audio samples of the frame.
-     * Default channel layouts based on the number of channels
-     * are assumed for simplicity. */
-    (*frame)->nb_samples     = frameSize;
-    (*frame)->channel_layout = outputCodecContext->channel_layout;
-    (*frame)->format         = outputCodecContext->sample_fmt;
-    (*frame)->sample_rate    = outputCodecContext->sample_rate;
-
-    /* Allocate the samples of the created frame. This call will make
-     * sure that the audio frame can hold as many samples as specified. */
-    if ((error = av_frame_get_buffer(*frame, 0)) < 0) {
-        fprintf(stderr, "Could not allocate output frame samples (error '%d')\n",
-                error);
-        av_frame_free(frame);
-        return error;
+            /* Add the converted input samples to the FIFO buffer for later processing. */
+            if (storeSamples(fifo, outputFormatContext, outputCodecContext,
+                             convertedInputSamples, converted))
+                goto cleanup;
+        }
     }
+    ret = 0;
 
-    return 0;
+    cleanup:
+        /* Hand the decoded samples back to the decoder's buffer pool.
+         * The frame and the converted sample storage stay in our pool. */
+        if (inputFrame)
+            av_frame_unref(inputFrame);
+
+    return ret;
 }
 
 /**
@@ -661,9 +1284,15 @@ int Transcoder::encodeAudioFrame(AVFrame *frame,
 {
     /* Packet used for temporary storage. */
     AVPacket *outputPacket;
+    StageTimer timer(options.stats);
+    /* Output sample position up to which the packet is complete. */
+    int64_t packetEnd;
+    /* Time spent in the encoder for this frame, without the muxer. */
+    std::chrono::steady_clock::time_point encodeStart;
+    int64_t encodeNanoseconds = 0;
     int error;
 
-    error = initPacket(&outputPacket);
+    error = pool.outputPacket(&outputPacket);
     if (error < 0)
         return error;
 
@@ -672,9 +1301,16 @@ int Transcoder::encodeAudioFrame(AVFrame *frame,
         frame->pts = pts;
         pts += frame->nb_samples;
     }
+    if (frame && analyzer) {
+        timer.start(TranscodeStage::Analyze);
+        analyzer->process(frame);
+    }
 
     /* Send the audio frame stored in the temporary packet to the encoder.
      * The output audio stream encoder is used to do this. */
+    timer.start(TranscodeStage::Encode);
+    if (options.metrics)
+        encodeStart = std::chrono::steady_clock::now();
     error = avcodec_send_frame(outputCodecContext, frame);
     /* The encoder signals that it has nothing more to encode. */
     if (error == AVERROR_EOF) {
@@ -686,79 +1322,126 @@ int Transcoder::encodeAudioFrame(AVFrame *frame,
         goto cleanup;
     }
 
-    /* Receive one encoded frame from the encoder. */
-    error = avcodec_receive_packet(outputCodecContext, outputPacket);
-    /* If the encoder asks for more data to be able to provide an
-     * encoded frame, return indicating that no data is present. */
-    if (error == AVERROR(EAGAIN)) {
-        error = 0;
-        goto cleanup;
-    /* If the last frame has been encoded, stop encoding. */
-    } else if (error == AVERROR_EOF) {
-        error = 0;
-        goto cleanup;
-    } else if (error < 0) {
-        fprintf(stderr, "Could not encode frame (error '%d')\n",
-                error);
-        goto cleanup;
-    /* Default case: Return encoded data. */
-    } else {
+    /* Receive all encoded frames the encoder has ready, so that none of
+     * them stays queued inside the encoder until the next call. */
+    while (1) {
+        error = avcodec_receive_packet(outputCodecContext, outputPacket);
+        /* If the encoder asks for more data to be able to provide an
+         * encoded frame, return indicating whether data was present. */
+        if (error == AVERROR(EAGAIN)) {
+            error = 0;
+            goto cleanup;
+        /* If the last frame has been encoded, stop encoding. */
+        } else if (error == AVERROR_EOF) {
+            error = 0;
+            goto cleanup;
+        } else if (error < 0) {
+            fprintf(stderr, "Could not encode frame (error '%d')\n",
+                    error);
+            goto cleanup;
+        }
         *dataPresent = 1;
-    }
-
-    /* Write one audio frame from the temporary packet to the output file. */
-    if (*dataPresent &&
-        (error = av_write_frame(outputFormatContext, outputPacket)) < 0) {
-        fprintf(stderr, "Could not write frame (error '%d')\n",
-                error);
-        goto cleanup;
+        if (options.metrics)
+            encodeNanoseconds += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - encodeStart).count();
+
+        /* Write one audio frame from the temporary packet to the output file.
+         * When encoding one segment of the input, keep it for stitching;
+         * when resuming, drop the packets of the encoder's warm-up. */
+        timer.start(TranscodeStage::Write);
+        packetEnd = outputPacket->pts + outputPacket->duration +
+                    outputCodecContext->initial_padding;
+        if (segment)
+            error = storeSegmentPacket(outputPacket, outputCodecContext);
+        else if (outputPacket->pts + outputCodecContext->initial_padding <
+                 resumePosition)
+            error = 0;
+        else
+            error = writeAudioPacket(outputFormatContext, outputCodecContext,
+                                     outputPacket);
+        if (error >= 0 && !segment && nextCheckpoint >= 0 &&
+            packetEnd >= nextCheckpoint)
+            error = saveCheckpoint(outputFormatContext, outputCodecContext,
+                                   packetEnd);
+        if (error >= 0 && !segment)
+            error = flushFragment(outputFormatContext, packetEnd,
+                                  outputCodecContext->sample_rate);
+        if (error < 0) {
+            fprintf(stderr, "Could not write frame (error '%d')\n",
+                    error);
+            goto cleanup;
+        }
+        av_packet_unref(outputPacket);
+        if (options.metrics) {
+            options.metrics->add(MetricCounter::PacketsWritten);
+            encodeStart = std::chrono::steady_clock::now();
+        }
+        timer.start(TranscodeStage::Encode);
     }
 
 cleanup:
-    av_packet_free(&outputPacket);
+    av_packet_unref(outputPacket);
+    if (options.metrics && frame && error >= 0) {
+        encodeNanoseconds += std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - encodeStart).count();
+        options.metrics->add(MetricCounter::FramesEncoded);
+        options.metrics->observeEncodeLatency(encodeNanoseconds);
+    }
     return error;
 }
 
 /**
- * Load one audio frame from the FIFO buffer, encode and write it to the
- * output file.
+ * Load a batch of audio frames from the FIFO buffer, encode and write them
+ * to the output file. Up to ENCODE_BATCH_FRAMES full frames are taken per
+ * call; a last, partial frame is only taken at the end of the input.
  * @param fifo                  Buffer used for temporary storage
  * @param output_format_context Format context of the output file
  * @param output_codec_context  Codec context of the output file
+ * @param finished              Whether the end of the input has been
+ *                              reached, so that the remaining samples
+ *                              have to be encoded as well
  * @return Error code (0 if successful)
  */
 int Transcoder::loadEncodeAndWrite(AVAudioFifo *fifo,
                                  AVFormatContext *outputFormatContext,
-                                 AVCodecContext *outputCodecContext)
+                                 AVCodecContext *outputCodecContext,
+                                 int finished)
 {
     /* Temporary storage of the output samples of the frame written to the file. */
     AVFrame *outputFrame;
-    /* Use the maximum number of possible samples per frame.
-     * If there is less than the maximum possible frame size in the FIFO
-     * buffer use this number. Otherwise, use the maximum possible frame size. */
-    const int frame_size = FFMIN(av_audio_fifo_size(fifo),
-                                 outputCodecContext->frame_size);
+    StageTimer timer(options.stats);
     int dataWritten;
 
-    /* Initialize temporary storage for one output frame. */
-    if (initOutputFrame(&outputFrame, outputCodecContext, frame_size))
-        return AVERROR_EXIT;
+    for (int i = 0; i < ENCODE_BATCH_FRAMES; i++) {
+        const int available = av_audio_fifo_size(fifo);
+        /* Use the maximum number of possible samples per frame.
+         * If there is less than the maximum possible frame size in the FIFO
+         * buffer use this number. Otherwise, use the maximum possible frame size. */
+        const int frame_size = FFMIN(available, outputCodecContext->frame_size);
 
-    /* Read as many samples from the FIFO buffer as required to fill the frame.
-     * The samples are stored in the frame temporarily. */
-    if (av_audio_fifo_read(fifo, (void **)outputFrame->data, frame_size) < frame_size) {
-        fprintf(stderr, "Could not read data from FIFO\n");
-        av_frame_free(&outputFrame);
-        return AVERROR_EXIT;
-    }
+        if (available <= 0 ||
+            (!finished && available < outputCodecContext->frame_size))
+            break;
 
-    /* Encode one frame worth of audio samples. */
-    if (encodeAudioFrame(outputFrame, outputFormatContext,
-                           outputCodecContext, &dataWritten)) {
-        av_frame_free(&outputFrame);
-        return AVERROR_EXIT;
+        /* Get the reusable temporary storage for one output frame. */
+        if (pool.outputFrame(&outputFrame, outputCodecContext, frame_size))
+            return AVERROR_EXIT;
+
+        /* Read as many samples from the FIFO buffer as required to fill the frame.
+         * The samples are stored in the frame temporarily. */
+        timer.start(TranscodeStage::Fifo);
+        if (av_audio_fifo_read(fifo, (void **)outputFrame->data, frame_size) < frame_size) {
+            fprintf(stderr, "Could not read data from FIFO\n");
+            return AVERROR_EXIT;
+        }
+        timer.stop();
+
+        /* Encode one frame worth of audio samples and write all
+         * packets the encoder returns for it. */
+        if (encodeAudioFrame(outputFrame, outputFormatContext,
+                               outputCodecContext, &dataWritten))
+            return AVERROR_EXIT;
     }
-    av_frame_free(&outputFrame);
     return 0;
 }
 
@@ -775,38 +1458,52 @@ int Transcoder::writeOutputFileTrailer(AVFormatContext *outputFormatContext)
                 error);
         return error;
     }
+    if (options.metrics && outputFormatContext->pb)
+        options.metrics->add(MetricCounter::BytesWritten,
+                             avio_tell(outputFormatContext->pb));
     return 0;
 }
 
-int Transcoder::processInput()
+/**
+ * Flush the encoder and write all delayed packets to the output file.
+ * @param outputFormatContext Format context of the output file
+ * @param outputCodecContext  Codec context of the output file
+ * @return Error code (0 if successful)
+ */
+int Transcoder::flushEncoder(AVFormatContext *outputFormatContext,
+                             AVCodecContext *outputCodecContext)
 {
-    AVFormatContext *inputFormatContext = nullptr;
-    AVFormatContext *outputFormatContext = nullptr;
-    AVCodecContext *inputCodecContext = nullptr;
-    AVCodecContext *outputCodecContext = nullptr;
-    SwrContext *resampleContext = nullptr;
-    AVAudioFifo *fifo = nullptr;
-    int ret = AVERROR_EXIT;
+    int dataWritten;
 
-    /* Open the input file for reading. */
-    if (openInputFile(inputFile, &inputFormatContext,
-                        &inputCodecContext))
-        goto cleanup;
-    /* Open the output file for writing. */
-    if (openOutputFile(outputFile, inputCodecContext,
-                         &outputFormatContext, &outputCodecContext))
-        goto cleanup;
-    /* Initialize the resampler to be able to convert audio sample formats. */
-    if (initResampler(inputCodecContext, outputCodecContext,
-                       &resampleContext))
-        goto cleanup;
-    /* Initialize the FIFO buffer to store audio samples to be encoded. */
-    if (initFifo(&fifo, outputCodecContext))
-        goto cleanup;
-    /* Write the header of the output file container. */
-    if (writeOutputFileHeader(outputFormatContext))
-        goto cleanup;
+    /* Flush the encoder as it may have delayed frames. */
+    do {
+        dataWritten = 0;
+        if (encodeAudioFrame(nullptr, outputFormatContext,
+                             outputCodecContext, &dataWritten))
+            return AVERROR_EXIT;
+    } while (dataWritten);
+
+    return 0;
+}
 
+/**
+ * Transcode the whole input on the calling thread, one stage after
+ * the other.
+ * @param inputFormatContext  Format context of the input file
+ * @param inputCodecContext   Codec context of the input file
+ * @param outputFormatContext Format context of the output file
+ * @param outputCodecContext  Codec context of the output file
+ * @param resampleContext     Resample context for the conversion
+ * @param fifo                Buffer used for temporary storage
+ * @return Error code (0 if successful)
+ */
+int Transcoder::processSequential(AVFormatContext *inputFormatContext,
+                                  AVCodecContext *inputCodecContext,
+                                  AVFormatContext *outputFormatContext,
+                                  AVCodecContext *outputCodecContext,
+                                  SwrContext *resampleContext,
+                                  AVAudioFifo *fifo)
+{
     /* Loop as long as we have input samples to read or output samples
      * to write; abort as soon as we have neither. */
     while (1) {
@@ -824,14 +1521,19 @@ int Transcoder::processInput()
              * output sample format and put it into the FIFO buffer. */
             if (readDecodeConvertAndStore(fifo, inputFormatContext,
                                               inputCodecContext,
+                                              outputFormatContext,
                                               outputCodecContext,
                                               resampleContext, &finished))
-                goto cleanup;
+                return AVERROR_EXIT;
 
             /* If we are at the end of the input file, we continue
-             * encoding the remaining audio samples to the output file. */
-            if (finished)
+             * encoding the remaining audio samples to the output file,
+             * including those still held back by the resampler. */
+            if (finished) {
+                if (flushResampler(fifo, outputCodecContext, resampleContext))
+                    return AVERROR_EXIT;
                 break;
+            }
         }
 
         /* If we have enough samples for the encoder, we encode them.
@@ -842,43 +1544,317 @@ int Transcoder::processInput()
             /* Take one frame worth of audio samples from the FIFO buffer,
              * encode it and write it to the output file. */
             if (loadEncodeAndWrite(fifo, outputFormatContext,
-                                      outputCodecContext))
-                goto cleanup;
+                                      outputCodecContext, finished))
+                return AVERROR_EXIT;
 
         /* If we are at the end of the input file and have encoded
          * all remaining samples, we can exit this loop and finish. */
-        if (finished) {
-            int data_written;
-            /* Flush the encoder as it may have delayed frames. */
-            do {
-                data_written = 0;
-                if (encodeAudioFrame(nullptr, outputFormatContext,
-                                       outputCodecContext, &data_written))
-                    goto cleanup;
-            } while (data_written);
-            break;
-        }
+        if (finished)
+            return flushEncoder(outputFormatContext, outputCodecContext);
+    }
+}
+
+/**
+ * Transcode the input into every output.
+ * Emits finished() or error() once the run is over.
+ * @return Error code (0 if successful)
+ */
+int Transcoder::processInput()
+{
+    const std::chrono::steady_clock::time_point start =
+        std::chrono::steady_clock::now();
+    int ret = open();
+
+    if (!ret)
+        ret = run();
+
+    if (options.metrics) {
+        options.metrics->add(ret < 0 ? MetricCounter::JobsFailed :
+                                       MetricCounter::JobsSucceeded);
+        options.metrics->add(MetricCounter::JobMicroseconds,
+                             std::chrono::duration_cast<std::chrono::microseconds>(
+                                 std::chrono::steady_clock::now() - start).count());
+    }
+    if (ret < 0)
+        emit error(ret);
+    else
+        emit finished();
+    return ret;
+}
+
+/**
+ * Stop a run as soon as possible. May be called from any thread; the run
+ * then fails with an error.
+ */
+void Transcoder::cancel()
+{
+    cancelled.store(true);
+}
+
+bool Transcoder::isCancelled() const
+{
+    return cancelled.load(std::memory_order_relaxed) ||
+           (owner && owner->isCancelled());
+}
+
+/**
+ * Emit progress() whenever the demuxer has advanced by another step,
+ * a hundredth of the input or TRANSCODE_PROGRESS_STEP, whichever is more.
+ * @param inputFormatContext Format context of the input file
+ * @param packet             Packet just read from the input file
+ */
+void Transcoder::reportProgress(AVFormatContext *inputFormatContext,
+                                const AVPacket *packet)
+{
+    const AVStream *stream = inputFormatContext->streams[packet->stream_index];
+    const int64_t duration = inputFormatContext->duration > 0 ?
+                             inputFormatContext->duration : 0;
+    int64_t position;
+
+    if (packet->pts == AV_NOPTS_VALUE)
+        return;
+    position = packet->pts;
+    if (stream->start_time != AV_NOPTS_VALUE)
+        position -= stream->start_time;
+    position = av_rescale_q(position, stream->time_base, av_get_time_base_q());
+    if (position < nextProgress)
+        return;
+
+    nextProgress = position + FFMAX(duration / 100, (int64_t)TRANSCODE_PROGRESS_STEP);
+    emit progress(position, duration);
+}
+
+/**
+ * Open the input and, unless the run copies the audio packets or fans out
+ * to several renditions, the output, resampler and FIFO buffer, and write
+ * the output header. Anything opened before is closed first.
+ * @return Error code (0 if successful)
+ */
+int Transcoder::open()
+{
+    AVFormatContext *inputFormatContext = nullptr;
+    AVFormatContext *outputFormatContext = nullptr;
+    AVCodecContext *inputCodecContext = nullptr;
+    AVCodecContext *outputCodecContext = nullptr;
+    SwrContext *resampleContext = nullptr;
+    AVAudioFifo *fifo = nullptr;
+    int64_t appendAt;
+    int sampleRate;
+
+    close();
+    /* Every run starts a new output stream. */
+    pts = 0;
+    nextProgress = 0;
+
+    if (outputs.isEmpty()) {
+        fprintf(stderr, "No output file given\n");
+        return AVERROR(EINVAL);
+    }
+    /* Outputs of an input transcoded before are taken from the cache. */
+    if (options.resultCache && !options.analysis.enabled() &&
+        fetchCachedOutputs()) {
+        fromCache = true;
+        return 0;
+    }
+
+    /* Open the input file for reading. */
+    mapping.reset(new MappedInput);
+    if (openInputFile(inputFile, inputSource(mapping.get()), options,
+                      &inputFormatContext, &inputCodecContext,
+                      &inputStreamIndex)) {
+        close();
+        return AVERROR_EXIT;
+    }
+    inputFormat.reset(inputFormatContext);
+    inputCodec = CodecContextHandle(inputCodecContext,
+                                    CodecContextDeleter(options.codecCache));
+
+    /* Several renditions share the decoded input; they are opened by
+     * the fan-out itself, which always transcodes the whole input. */
+    if (outputs.size() > 1 && (options.trimStart > 0 || options.trimDuration > 0)) {
+        fprintf(stderr, "Clips cannot be cut from several renditions\n");
+        close();
+        return AVERROR(EINVAL);
+    }
+    /* Normalization measures whole inputs for a single output. */
+    if (options.normalize && (outputs.size() > 1 || options.trimStart > 0 ||
+                              options.trimDuration > 0)) {
+        fprintf(stderr, "Renditions and clips cannot be normalized\n");
+        close();
+        return AVERROR(EINVAL);
+    }
+    if (outputs.size() > 1)
+        return 0;
+    /* Input audio that already is what the output asks for is remuxed,
+     * unless the encoder is asked for more than that. */
+    sampleRate = outputSampleRate(outputs.first(), inputCodecContext);
+    remuxing = options.remux && options.trimStart <= 0 &&
+               options.trimDuration <= 0 && !options.analysis.enabled() &&
+               !options.normalize && options.fragmentDuration <= 0 &&
+               options.encoderOptions.isEmpty() && !options.lowDelay &&
+               canRemux(outputs.first(), sampleRate,
+                        inputFormatContext->streams[inputStreamIndex]->codecpar);
+    if (remuxing)
+        return 0;
+
+    /* Open the output file for writing, or to continue it from where an
+     * earlier run of the job was stopped. */
+    appendAt = prepareCheckpoints(outputs.first(), sampleRate, inputCodecContext);
+    if (openOutputFile(outputs.first(), sampleRate, options,
+                       &outputFormatContext, &outputCodecContext, appendAt))
+        goto fail;
+    outputFormat.reset(outputFormatContext);
+    outputCodec = CodecContextHandle(outputCodecContext,
+                                     CodecContextDeleter(options.codecCache));
+    /* Copy the other streams of the input along with the audio. Only the
+     * sequential engine demuxes and muxes on the same thread, and only
+     * whole inputs keep the timestamps of the other streams in line. */
+    if (options.copyStreams && options.engine != TranscodeEngine::Sequential)
+        fprintf(stderr, "Streams are only copied by the sequential engine, dropping them\n");
+    else if (options.copyStreams && options.normalize)
+        fprintf(stderr, "Streams are not copied into normalized outputs, dropping them\n");
+    else if (options.copyStreams && (options.trimStart > 0 || options.trimDuration > 0))
+        fprintf(stderr, "Streams are not copied into clips, dropping them\n");
+    else if (options.copyStreams &&
+             addCopiedStreams(inputFormatContext, outputFormatContext))
+        goto fail;
+    /* Initialize the resampler to be able to convert audio sample formats.
+     * If the decoder already delivers what the encoder expects, the
+     * samples are passed through without one. */
+    if (!formatsMatch(inputCodecContext, outputCodecContext) &&
+        initResampler(inputCodecContext, outputCodecContext,
+                       options.resamplerQuality, options.downmix,
+                       &resampleContext))
+        goto fail;
+    resampler.reset(resampleContext);
+    downmix.configure(inputCodecContext, outputCodecContext, options.downmix,
+                      resampleContext);
+    /* Initialize the FIFO buffer to store audio samples to be encoded. */
+    if (initFifo(&fifo, inputCodecContext, outputCodecContext))
+        goto fail;
+    outputFifo.reset(fifo);
+    /* Tap the frames handed to the encoder for the analysis files. */
+    if (options.analysis.enabled() && outputs.first().stream)
+        fprintf(stderr, "Output is a stream, writing no analysis\n");
+    else if (options.analysis.enabled())
+        analyzer.reset(new AudioAnalyzer(options.analysis, outputCodecContext));
+    /* Write the header of the output file container. */
+    if (writeOutputFileHeader(outputFormatContext))
+        goto fail;
+    return 0;
+
+fail:
+    close();
+    return AVERROR_EXIT;
+}
+
+/**
+ * Transcode the input opened by open() into every output, then close
+ * them all, whether the run succeeded or not.
+ * @return Error code (0 if successful)
+ */
+int Transcoder::run()
+{
+    AVFormatContext *inputFormatContext   = inputFormat.get();
+    AVCodecContext *inputCodecContext     = inputCodec.get();
+    AVFormatContext *outputFormatContext  = outputFormat.get();
+    AVCodecContext *outputCodecContext    = outputCodec.get();
+    SwrContext *resampleContext           = resampler.get();
+    AVAudioFifo *fifo                     = outputFifo.get();
+    int ret = AVERROR_EXIT;
+
+    if (fromCache) {
+        close();
+        return 0;
+    }
+    if (!inputFormatContext) {
+        fprintf(stderr, "Transcoder has not been opened\n");
+        return AVERROR(EINVAL);
+    }
+
+    if (outputs.size() > 1) {
+        ret = processFanOut(inputFormatContext, inputCodecContext);
+        goto cleanup;
+    }
+    if (remuxing) {
+        ret = processRemux(inputFormatContext);
+        goto cleanup;
+    }
+
+    /* Decode, convert and encode the whole input, its clip, or what is
+     * left of it after the checkpoint of an earlier run. */
+    if (options.normalize) {
+        if (processNormalized(inputFormatContext, inputCodecContext,
+                              outputFormatContext, outputCodecContext, fifo))
+            goto cleanup;
+    } else if (resumePosition > 0) {
+        if (processResumed(inputFormatContext, inputCodecContext,
+                           outputFormatContext, outputCodecContext,
+                           resampleContext, fifo))
+            goto cleanup;
+    } else if (options.trimStart > 0 || options.trimDuration > 0) {
+        if (processTrimmed(inputFormatContext, inputCodecContext,
+                           outputFormatContext, outputCodecContext,
+                           resampleContext, fifo))
+            goto cleanup;
+    } else if (options.engine == TranscodeEngine::Pipelined) {
+        if (processPipelined(inputFormatContext, inputCodecContext,
+                             outputFormatContext, outputCodecContext,
+                             resampleContext, fifo))
+            goto cleanup;
+    } else if (options.engine == TranscodeEngine::Segmented) {
+        if (processSegmented(inputFormatContext, inputCodecContext,
+                             outputFormatContext, outputCodecContext,
+                             resampleContext, fifo))
+            goto cleanup;
+    } else {
+        if (processSequential(inputFormatContext, inputCodecContext,
+                              outputFormatContext, outputCodecContext,
+                              resampleContext, fifo))
+            goto cleanup;
     }
 
     /* Write the trailer of the output file container. */
     if (writeOutputFileTrailer(outputFormatContext))
         goto cleanup;
+    if (analyzer && !analyzer->write(outputs.first().path))
+        goto cleanup;
+    /* A finished output is not to be continued. */
+    if (nextCheckpoint >= 0)
+        QFile::remove(checkpointFile);
     ret = 0;
 
 cleanup:
-    if (fifo)
-        av_audio_fifo_free(fifo);
-    swr_free(&resampleContext);
-    if (outputCodecContext)
-        avcodec_free_context(&outputCodecContext);
-    if (outputFormatContext) {
-        avio_closep(&outputFormatContext->pb);
-        avformat_free_context(outputFormatContext);
-    }
-    if (inputCodecContext)
-        avcodec_free_context(&inputCodecContext);
-    if (inputFormatContext)
-        avformat_close_input(&inputFormatContext);
+    if (!ret && !cacheKeys.isEmpty())
+        storeCachedOutputs();
+    close();
 
     return ret;
 }
+
+/**
+ * Release everything opened by open(), the output before the input it
+ * is read from.
+ */
+void Transcoder::close()
+{
+    copyOutput = nullptr;
+    streamMap.clear();
+    remuxing = false;
+    nextCheckpoint = -1;
+    nextFragment = options.fragmentDuration;
+    resumePosition = 0;
+    fromCache = false;
+    cacheKeys.clear();
+    analyzer.reset();
+    outputFifo.reset();
+    /* The FIFO buffer is charged again by the next open(). */
+    MemoryAccount::credit(fifoBytes);
+    fifoBytes = 0;
+    resampler.reset();
+    outputCodec.reset();
+    outputFormat.reset();
+    inputCodec.reset();
+    inputFormat.reset();
+    mapping.reset();
+}
@@ -28,7 +28,30 @@
  * @author Andreas Unterweger (dustsigns@gmail.com)
  */
 
+#ifndef TRANSCODER_H
+#define TRANSCODER_H
+
+#include <QList>
+#include <QMap>
 #include <QObject>
+#include <QString>
+#include <QVector>
+
+#include <atomic>
+#include <memory>
+
+#include "analysis.h"
+#include "checkpoint.h"
+#include "codeccache.h"
+#include "downmix.h"
+#include "encoderselector.h"
+#include "framepool.h"
+#include "mediahandles.h"
+#include "memoryaccount.h"
+#include "resultcache.h"
+#include "streamio.h"
+#include "transcodemetrics.h"
+#include "transcodestats.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -45,80 +68,503 @@ extern "C" {
 }
 #endif
 
-/* The output bit rate in bit/s */
+/* The default output bit rate in bit/s */
 #define OUTPUT_BIT_RATE 96000
-/* The number of output channels */
+/* The default number of output channels */
 #define OUTPUT_CHANNELS 2
+/* The frame size used for encoders accepting any number of samples */
+#define ENCODER_DEFAULT_FRAME_SIZE 1024
+/* The maximum number of frames encoded per FIFO read batch */
+#define ENCODE_BATCH_FRAMES 8
+/* The decoder frame size assumed for sizing the FIFO if it is unknown */
+#define FIFO_DEFAULT_INPUT_FRAME_SIZE 4096
+/* The block size used for writing the output file in bytes */
+#define OUTPUT_IO_BLOCK_SIZE (256 * 1024)
+/* The fragment duration of MP4 output that cannot be seeked in us */
+#define OUTPUT_FRAGMENT_DURATION 1000000
+/* The segment duration of HLS output without a fragment duration in us */
+#define HLS_SEGMENT_DURATION 2000000
+/* Suffix of the HLS initialization segment, appended to the playlist name */
+#define HLS_INIT_SUFFIX "_init.mp4"
+/* The number of bytes probed of a trusted input */
+#define INPUT_TRUSTED_PROBE_SIZE (32 * 1024)
+/* The duration analyzed of a trusted input in us */
+#define INPUT_TRUSTED_ANALYZE_DURATION 100000
+/* The minimum input distance between two progress reports in us */
+#define TRANSCODE_PROGRESS_STEP 1000000
+/* How far above the requested bit rate an input may be remuxed in % */
+#define REMUX_BIT_RATE_TOLERANCE 25
+/* Output formats a stopped run can be continued in: fragmented MP4 and
+ * formats without a file header or index */
+#define CHECKPOINT_FORMATS "mp4,mov,ipod,ismv,3gp,3g2,psp,adts,mpegts"
+
+/* Strategy used to run the decode -> convert -> encode loop. */
+enum class TranscodeEngine
+{
+    /* All stages one after the other on the calling thread. */
+    Sequential,
+    /* Demux+decode, resample and encode+mux on separate threads. */
+    Pipelined,
+    /* Time ranges of the input encoded in parallel and stitched together. */
+    Segmented
+};
+
+/* Speed/quality trade-off of the sample rate conversion. */
+enum class ResamplerQuality
+{
+    /* Short linearly interpolated filter, cheapest on the CPU. */
+    Fast,
+    /* The default filter of the built-in resampler. */
+    Default,
+    /* The SoX resampler if available, a long filter otherwise. */
+    High
+};
+
+/* One rendition produced from the input. */
+struct OutputSpec
+{
+    QString path;
+    /* Name of the encoder (empty: the default AAC encoder). */
+    QString codec;
+    /* Bit rate in bit/s. */
+    int bitRate = OUTPUT_BIT_RATE;
+    int channels = OUTPUT_CHANNELS;
+    /* Sample rate in Hz (0: the rate of the options, or else the input's). */
+    int sampleRate = 0;
+    /* Name of the container format (empty: guessed from the path). */
+    QString format;
+    /* Stream written to instead of the path if set. */
+    const StreamCallbacks *stream = nullptr;
+};
+
+/* Settings of one transcoding run. */
+struct TranscoderOptions
+{
+    TranscodeEngine engine = TranscodeEngine::Sequential;
+    /* Number of frames in flight between two pipeline stages. */
+    int queueDepth = 16;
+    /* Bytes the FIFO buffers and the frames in flight of one job may
+     * take (0: unlimited); caps the FIFO size and the queue depth. */
+    int64_t memoryBudget = 0;
+    /* Number of time ranges encoded in parallel (0: one per core). */
+    int segments = 0;
+    /* Sample rate of the output file in Hz (0: the input's rate). */
+    int sampleRate = 0;
+    ResamplerQuality resamplerQuality = ResamplerQuality::Default;
+    /* Matrix used if surround or mono input is encoded as stereo. */
+    DownmixMode downmix = DownmixMode::Itu;
+    /* Receives the time spent per stage if set; shared by all threads
+     * of the run. */
+    TranscodeStats *stats = nullptr;
+    /* Receives the counters of the run if set; may be shared by any
+     * number of runs. */
+    TranscodeMetrics *metrics = nullptr;
+    /* Stream read from instead of the input file if set. */
+    const StreamCallbacks *inputStream = nullptr;
+    /* Read local input files through a memory mapping. */
+    bool mapInput = true;
+    /* The input is known to be well-formed: probe as little of it as
+     * possible and skip the stream analysis if its header suffices. */
+    bool trustedInput = false;
+    /* Container format of the input (default: probed). */
+    QString inputFormat;
+    /* Opened decoders and encoders are taken from and returned to this
+     * cache if set; shared by all jobs and threads of a run. */
+    CodecContextCache *codecCache = nullptr;
+    /* Outputs are taken from and stored in this cache if set; shared by
+     * all jobs and threads of a run. */
+    ResultCache *resultCache = nullptr;
+    /* Picks the fastest usable encoder of the output codec if set;
+     * otherwise the codec of an output names its encoder. */
+    const EncoderSelector *encoders = nullptr;
+    /* Index of the audio stream to be transcoded (-1: the best one). */
+    int audioStream = -1;
+    /* Copy the other streams of the input, like video or cover art, into
+     * the output without decoding them. */
+    bool copyStreams = false;
+    /* Copy the audio packets instead of transcoding them if the input
+     * already has the codec, channels, rate and bit rate asked for.
+     * Runs with encoder options or low-delay threading always transcode,
+     * as copied packets would not follow them. */
+    bool remux = true;
+    /* Start of the clip of the input to be transcoded in us. */
+    int64_t trimStart = 0;
+    /* Duration of the clip in us (0: up to the end of the input). */
+    int64_t trimDuration = 0;
+    /* Output duration in us after which the progress of the run is saved
+     * to the output path + CHECKPOINT_SUFFIX, to be continued from by a
+     * later run of the same job (0: no checkpoints). */
+    int64_t checkpointInterval = 0;
+    /* Loudness, waveform and silences measured of the (first) output in
+     * the same pass and written next to it; whole inputs are then
+     * always decoded, neither remuxed nor taken from the result cache. */
+    AnalysisOptions analysis;
+    /* Normalize the output to targetLoudness in two passes over one
+     * decode: the converted samples are spilled to a temporary file while
+     * their loudness is measured, then encoded from it with the gain. */
+    bool normalize = false;
+    /* Integrated loudness normalized to in LUFS. */
+    double targetLoudness = -16.0;
+    /* True peak the gain may raise the output to at most in dBTP. */
+    double truePeakLimit = -1.0;
+    /* Directory of the temporary sample spill (empty: the system's). */
+    QString scratchDirectory;
+    /* Output duration in us after which MP4 output is completed as a
+     * fragment and flushed, and other output flushed; the segment
+     * duration of HLS output (0: no low-latency flushing). */
+    int64_t fragmentDuration = 0;
+    /* Threads every decoder and encoder may use (0: as many as FFmpeg
+     * considers useful). Batches, the service and the engines running
+     * codecs in parallel share the cores among them if unset. */
+    int codecThreads = 0;
+    /* Keep the codecs to slice threading: frame threading delays every
+     * frame by one per thread. */
+    bool lowDelay = false;
+    /* Codec options (AVOptions, like "aac_coder" or "profile") decoders
+     * and encoders are opened with; they override the threading
+     * settings. Options a codec does not know are reported and ignored. */
+    QMap<QString, QString> decoderOptions;
+    QMap<QString, QString> encoderOptions;
+};
+
+class MappedInput;
+class QJsonObject;
+class SampleSpill;
+struct PipelineState;
+struct SegmentJob;
+struct FanOutRendition;
+struct FanOutGroup;
 
 class Transcoder: public QObject
 {
     Q_OBJECT
 
     public:
-        Transcoder(const char *input, const char *output);
+        Transcoder(const char *input, const char *output,
+                   const TranscoderOptions &options = TranscoderOptions());
+        Transcoder(const char *input, const QList<OutputSpec> &outputs,
+                   const TranscoderOptions &options = TranscoderOptions());
+        ~Transcoder();
+
+        int open();
+
+        int run();
+
         int processInput();
 
+        static int probeInput(const char *filename,
+                              const TranscoderOptions &options,
+                              QJsonObject *info);
+
+        static int codecThreadShare(const TranscoderOptions &options,
+                                    int concurrent);
+
+        bool isCancelled() const;
+
+    public slots:
+        void cancel();
+
+    signals:
+        /* Position the input has been read up to and its duration, both
+         * in us; the duration is 0 if it is unknown. */
+        void progress(qint64 position, qint64 duration);
+        void finished();
+        void error(int code);
+
     private:
+        void close();
+
+        void reportProgress(AVFormatContext *inputFormatContext,
+                            const AVPacket *packet);
+
+        static int codecOptions(const AVCodec *codec,
+                                const QMap<QString, QString> &given,
+                                const TranscoderOptions &options,
+                                AVDictionary **dictionary, CodecKey *key);
+
+        static void reportUnusedOptions(const AVCodec *codec,
+                                        const AVDictionary *dictionary);
+
+        static int openInputContainer(const char *filename,
+                                      const StreamCallbacks *stream,
+                                      const TranscoderOptions &options,
+                                      AVFormatContext **inputFormatContext);
+
         static int openInputFile(const char *filename,
+                           const StreamCallbacks *stream,
+                           const TranscoderOptions &options,
                            AVFormatContext **inputFormatContext,
-                           AVCodecContext **inputCodecContext);
+                           AVCodecContext **inputCodecContext,
+                           int *streamIndex);
+
+        static void closeInputFile(AVFormatContext **inputFormatContext);
+
+        const StreamCallbacks *inputSource(MappedInput *mapping) const;
 
-        static int openOutputFile(const char *filename,
-                            AVCodecContext *inputCodecContext,
+        static int openEncoder(const OutputSpec &spec,
+                               int sampleRate, bool globalHeader,
+                               const TranscoderOptions &options,
+                               AVCodecContext **outputCodecContext);
+
+        static int openOutputContainer(const OutputSpec &spec,
+                                       AVFormatContext **outputFormatContext,
+                                       int64_t appendAt = -1);
+
+        static int openOutputFile(const OutputSpec &spec,
+                            int sampleRate,
+                            const TranscoderOptions &options,
                             AVFormatContext **outputFormatContext,
-                            AVCodecContext **outputCodecContext);
+                            AVCodecContext **outputCodecContext,
+                            int64_t appendAt = -1);
+
+        static void closeOutputFile(AVFormatContext **outputFormatContext);
 
-        static int initPacket(AVPacket **packet);
+        static void closeCodec(CodecContextCache *cache, AVCodecContext **context);
 
-        static int initInputFrame(AVFrame **frame);
+        static bool formatsMatch(AVCodecContext *inputCodecContext,
+                                 AVCodecContext *outputCodecContext);
+
+        static int outputSampleRate(const OutputSpec &spec,
+                                    AVCodecContext *inputCodecContext);
 
         static int initResampler(AVCodecContext *inputCodecContext,
                           AVCodecContext *outputCodecContext,
+                          ResamplerQuality quality,
+                          DownmixMode mode,
                           SwrContext **resampleContext);
 
-        static int initFifo(AVAudioFifo **fifo, AVCodecContext *outputCodecContext);
+        int initFifo(AVAudioFifo **fifo, AVCodecContext *inputCodecContext,
+                     AVCodecContext *outputCodecContext);
+
+        int fifoLimit(AVCodecContext *outputCodecContext) const;
 
-        static int writeOutputFileHeader(AVFormatContext *outputFormatContext);
+        int framesInFlight(AVCodecContext *inputCodecContext, int buffers) const;
 
-        static int decodeAudioFrame(AVFrame *frame,
+        int writeOutputFileHeader(AVFormatContext *outputFormatContext);
+
+        int decodeAudioFrame(AVFrame *frame,
                               AVFormatContext *inputFormatContext,
                               AVCodecContext *inputCodecContext,
                               int *dataPresent, int *finished);
 
-        static int initConvertedSamples(uint8_t ***convertedInputSamples,
-                                  AVCodecContext *outputCodecContext,
-                                  int frameSize);
+        int convertSamples(const uint8_t **inputData, const int inputSize,
+                           uint8_t **convertedData, const int outputSize,
+                           SwrContext *resampleContext);
 
-        static int convertSamples(const uint8_t **inputData,
-                           uint8_t **convertedData, const int frameSize,
+        int flushResampler(AVAudioFifo *fifo,
+                           AVCodecContext *outputCodecContext,
                            SwrContext *resampleContext);
 
-        static int addSamplesToFifo(AVAudioFifo *fifo,
+        int addSamplesToFifo(AVAudioFifo *fifo,
+                               AVCodecContext *outputCodecContext,
                                uint8_t **convertedInputSamples,
                                const int frameSize);
 
-        static int readDecodeConvertAndStore(AVAudioFifo *fifo,
+        int storeSamples(AVAudioFifo *fifo,
+                         AVFormatContext *outputFormatContext,
+                         AVCodecContext *outputCodecContext,
+                         uint8_t **samples, int count);
+
+        int readDecodeConvertAndStore(AVAudioFifo *fifo,
                                          AVFormatContext *inputFormatContext,
                                          AVCodecContext *inputCodecContext,
+                                         AVFormatContext *outputFormatContext,
                                          AVCodecContext *outputCodecContext,
                                          SwrContext *resamplerContext,
                                          int *finished);
 
-        static int initOutputFrame(AVFrame **frame,
-                             AVCodecContext *outputCodecContext,
-                             int frameSize);
-
-        static int encodeAudioFrame(AVFrame *frame,
+        int encodeAudioFrame(AVFrame *frame,
                                       AVFormatContext *outputFormatContext,
                                       AVCodecContext *outputCodecContext,
                                       int *dataPresent);
 
-        static int loadEncodeAndWrite(AVAudioFifo *fifo,
+        int loadEncodeAndWrite(AVAudioFifo *fifo,
                                          AVFormatContext *outputFormatContext,
-                                         AVCodecContext *outputCodecContext);
+                                         AVCodecContext *outputCodecContext,
+                                         int finished);
+
+        int writeOutputFileTrailer(AVFormatContext *outputFormatContext);
+
+        int flushEncoder(AVFormatContext *outputFormatContext,
+                         AVCodecContext *outputCodecContext);
+
+        int processSequential(AVFormatContext *inputFormatContext,
+                              AVCodecContext *inputCodecContext,
+                              AVFormatContext *outputFormatContext,
+                              AVCodecContext *outputCodecContext,
+                              SwrContext *resampleContext,
+                              AVAudioFifo *fifo);
+
+        int processPipelined(AVFormatContext *inputFormatContext,
+                             AVCodecContext *inputCodecContext,
+                             AVFormatContext *outputFormatContext,
+                             AVCodecContext *outputCodecContext,
+                             SwrContext *resampleContext,
+                             AVAudioFifo *fifo);
+
+        void runDecodeStage(PipelineState *state);
+
+        void runResampleStage(PipelineState *state);
+
+        int flushConvertedFrame(PipelineState *state);
+
+        int runEncodeStage(PipelineState *state);
+
+        int processSegmented(AVFormatContext *inputFormatContext,
+                             AVCodecContext *inputCodecContext,
+                             AVFormatContext *outputFormatContext,
+                             AVCodecContext *outputCodecContext,
+                             SwrContext *resampleContext,
+                             AVAudioFifo *fifo);
+
+        int encodeSegment(SegmentJob *job);
+
+        int transcodeRange(AVFormatContext *inputFormatContext,
+                           AVCodecContext *inputCodecContext,
+                           AVFormatContext *outputFormatContext,
+                           AVCodecContext *outputCodecContext,
+                           SwrContext *resampleContext,
+                           AVAudioFifo *fifo,
+                           int64_t first, int64_t last);
+
+        int storeRangeSamples(AVFrame *frame, int64_t position,
+                              int64_t last, int64_t *written,
+                              AVFormatContext *outputFormatContext,
+                              AVCodecContext *outputCodecContext,
+                              SwrContext *resampleContext,
+                              AVAudioFifo *fifo);
+
+        int storeSegmentPacket(AVPacket *packet,
+                               AVCodecContext *outputCodecContext);
+
+        int processFanOut(AVFormatContext *inputFormatContext,
+                          AVCodecContext *inputCodecContext);
+
+        int convertAndDistribute(FanOutGroup *group, AVFrame *input,
+                                 const std::atomic<bool> &abort);
+
+        int runRendition(FanOutRendition *rendition);
 
-        static int writeOutputFileTrailer(AVFormatContext *outputFormatContext);
+        int addCopiedStreams(AVFormatContext *inputFormatContext,
+                             AVFormatContext *outputFormatContext);
+
+        int copyPacket(AVFormatContext *inputFormatContext, AVPacket *packet);
+
+        int writeAudioPacket(AVFormatContext *outputFormatContext,
+                             AVCodecContext *outputCodecContext,
+                             AVPacket *packet);
+
+        static bool canRemux(const OutputSpec &spec, int sampleRate,
+                             const AVCodecParameters *parameters);
+
+        int processRemux(AVFormatContext *inputFormatContext);
+
+        int64_t prepareCheckpoints(const OutputSpec &spec, int sampleRate,
+                                   AVCodecContext *inputCodecContext);
+
+        int saveCheckpoint(AVFormatContext *outputFormatContext,
+                           AVCodecContext *outputCodecContext,
+                           int64_t position);
+
+        void fragmentOptions(const AVFormatContext *outputFormatContext,
+                             AVDictionary **muxerOptions);
+
+        int flushFragment(AVFormatContext *outputFormatContext,
+                          int64_t position, int sampleRate);
+
+        bool fetchCachedOutputs();
+
+        void storeCachedOutputs();
+
+        int processTrimmed(AVFormatContext *inputFormatContext,
+                           AVCodecContext *inputCodecContext,
+                           AVFormatContext *outputFormatContext,
+                           AVCodecContext *outputCodecContext,
+                           SwrContext *resampleContext,
+                           AVAudioFifo *fifo);
+
+        int processResumed(AVFormatContext *inputFormatContext,
+                           AVCodecContext *inputCodecContext,
+                           AVFormatContext *outputFormatContext,
+                           AVCodecContext *outputCodecContext,
+                           SwrContext *resampleContext,
+                           AVAudioFifo *fifo);
+
+        int spillInput(AVFormatContext *inputFormatContext,
+                       AVCodecContext *inputCodecContext,
+                       AVCodecContext *floatCodecContext,
+                       SwrContext *resampleContext,
+                       SampleSpill *spill, AudioAnalyzer *meter);
+
+        int encodeSpill(SampleSpill *spill, float gain,
+                        AVCodecContext *floatCodecContext,
+                        AVFormatContext *outputFormatContext,
+                        AVCodecContext *outputCodecContext,
+                        SwrContext *resampleContext, AVAudioFifo *fifo);
+
+        int processNormalized(AVFormatContext *inputFormatContext,
+                              AVCodecContext *inputCodecContext,
+                              AVFormatContext *outputFormatContext,
+                              AVCodecContext *outputCodecContext,
+                              AVAudioFifo *fifo);
+
+        TranscoderOptions options;
 
         const char * inputFile;
-        const char * outputFile;
+        /* Renditions to be produced, more than one for a fan-out run. */
+        QList<OutputSpec> outputs;
+        /* Timestamp for the audio frames of the output file. */
+        int64_t pts;
+        /* Segment being encoded by this instance in segmented mode. */
+        SegmentJob *segment;
+        /* Packets, frames and sample buffers reused between frames. */
+        FramePool pool;
+        std::atomic<bool> cancelled;
+        /* Instance whose cancellation also stops this worker instance. */
+        const Transcoder *owner;
+        /* Input position in us the next progress report is due at. */
+        int64_t nextProgress;
+        /* Index of the input stream being decoded. */
+        int inputStreamIndex;
+        /* Output the other input streams are copied into, or nullptr. */
+        AVFormatContext *copyOutput;
+        /* Output stream of every input stream, -1 if it is not copied. */
+        QVector<int> streamMap;
+        /* Capacity of the FIFO buffers grown by this instance, as charged
+         * to the MemoryAccount. */
+        int64_t fifoBytes;
+        /* Performs the conversion of one resampler if it only has to
+         * downmix float planar samples. */
+        Downmix downmix;
+        /* What open() has opened for run(); the input of a fan-out run
+         * only, and nothing but the input if its packets are copied. */
+        std::unique_ptr<MappedInput> mapping;
+        InputFormatHandle inputFormat;
+        CodecContextHandle inputCodec;
+        OutputFormatHandle outputFormat;
+        CodecContextHandle outputCodec;
+        ResamplerHandle resampler;
+        FifoHandle outputFifo;
+        /* The audio packets of the opened input are copied by run(). */
+        bool remuxing;
+        /* Progress of the run as last saved to checkpointFile. */
+        Checkpoint checkpoint;
+        QString checkpointFile;
+        /* Output sample position the next checkpoint is due at, -1 if the
+         * run saves none. */
+        int64_t nextCheckpoint;
+        /* Output time in us the pending fragment is flushed at. */
+        int64_t nextFragment;
+        /* Output sample position a resumed run continues at, 0 if the run
+         * starts at the beginning. */
+        int64_t resumePosition;
+        /* The outputs have been taken from the result cache by open(). */
+        bool fromCache;
+        /* Result cache keys of the outputs, to store them under. */
+        QList<QByteArray> cacheKeys;
+        /* Taps the frames handed to the encoder if analysis files are
+         * written for the output. */
+        std::unique_ptr<AudioAnalyzer> analyzer;
 };
+
+#endif
@@ -0,0 +1,458 @@
+#include "transcodeservice.h"
+
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QLocalSocket>
+#include <QMutexLocker>
+#include <QRunnable>
+#include <QTcpSocket>
+
+/* Runs the most urgent queued job of the service on a pool thread. */
+class ServiceTask : public QRunnable
+{
+    public:
+        explicit ServiceTask(TranscodeService *service)
+            : service(service)
+        {
+        }
+
+        void run() override
+        {
+            service->runNext();
+        }
+
+    private:
+        TranscodeService *service;
+};
+
+TranscodeService::TranscodeService(int threadCount,
+                                   const TranscoderOptions &options,
+                                   QObject *parent)
+    : QObject(parent), options(options), nextId(1)
+{
+    if (!this->options.codecCache)
+        this->options.codecCache = &codecCache;
+    if (!this->options.metrics)
+        this->options.metrics = &metrics;
+    pool.setMaxThreadCount(threadCount > 0 ? threadCount : 1);
+    /* The jobs running at the same time share the cores among their
+     * codecs instead of each one spawning a thread per core. */
+    if (this->options.codecThreads <= 0)
+        this->options.codecThreads =
+            Transcoder::codecThreadShare(this->options, pool.maxThreadCount());
+    /* Keep the workers warm for the next job. */
+    pool.setExpiryTimeout(-1);
+    connect(&server, &QLocalServer::newConnection,
+            this, &TranscodeService::acceptConnection);
+    connect(&metricsServer, &QTcpServer::newConnection,
+            this, &TranscodeService::acceptMetricsConnection);
+}
+
+TranscodeService::~TranscodeService()
+{
+    {
+        QMutexLocker locker(&mutex);
+
+        for (auto it = jobs.begin(); it != jobs.end(); ++it) {
+            ServiceJob &job = it.value();
+
+            if (job.state == ServiceJobState::Queued)
+                job.state = ServiceJobState::Cancelled;
+            job.cancelRequested = true;
+            if (job.transcoder)
+                job.transcoder->cancel();
+        }
+    }
+    pool.waitForDone();
+}
+
+/**
+ * Start accepting requests on a local socket.
+ * A stale socket left behind by an earlier instance is removed.
+ * @param name Name or path of the socket
+ * @return true if the service is listening
+ */
+bool TranscodeService::listen(const QString &name)
+{
+    QLocalServer::removeServer(name);
+    if (!server.listen(name)) {
+        fprintf(stderr, "Could not listen on '%s': %s\n",
+                name.toLocal8Bit().constData(),
+                server.errorString().toLocal8Bit().constData());
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Serve the metrics of the jobs in the Prometheus text format over HTTP.
+ * Every request is answered with the metrics, whatever its path.
+ * @param port TCP port to listen on, on all interfaces
+ * @return true if the service is listening
+ */
+bool TranscodeService::listenMetrics(quint16 port)
+{
+    if (!metricsServer.listen(QHostAddress::Any, port)) {
+        fprintf(stderr, "Could not listen on port %d: %s\n", port,
+                metricsServer.errorString().toLocal8Bit().constData());
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Queue a job.
+ * @param input    File to be transcoded
+ * @param outputs  Outputs to be produced from it
+ * @param priority Priority among the queued jobs
+ * @return Id of the job
+ */
+int TranscodeService::submit(const QString &input,
+                             const QList<OutputSpec> &outputs, int priority)
+{
+    int id;
+
+    {
+        QMutexLocker locker(&mutex);
+        ServiceJob job;
+
+        job.id       = id = nextId++;
+        job.input    = input;
+        job.outputs  = outputs;
+        job.priority = priority;
+        jobs.insert(id, job);
+    }
+    /* Every task runs whichever job is the most urgent when it starts. */
+    pool.start(new ServiceTask(this));
+    return id;
+}
+
+/**
+ * Cancel a job. A queued job is dropped, a running one stopped.
+ * @param id Id of the job
+ * @return true if the job exists and has not ended yet
+ */
+bool TranscodeService::cancel(int id)
+{
+    QMutexLocker locker(&mutex);
+    auto it = jobs.find(id);
+
+    if (it == jobs.end())
+        return false;
+    ServiceJob &job = it.value();
+    if (job.state == ServiceJobState::Queued) {
+        job.state = ServiceJobState::Cancelled;
+        return true;
+    }
+    if (job.state != ServiceJobState::Running)
+        return false;
+    job.cancelRequested = true;
+    if (job.transcoder)
+        job.transcoder->cancel();
+    return true;
+}
+
+/**
+ * Change the priority of a queued job.
+ * @param id       Id of the job
+ * @param priority New priority
+ * @return true if the job is still queued
+ */
+bool TranscodeService::setPriority(int id, int priority)
+{
+    QMutexLocker locker(&mutex);
+    auto it = jobs.find(id);
+
+    if (it == jobs.end() || it.value().state != ServiceJobState::Queued)
+        return false;
+    it.value().priority = priority;
+    return true;
+}
+
+/**
+ * Describe a job.
+ * @param      id     Id of the job
+ * @param[out] status Description of the job
+ * @return true if the job is known
+ */
+bool TranscodeService::status(int id, QJsonObject *status) const
+{
+    QMutexLocker locker(&mutex);
+    auto it = jobs.constFind(id);
+
+    if (it == jobs.constEnd())
+        return false;
+    *status = describe(it.value());
+    return true;
+}
+
+/**
+ * Run the queued job with the highest priority, the oldest one among
+ * equals, on the calling thread.
+ */
+void TranscodeService::runNext()
+{
+    QList<OutputSpec> outputs;
+    QByteArray input;
+    ServiceJob *next = nullptr;
+    int id;
+
+    {
+        QMutexLocker locker(&mutex);
+
+        for (auto it = jobs.begin(); it != jobs.end(); ++it)
+            if (it.value().state == ServiceJobState::Queued &&
+                (!next || it.value().priority > next->priority))
+                next = &it.value();
+        /* The job of this task has been cancelled while it was queued. */
+        if (!next)
+            return;
+        next->state = ServiceJobState::Running;
+        id          = next->id;
+        input       = next->input.toLocal8Bit();
+        outputs     = next->outputs;
+    }
+
+    Transcoder transcoder(input.constData(), outputs, options);
+
+    /* Progress is reported on this thread, so it is stored directly. */
+    connect(&transcoder, &Transcoder::progress,
+            [this, id](qint64 position, qint64 duration) {
+        QMutexLocker locker(&mutex);
+        ServiceJob &job = jobs[id];
+
+        job.position = position;
+        job.duration = duration;
+    });
+    {
+        QMutexLocker locker(&mutex);
+
+        jobs[id].transcoder = &transcoder;
+        if (jobs[id].cancelRequested)
+            transcoder.cancel();
+    }
+
+    const int error = transcoder.processInput();
+
+    QMutexLocker locker(&mutex);
+    ServiceJob &job = jobs[id];
+
+    job.transcoder = nullptr;
+    job.error      = error;
+    if (job.cancelRequested)
+        job.state = ServiceJobState::Cancelled;
+    else
+        job.state = error < 0 ? ServiceJobState::Failed : ServiceJobState::Finished;
+    if (job.state == ServiceJobState::Finished)
+        job.position = job.duration;
+    pruneHistory();
+}
+
+/* Read the requests of a new client as they arrive. */
+void TranscodeService::acceptConnection()
+{
+    while (server.hasPendingConnections()) {
+        QLocalSocket *socket = server.nextPendingConnection();
+
+        connect(socket, &QLocalSocket::readyRead, this, [this, socket]() {
+            while (socket->canReadLine()) {
+                const QByteArray line = socket->readLine().trimmed();
+                QJsonParseError parseError;
+                QJsonDocument document;
+                QJsonObject response;
+
+                if (line.isEmpty())
+                    continue;
+                document = QJsonDocument::fromJson(line, &parseError);
+                if (!document.isObject()) {
+                    response.insert("ok", false);
+                    response.insert("error", QString("Invalid request"));
+                } else {
+                    response = handleRequest(document.object());
+                }
+                socket->write(QJsonDocument(response).toJson(QJsonDocument::Compact));
+                socket->write("\n");
+            }
+        });
+        connect(socket, &QLocalSocket::disconnected,
+                socket, &QObject::deleteLater);
+    }
+}
+
+/* Answer a scrape once its request header is complete. */
+void TranscodeService::acceptMetricsConnection()
+{
+    while (metricsServer.hasPendingConnections()) {
+        QTcpSocket *socket = metricsServer.nextPendingConnection();
+
+        connect(socket, &QTcpSocket::readyRead, this, [this, socket]() {
+            QByteArray body;
+
+            /* The request itself does not matter, only its end does. */
+            while (socket->canReadLine())
+                if (socket->readLine().trimmed().isEmpty())
+                    body = options.metrics->prometheus();
+            if (body.isNull())
+                return;
+            socket->write("HTTP/1.0 200 OK\r\n"
+                          "Content-Type: text/plain; version=0.0.4\r\n"
+                          "Content-Length: " + QByteArray::number(body.size()) +
+                          "\r\n\r\n" + body);
+            socket->disconnectFromHost();
+        });
+        connect(socket, &QTcpSocket::disconnected,
+                socket, &QObject::deleteLater);
+    }
+}
+
+/**
+ * Answer one request of a client.
+ * @param request Request as sent by the client
+ * @return Response to be sent back
+ */
+QJsonObject TranscodeService::handleRequest(const QJsonObject &request)
+{
+    const QString command = request.value("command").toString();
+    const int id = request.value("id").toInt();
+    QJsonObject response;
+    bool ok;
+
+    if (command == "submit")
+        return handleSubmit(request);
+
+    if (command == "status" && !request.contains("id")) {
+        QMutexLocker locker(&mutex);
+        QJsonArray list;
+
+        for (auto it = jobs.constBegin(); it != jobs.constEnd(); ++it)
+            list.append(describe(it.value()));
+        response.insert("jobs", list);
+        ok = true;
+    } else if (command == "status") {
+        QJsonObject job;
+
+        if ((ok = status(id, &job)))
+            response.insert("job", job);
+    } else if (command == "cancel") {
+        ok = cancel(id);
+    } else if (command == "priority") {
+        ok = setPriority(id, request.value("priority").toInt());
+    } else if (command == "metrics") {
+        response.insert("metrics", options.metrics->json());
+        ok = true;
+    } else {
+        response.insert("ok", false);
+        response.insert("error", QString("Unknown command '%1'").arg(command));
+        return response;
+    }
+
+    response.insert("ok", ok);
+    if (!ok)
+        response.insert("error", QString("No such job or not applicable to it"));
+    return response;
+}
+
+/**
+ * Queue the job of a submit request. Besides "output", the request may
+ * list further outputs as "renditions", each an object with "path" and
+ * optionally "codec", "bitrate", "channels" and "rate".
+ * @param request Submit request
+ * @return Response with the id of the job
+ */
+QJsonObject TranscodeService::handleSubmit(const QJsonObject &request)
+{
+    const QString input = request.value("input").toString();
+    QList<OutputSpec> outputs;
+    QJsonObject response;
+
+    if (request.contains("output")) {
+        OutputSpec spec;
+
+        spec.path = request.value("output").toString();
+        outputs.append(spec);
+    }
+    for (const QJsonValue &value : request.value("renditions").toArray()) {
+        OutputSpec spec;
+
+        if (!parseOutput(value.toObject(), &spec)) {
+            response.insert("ok", false);
+            response.insert("error", QString("Invalid rendition"));
+            return response;
+        }
+        outputs.append(spec);
+    }
+    if (input.isEmpty() || outputs.isEmpty()) {
+        response.insert("ok", false);
+        response.insert("error", QString("An input and an output are required"));
+        return response;
+    }
+
+    response.insert("ok", true);
+    response.insert("id", submit(input, outputs, request.value("priority").toInt()));
+    return response;
+}
+
+/**
+ * Read the settings of one output of a submit request.
+ * @param      object Output as sent by the client
+ * @param[out] spec   Output settings
+ * @return true if the output is valid
+ */
+bool TranscodeService::parseOutput(const QJsonObject &object, OutputSpec *spec)
+{
+    spec->path       = object.value("path").toString();
+    spec->codec      = object.value("codec").toString();
+    spec->bitRate    = object.value("bitrate").toInt(OUTPUT_BIT_RATE);
+    spec->channels   = object.value("channels").toInt(OUTPUT_CHANNELS);
+    spec->sampleRate = object.value("rate").toInt(0);
+    return !spec->path.isEmpty() && spec->bitRate > 0 && spec->channels > 0 &&
+           spec->sampleRate >= 0;
+}
+
+QJsonObject TranscodeService::describe(const ServiceJob &job)
+{
+    QJsonObject status;
+
+    status.insert("id", job.id);
+    status.insert("input", job.input);
+    status.insert("state", QString(stateName(job.state)));
+    status.insert("priority", job.priority);
+    status.insert("position_us", job.position);
+    status.insert("duration_us", job.duration);
+    if (job.duration > 0)
+        status.insert("progress", (double)job.position / job.duration);
+    if (job.state == ServiceJobState::Failed)
+        status.insert("error", job.error);
+    return status;
+}
+
+const char *TranscodeService::stateName(ServiceJobState state)
+{
+    switch (state) {
+    case ServiceJobState::Queued:
+        return "queued";
+    case ServiceJobState::Running:
+        return "running";
+    case ServiceJobState::Finished:
+        return "finished";
+    case ServiceJobState::Failed:
+        return "failed";
+    case ServiceJobState::Cancelled:
+        return "cancelled";
+    default:
+        return "unknown";
+    }
+}
+
+/* Forget the oldest ended jobs beyond SERVICE_JOB_HISTORY. */
+void TranscodeService::pruneHistory()
+{
+    QList<int> ended;
+
+    for (auto it = jobs.constBegin(); it != jobs.constEnd(); ++it)
+        if (it.value().state != ServiceJobState::Queued &&
+            it.value().state != ServiceJobState::Running)
+            ended.append(it.key());
+    for (int i = 0; i < ended.size() - SERVICE_JOB_HISTORY; i++)
+        jobs.remove(ended.at(i));
+}
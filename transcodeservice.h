@@ -0,0 +1,119 @@
+#ifndef TRANSCODESERVICE_H
+#define TRANSCODESERVICE_H
+
+#include <QJsonObject>
+#include <QList>
+#include <QLocalServer>
+#include <QMap>
+#include <QMutex>
+#include <QObject>
+#include <QString>
+#include <QTcpServer>
+#include <QThreadPool>
+
+#include "transcoder.h"
+
+/* The number of finished jobs whose status is kept */
+#define SERVICE_JOB_HISTORY 1000
+
+/* Life cycle of a job submitted to the service. */
+enum class ServiceJobState
+{
+    Queued,
+    Running,
+    Finished,
+    Failed,
+    Cancelled
+};
+
+/* One job of the service and its last known state. */
+struct ServiceJob
+{
+    int id = 0;
+    QString input;
+    QList<OutputSpec> outputs;
+    /* Queued jobs with a higher priority are started first. */
+    int priority = 0;
+    ServiceJobState state = ServiceJobState::Queued;
+    bool cancelRequested = false;
+    /* Progress in us, as reported by Transcoder::progress. */
+    qint64 position = 0;
+    qint64 duration = 0;
+    int error = 0;
+    /* Transcoder of the job while it is running. */
+    Transcoder *transcoder = nullptr;
+};
+
+/**
+ * Resident transcoding service.
+ * Jobs are submitted through a local socket, one JSON request per line,
+ * and answered with one JSON line each:
+ *
+ *     {"command": "submit", "input": "in.mp3", "output": "out.mp4", "priority": 1}
+ *     {"command": "status", "id": 1}
+ *     {"command": "cancel", "id": 1}
+ *     {"command": "priority", "id": 1, "priority": 5}
+ *     {"command": "metrics"}
+ *
+ * The jobs run on a pool of threads that are kept alive between jobs, and
+ * share one cache of opened codec contexts. Their metrics can also be
+ * scraped by Prometheus over HTTP, see listenMetrics().
+ */
+class TranscodeService : public QObject
+{
+    Q_OBJECT
+
+    public:
+        TranscodeService(int threadCount, const TranscoderOptions &options,
+                         QObject *parent = nullptr);
+        ~TranscodeService();
+
+        bool listen(const QString &name);
+
+        bool listenMetrics(quint16 port);
+
+        int submit(const QString &input, const QList<OutputSpec> &outputs,
+                   int priority);
+
+        bool cancel(int id);
+
+        bool setPriority(int id, int priority);
+
+        bool status(int id, QJsonObject *status) const;
+
+        void runNext();
+
+    private slots:
+        void acceptConnection();
+
+        void acceptMetricsConnection();
+
+    private:
+        TranscodeService(const TranscodeService &) = delete;
+        TranscodeService &operator=(const TranscodeService &) = delete;
+
+        QJsonObject handleRequest(const QJsonObject &request);
+
+        QJsonObject handleSubmit(const QJsonObject &request);
+
+        static bool parseOutput(const QJsonObject &object, OutputSpec *spec);
+
+        static QJsonObject describe(const ServiceJob &job);
+
+        static const char *stateName(ServiceJobState state);
+
+        void pruneHistory();
+
+        /* Declared before the pool so that they outlive the jobs. */
+        CodecContextCache codecCache;
+        TranscodeMetrics metrics;
+        TranscoderOptions options;
+        QLocalServer server;
+        QTcpServer metricsServer;
+        mutable QMutex mutex;
+        QMap<int, ServiceJob> jobs;
+        int nextId;
+        QThreadPool pool;
+};
+
+#endif
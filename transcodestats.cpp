@@ -0,0 +1,55 @@
+#include "transcodestats.h"
+
+TranscodeStats::TranscodeStats()
+{
+    reset();
+}
+
+/**
+ * Account for one measurement of a stage.
+ * @param stage        Measured stage
+ * @param nanoseconds  Time spent in the stage
+ */
+void TranscodeStats::add(TranscodeStage stage, int64_t nanoseconds)
+{
+    times[(int)stage].fetch_add(nanoseconds, std::memory_order_relaxed);
+    counts[(int)stage].fetch_add(1, std::memory_order_relaxed);
+}
+
+int64_t TranscodeStats::nanoseconds(TranscodeStage stage) const
+{
+    return times[(int)stage].load(std::memory_order_relaxed);
+}
+
+int64_t TranscodeStats::calls(TranscodeStage stage) const
+{
+    return counts[(int)stage].load(std::memory_order_relaxed);
+}
+
+void TranscodeStats::reset()
+{
+    for (int i = 0; i < (int)TranscodeStage::Count; i++) {
+        times[i].store(0, std::memory_order_relaxed);
+        counts[i].store(0, std::memory_order_relaxed);
+    }
+}
+
+const char *TranscodeStats::stageName(TranscodeStage stage)
+{
+    switch (stage) {
+    case TranscodeStage::Decode:
+        return "decode";
+    case TranscodeStage::Convert:
+        return "convert";
+    case TranscodeStage::Fifo:
+        return "fifo";
+    case TranscodeStage::Encode:
+        return "encode";
+    case TranscodeStage::Write:
+        return "write";
+    case TranscodeStage::Analyze:
+        return "analyze";
+    default:
+        return "unknown";
+    }
+}
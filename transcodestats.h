@@ -0,0 +1,100 @@
+#ifndef TRANSCODESTATS_H
+#define TRANSCODESTATS_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+/* Stages of the transcoding loop whose time is measured. */
+enum class TranscodeStage
+{
+    /* Demuxing and decoding, decodeAudioFrame. */
+    Decode,
+    /* Sample format and rate conversion, convertSamples. */
+    Convert,
+    /* Storing samples in and loading them from the FIFO buffer. */
+    Fifo,
+    /* Sending frames to and receiving packets from the encoder. */
+    Encode,
+    /* Muxing the encoded packets, av_write_frame. */
+    Write,
+    /* Measuring the frames handed to the encoder, AudioAnalyzer. */
+    Analyze,
+    Count
+};
+
+/**
+ * Time spent per stage by one or several transcoding runs.
+ * The counters may be updated from several threads at once. The times of
+ * stages running concurrently add up, so that their sum can exceed the
+ * wall clock time of a multi-threaded engine.
+ */
+class TranscodeStats
+{
+    public:
+        TranscodeStats();
+
+        void add(TranscodeStage stage, int64_t nanoseconds);
+
+        int64_t nanoseconds(TranscodeStage stage) const;
+
+        int64_t calls(TranscodeStage stage) const;
+
+        void reset();
+
+        static const char *stageName(TranscodeStage stage);
+
+    private:
+        TranscodeStats(const TranscodeStats &) = delete;
+        TranscodeStats &operator=(const TranscodeStats &) = delete;
+
+        std::atomic<int64_t> times[(int)TranscodeStage::Count];
+        std::atomic<int64_t> counts[(int)TranscodeStage::Count];
+};
+
+/**
+ * Measures stages for a TranscodeStats, doing nothing without one.
+ * A running measurement is stopped at the latest when the timer goes
+ * out of scope.
+ */
+class StageTimer
+{
+    public:
+        explicit StageTimer(TranscodeStats *stats)
+            : stats(stats), stage(TranscodeStage::Count)
+        {
+        }
+
+        ~StageTimer()
+        {
+            stop();
+        }
+
+        void start(TranscodeStage stage)
+        {
+            if (!stats)
+                return;
+            stop();
+            this->stage = stage;
+            begin = std::chrono::steady_clock::now();
+        }
+
+        void stop()
+        {
+            if (!stats || stage == TranscodeStage::Count)
+                return;
+            stats->add(stage, std::chrono::duration_cast<std::chrono::nanoseconds>(
+                           std::chrono::steady_clock::now() - begin).count());
+            stage = TranscodeStage::Count;
+        }
+
+    private:
+        StageTimer(const StageTimer &) = delete;
+        StageTimer &operator=(const StageTimer &) = delete;
+
+        TranscodeStats *stats;
+        TranscodeStage stage;
+        std::chrono::steady_clock::time_point begin;
+};
+
+#endif